@@ -25,6 +25,9 @@
 ;
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* cpu affinity */
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -33,7 +36,10 @@
 #include <assert.h>
 #include <sched.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <time.h>
+#include <errno.h>
+#include <limits.h>
 
 #ifdef __linux__
 #include <syscall.h>
@@ -43,6 +49,7 @@
 #endif
 
 #include "list.h"
+#include "llist.h"
 #include "inception_arch.h"
 
 #define DREAM_INCEPTION_TARGET 0x1
@@ -52,8 +59,11 @@
 #define DREAM_SHAPES_FAKER 0x10
 #define DREAM_SEDATIVE_CREATOR 0x20
 #define DREAM_OVERLOOKER 0x40
-#define DREAM_ROLE_MASK 0x7f
-#define DREAMERS (0x7)
+#define DREAM_PROJECTION 0x80 /* Fischers projections. Any number of them */
+#define DREAM_ROLE_MASK 0xff
+#define DREAM_ROLES (8) /* one bit per role */
+#define DREAM_ROLE_INDEX(role) __builtin_ctz((role) & DREAM_ROLE_MASK)
+#define DREAMERS (0x7) /* the cast. Projections are extras on top of it */
 
 /*
  * fprintf output buffer is thread-safe anyway. So don't care much
@@ -61,6 +71,25 @@
 #define output(fmt, arg...) do { fprintf(stdout, fmt, ##arg);} while(0)
 
 #define DREAM_LEVELS (0x3 + 1 ) /* + 1 as an illustrative considering the 4th is really a limbo from 3rd */
+#define DREAM_LEVELS_MAX (64) /* deepest dream. Limbo is always the deepest level */
+
+#define DREAM_CACHE_LINE (64)
+#define DREAM_REQUEST_MAGAZINE (32) /* requests moved between a thread cache and the depot at a time */
+#define DREAM_REQUEST_SLAB (1024) /* requests carved out of the heap at a time */
+
+/*
+ * Completion handle of a synchronous request. It lives with the caller waiting on it.
+ * The dreamer handling the request fulfills it with a reply and the caller wakes up
+ * as soon as the reply lands. A request freed without a reply completes its future with
+ * no reply. So every future is completed exactly once.
+ */
+struct dream_future
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int done;
+    void *reply;
+};
 
 struct dreamer_request
 {
@@ -79,31 +108,187 @@ struct dreamer_request
 #define DREAMER_FALL (0x1000)
 #define DREAMER_SYNCHRONIZE_KICK (0x2000)
 #define DREAMER_RECOVER (0x4000)
+#define DREAMER_CMDS (15) /* one bit per request command */
 
     struct dreamer_attr *dattr; /*dreamer attribute*/
     int cmd; /* request cmd */
     void *arg; /* request cmd arg*/
+    int coalesce; /* owns the coalescing slot of its command in the mailbox */
+    int merged; /* repeated enqueues were merged into this request */
+    int periodic; /* re-sent by a periodic timer. The drop policies only drop these */
+    struct dream_future *future; /* caller waiting for the reply of a synchronous request */
+    struct llist_node mailbox; /* lock-less mailbox inbox marker. request cache marker when free */
     struct list list; /* list head marker*/
+} __attribute__((aligned(DREAM_CACHE_LINE)));
+
+/*
+ * Mailbox priority lanes. Commands of the control lane are delivered ahead of
+ * the data commands queued before them.
+ */
+#define DREAM_LANE_CONTROL (0)
+#define DREAM_LANE_DATA (1)
+#define DREAM_LANES (2)
+
+/*
+ * What a producer does when the mailbox of a bounded dreamer is full.
+ * A blocked producer waits for room up to the level period of the dreamer
+ * and then queues anyway as the dreamer could be itself or waiting on the producer.
+ * The drop policies only apply to the copies of a command re-sent by a periodic timer.
+ * A command sent once blocks instead, as the storyline waits on every one of them.
+ */
+#define DREAM_OVERFLOW_BLOCK (0)
+#define DREAM_OVERFLOW_FAIL (1) /* enqueue returns -1 */
+#define DREAM_OVERFLOW_DROP_OLDEST (2) /* the dreamer drops its oldest request of the command class */
+#define DREAM_OVERFLOW_DROP_NEWEST (3) /* the new request is dropped */
+#define DREAM_OVERFLOW_POLICIES (4)
+
+#define DREAM_SEND_PERIODIC (0x1) /* re-sent by a periodic timer. The drop policies apply */
+#define DREAM_SEND_NOWAIT (0x2) /* fail instead of blocking on a full mailbox */
+#define DREAM_SEND_FORCE (0x4) /* queue beyond the capacity as a blocked send timing out does */
+
+static const char *dream_overflow_names[DREAM_OVERFLOW_POLICIES] = {
+    "blocked", "failed", "dropped oldest", "dropped newest",
+};
+
+/*
+ * Per command class table indexed by the command bit.
+ * A coalescable command sent again by the same sender (the command arg) while the previous one
+ * is still queued is merged into the queued request instead of being appended, and dispatched once.
+ * Only the commands whose handlers set a state, so a repeat has no effect of its own, are coalescable.
+ */
+#define DREAM_CMD_COALESCE (0x1)
+
+struct dream_cmd_class
+{
+    int cmd;
+    const char *name;
+    int lane;
+    int flags;
+    int overflow; /* overflow policy */
+};
+
+static struct dream_cmd_class dream_cmd_classes[DREAMER_CMDS] = {
+    { DREAMER_HIJACKED, "HIJACKED", DREAM_LANE_DATA, 0, DREAM_OVERFLOW_BLOCK },
+    { DREAMER_DEFENSE_PROJECTIONS, "DEFENSE_PROJECTIONS", DREAM_LANE_DATA, 0, DREAM_OVERFLOW_BLOCK },
+    { DREAMER_FREE_FALL, "FREE_FALL", DREAM_LANE_DATA, 0, DREAM_OVERFLOW_BLOCK },
+    { DREAMER_FAKE_SHAPE, "FAKE_SHAPE", DREAM_LANE_DATA, DREAM_CMD_COALESCE, DREAM_OVERFLOW_DROP_OLDEST },
+    { DREAMER_SHOT, "SHOT", DREAM_LANE_DATA, 0, DREAM_OVERFLOW_BLOCK },
+    { DREAMER_KILLED, "KILLED", DREAM_LANE_DATA, 0, DREAM_OVERFLOW_BLOCK },
+    { DREAMER_NEXT_LEVEL, "NEXT_LEVEL", DREAM_LANE_CONTROL, 0, DREAM_OVERFLOW_BLOCK },
+    { DREAMER_IN_LIMBO, "IN_LIMBO", DREAM_LANE_DATA, 0, DREAM_OVERFLOW_BLOCK },
+    { DREAMER_IN_MY_DREAM, "IN_MY_DREAM", DREAM_LANE_DATA, 0, DREAM_OVERFLOW_BLOCK },
+    { DREAMER_KICK_BACK, "KICK_BACK", DREAM_LANE_CONTROL, 0, DREAM_OVERFLOW_BLOCK },
+    { DREAMER_FIGHT, "FIGHT", DREAM_LANE_DATA, 0, DREAM_OVERFLOW_DROP_OLDEST },
+    { DREAMER_SELF, "SELF", DREAM_LANE_DATA, 0, DREAM_OVERFLOW_BLOCK },
+    { DREAMER_FALL, "FALL", DREAM_LANE_DATA, 0, DREAM_OVERFLOW_BLOCK },
+    { DREAMER_SYNCHRONIZE_KICK, "SYNCHRONIZE_KICK", DREAM_LANE_CONTROL, 0, DREAM_OVERFLOW_BLOCK },
+    { DREAMER_RECOVER, "RECOVER", DREAM_LANE_DATA, DREAM_CMD_COALESCE, DREAM_OVERFLOW_DROP_NEWEST },
+};
+
+static struct dream_mailbox_stats
+{
+    unsigned long merged[DREAMER_CMDS]; /* enqueues merged into a queued request */
+    unsigned long overflow[DREAM_OVERFLOW_POLICIES]; /* enqueues that found the mailbox full */
+    unsigned long block_timeouts; /* blocked enqueues queued beyond the capacity */
+    unsigned long closed; /* requests reclaimed from the mailboxes of the dreamers gone */
+} dream_mailbox_stats;
+
+static int dream_mailbox_capacity; /* capacity of the dreamer mailboxes. 0 for unbounded */
+
+static __inline__ struct dream_cmd_class *dream_cmd_class(int cmd)
+{
+    assert(cmd && !(cmd & (cmd - 1)) && cmd < (1 << DREAMER_CMDS));
+    return &dream_cmd_classes[__builtin_ctz(cmd)];
+}
+
+static __inline__ int dream_cmd_lane(int cmd)
+{
+    return dream_cmd_class(cmd)->lane;
+}
+
+/*
+ * Multi producer, single consumer mailbox with one inbox per priority lane.
+ * Producers push into the inbox of the command lane without a lock.
+ * Only the dreamer owning the mailbox moves the inboxes into its private pending FIFOs.
+ */
+struct dreamer_mailbox
+{
+    struct llist_head inbox[DREAM_LANES]; /* lock-less LIFOs pushed by the producers */
+    struct list_head pending[DREAM_LANES]; /* consumer private FIFOs of fetched requests */
+    unsigned long coalesce[DREAMER_CMDS]; /* sender of the queued request owning the slot. 0 if free */
+    int capacity; /* max requests queued. 0 for unbounded */
+    int depth; /* requests queued and not yet dequeued */
+    int high_water; /* max depth seen */
+    int overflow[DREAMER_CMDS]; /* requests owed to the drop oldest policy per command class */
+    int waiters; /* producers blocked for room */
+    int closed; /* the dreamer left its level. The requests sent to it are reclaimed by the senders */
+    pthread_cond_t room; /* signalled under the dreamer mutex when room is made for the blocked producers */
 };
 
 struct dreamer_attr
 {
     const char *name;
     int role;
-    int shared_state; /* shared request command state*/
+    int id; /* interned dreamer id. Same for the dreamer at every level */
     int level; /*dreamer level*/
-    struct list_head request_queue; /* per dreamer request queue*/
+    struct dreamer_mailbox mailbox; /* per dreamer request mailbox*/
     struct list list; /* list head marker*/
     pthread_mutex_t mutex;
-    pthread_cond_t *cond[DREAM_LEVELS]; /* per dreamer wake up levels */
+    pthread_cond_t cond; /* wakes up the dreamer at its level */
+    struct dream_task *task; /* set if the dreamer runs as a task on the executor */
 };
 
 static pthread_mutex_t inception_reality_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t inception_reality_wakeup_for_all = PTHREAD_COND_INITIALIZER;
-static struct list_head dreamer_queue[DREAM_LEVELS];
-static pthread_mutex_t dreamer_mutex[DREAM_LEVELS];
+static pthread_cond_t inception_reality_wakeup_for_all;
+static struct list_head dreamer_queue[DREAM_LEVELS_MAX];
+static pthread_mutex_t dreamer_mutex[DREAM_LEVELS_MAX];
+static pthread_cond_t dreamer_join_cond[DREAM_LEVELS_MAX]; /* broadcast under the level lock as dreamers join the level */
 static pthread_mutex_t limbo_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t limbo_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t limbo_cond;
+
+/*
+ * Dreamer names and roles are interned into dense ids as the dreamers are created.
+ * The dreamer at a level is then looked up by id in dreamer_table in constant time.
+ * The registry is sized at startup for the cast and the projections.
+ * The table is the per level registry of dreamers. Readers walk it lock-less inside
+ * an epoch read section. Joins and leaves are published under the level lock and a leave
+ * waits for a grace period before the mailbox of the dreamer is reclaimed.
+ */
+struct dream_id
+{
+    const char *name;
+    int role;
+};
+
+static struct dream_id *dream_ids;
+static int dream_nids;
+static int dream_max_ids;
+static int dream_role_ids[DREAM_ROLES]; /* id + 1 of the first dreamer of a role. 0 till the role is interned */
+static struct dreamer_attr **dreamer_table[DREAM_LEVELS_MAX];
+static int dream_projections; /* extra dreamers added to the cast */
+
+/*
+ * Shared request command state of the dreamers. A word per 4 levels of a dreamer id with a lane
+ * of state bits per level, so a state is set on 4 levels of a dreamer with a single atomic op.
+ * The words of a dreamer are contiguous and so are the dreamers, to scan a level across
+ * all the dreamers in one pass.
+ */
+#define DREAM_STATE_BITS (16)
+#define DREAM_STATE_LEVELS (64 / DREAM_STATE_BITS) /* levels per state word */
+#define DREAM_STATE_MASK ((1ULL << DREAM_STATE_BITS) - 1)
+#define DREAM_STATE_SHIFT(level) ((((level)-1) % DREAM_STATE_LEVELS) * DREAM_STATE_BITS)
+#define DREAM_STATE_ALL_LEVELS (0x0001000100010001ULL) /* replicates a lane to all the levels of a word */
+#if DREAMER_CMDS > DREAM_STATE_BITS
+#error "The dreamer state word holds 4 levels of 16 state bits"
+#endif
+
+static unsigned long long *dream_states;
+static int dream_state_words; /* state words per dreamer */
+
+/*
+ * Depth of the dream. Limbo is the level at the depth. Set from the command line.
+ */
+static int dream_depth = DREAM_LEVELS;
 
 #define _INCEPTION_C_
 #include "inception.h"
@@ -111,376 +296,3658 @@ static pthread_cond_t limbo_cond = PTHREAD_COND_INITIALIZER;
 static char *fischers_mind_state;
 static struct dreamer_attr *fischer_level1;
 static pid_t fischer_level1_taskid; /*fischers level1 taskid*/
-static int dream_delay_map[DREAM_LEVELS] = { 1, 2, 4, 8};
+#define DREAM_DELAY_MAX (64) /* longest level period in seconds */
+static int dream_delay_map[DREAM_LEVELS_MAX] = { 1, 2, 4, 8}; /* level periods in seconds */
 static int dreamers_in_reality;
 
-static void fischer_dream_level1(void) __attribute__((unused));
+static __inline__ unsigned long long dream_period(int level)
+{
+    return dream_delay_map[level-1] * 1000000000ULL;
+}
+
 /*
- * Queue the command to the dreamers request queue
+ * Clock of the dream. Real time by default. In virtual time (-v) the clock only moves
+ * when no thread of the dream is running: it then jumps straight to the earliest deadline of the timed waits
+ * and wakes that waiter alone. Waiters due at the same time are woken one at a time in an order
+ * drawn from the seed, so a seed replays the same interleaving in a fraction of the real time.
+ * The threads of the dream are counted running from their creation (dream_thread_create) and only
+ * leave the count while they wait in dream_cond_wait, dream_cond_timedwait or dream_futex_wait.
+ * Every wake up of these goes through dream_cond_signal, dream_cond_broadcast or dream_futex_wake,
+ * which count the waiters running again before waking them, so a wake up in flight keeps the clock still.
  */
-static void __dream_enqueue_cmd(struct dreamer_attr *dattr, int cmd, void *arg, int level, int locked)
+#define DREAM_VCLOCK_POLL (20) /* us of real time before retrying a waiter whose lock is busy */
+
+struct dream_vclock_waiter
 {
-    struct dreamer_request *req = calloc(1, sizeof(*req));
-    assert(req != NULL);
-    assert(level > 0 && level <= DREAM_LEVELS);
-    req->dattr = dattr;
-    req->cmd = cmd;
-    req->arg = arg;
-    if(!locked)
-        pthread_mutex_lock(&dattr->mutex);
-    list_add_tail(&req->list, &dattr->request_queue); 
-    pthread_cond_signal(dattr->cond[level-1]);
-    if(!locked)
-        pthread_mutex_unlock(&dattr->mutex);
-}
+    struct list list;
+    unsigned long long deadline; /* 0 for untimed waits */
+    const void *addr; /* condition or futex waited for */
+    pthread_mutex_t *mutex; /* lock of a condition wait */
+    int woken; /* counted running again by the waker */
+};
+
+static struct dream_vclock
+{
+    pthread_mutex_t mutex;
+    int enabled;
+    int running; /* threads of the dream not waiting. Futex word of the clock */
+    unsigned int seed;
+    unsigned long long now;
+    unsigned long long start;
+    unsigned long events; /* waiters woken by the clock */
+    struct list_head waiters;
+} dream_vclock = { .mutex = PTHREAD_MUTEX_INITIALIZER };
 
-static __inline__ void dream_enqueue_cmd(struct dreamer_attr *dattr, int cmd, void *arg, int level)
+static __inline__ unsigned long long dream_time_ns(void)
 {
-    return __dream_enqueue_cmd(dattr, cmd, arg, level, 0);
+    if(dream_vclock.enabled)
+        return __atomic_load_n(&dream_vclock.now, __ATOMIC_ACQUIRE);
+    return arch_time_ns();
 }
 
-static __inline__ void dream_enqueue_cmd_safe(struct dreamer_attr *dattr, int cmd, 
-                                              void *arg, int level, pthread_mutex_t *dreamer_lock)
+static __inline__ void dream_vclock_busy(void)
 {
-    /*
-     * Drop the current level dreamer lock before reacquiring.
-     */
-    pthread_mutex_unlock(dreamer_lock);
-    __dream_enqueue_cmd(dattr, cmd, arg, level, 0);
-    pthread_mutex_lock(dreamer_lock);
+    if(dream_vclock.enabled && !__atomic_fetch_add(&dream_vclock.running, 1, __ATOMIC_SEQ_CST))
+        arch_futex_wake_all(&dream_vclock.running);
 }
 
-static __inline__ void dream_enqueue_cmd_locked(struct dreamer_attr *dattr, int cmd, void *arg, int level)
+static __inline__ void dream_vclock_idle(void)
 {
-    return __dream_enqueue_cmd(dattr, cmd, arg, level, 1);
+    if(dream_vclock.enabled && !__atomic_sub_fetch(&dream_vclock.running, 1, __ATOMIC_SEQ_CST))
+        arch_futex_wake_all(&dream_vclock.running);
 }
 
 /*
- * Clone the request command to all the dreamers: Called with lock held.
+ * Called with the clock lock held.
  */
-static void dream_clone_cmd(struct list_head *dreamer_queue, int cmd, void *arg, struct dreamer_attr *dattr, int level)
+static void dream_vclock_wake_locked(const void *addr)
 {
-    register struct list *iter;
-    for(iter = dreamer_queue->head; iter; iter = iter->next)
+    struct list *iter;
+    for(iter = dream_vclock.waiters.head; iter; iter = iter->next)
     {
-        struct dreamer_attr *dreamer = LIST_ENTRY(iter, struct dreamer_attr, list);
-        if(dattr && dreamer == dattr)
-            continue; /*skip cloning it on this dreamer*/
-        dream_enqueue_cmd(dreamer, cmd, arg, level);
+        struct dream_vclock_waiter *waiter = LIST_ENTRY(iter, struct dream_vclock_waiter, list);
+        if(waiter->addr != addr || waiter->woken)
+            continue;
+        waiter->woken = 1;
+        dream_vclock_busy();
     }
 }
 
-static struct dreamer_request *dream_dequeue_cmd_locked(struct dreamer_attr *dattr)
+/*
+ * Count the waiters of an address running again before the caller wakes them up.
+ */
+static void dream_vclock_wake(const void *addr)
 {
-    struct dreamer_request *req = NULL;
-    struct list *head = NULL;
-    if(!dattr->request_queue.nodes) 
-        return NULL;
-    head = dattr->request_queue.head;
-    assert(head != NULL);
-    req = LIST_ENTRY(head, struct dreamer_request, list);
-    list_del(head, &dattr->request_queue);
-    return req;
+    if(!dream_vclock.enabled)
+        return;
+    pthread_mutex_lock(&dream_vclock.mutex);
+    dream_vclock_wake_locked(addr);
+    pthread_mutex_unlock(&dream_vclock.mutex);
 }
 
-static __inline__ struct dreamer_request *dream_dequeue_cmd(struct dreamer_attr *dattr)
+/*
+ * The waiter is registered before the caller drops the lock of its wait,
+ * so a waker holding that lock always finds it.
+ */
+static void dream_vclock_wait_begin(struct dream_vclock_waiter *waiter)
 {
-    struct dreamer_request *req;
-    pthread_mutex_lock(&dattr->mutex);
-    req = dream_dequeue_cmd_locked(dattr);
-    pthread_mutex_unlock(&dattr->mutex);
-    return req;
+    pthread_mutex_lock(&dream_vclock.mutex);
+    list_add_tail(&waiter->list, &dream_vclock.waiters);
+    dream_vclock_idle();
+    pthread_mutex_unlock(&dream_vclock.mutex);
 }
 
-static struct dreamer_attr *dreamer_find(struct list_head *dreamer_queue, const char *name, int role)
+/*
+ * A waiter returning without a wake up of the dream, on a timeout or spuriously,
+ * counts itself running again.
+ */
+static void dream_vclock_wait_end(struct dream_vclock_waiter *waiter)
 {
-    register struct list *iter;
-    for(iter = dreamer_queue->head; iter ; iter = iter->next)
-    {
-        struct dreamer_attr *dattr = LIST_ENTRY(iter, struct dreamer_attr, list);
-        if(role && (dattr->role & role))
-            return dattr;
-        if(name &&
-           !strcasecmp(dattr->name, name))
-            return dattr;
-    }
-    return NULL;
+    pthread_mutex_lock(&dream_vclock.mutex);
+    list_del(&waiter->list, &dream_vclock.waiters);
+    if(!waiter->woken)
+        dream_vclock_busy();
+    pthread_mutex_unlock(&dream_vclock.mutex);
 }
 
-static struct dreamer_attr *dreamer_find_sync_locked(struct dreamer_attr *dreamer, int level, const char *name, int role)
+struct dream_thread_start
 {
-    struct dreamer_attr *dattr = NULL;
-    if(!level) return NULL;
-    rescan:
-    dattr = dreamer_find(&dreamer_queue[level-1], name, role);
-    if(!dattr)
-    {
-        static int c;
-        pthread_mutex_unlock(&dreamer_mutex[level-1]);
-        if(++c >= 10)
-        {
-            output("[%s] waiting for [%s] to join at level [%d]\n", dreamer->name,
-                   name ?:"Unknown", level);
-        }
-        usleep(100000);
-        pthread_mutex_lock(&dreamer_mutex[level-1]);
-        goto rescan;
-    }
-    return dattr;
+    void *(*function)(void *);
+    void *arg;
+};
+
+static void *dream_thread_start(void *arg)
+{
+    struct dream_thread_start start = *(struct dream_thread_start*)arg;
+    void *ret;
+    free(arg);
+    ret = start.function(start.arg);
+    dream_vclock_idle();
+    return ret;
 }
 
-static struct dreamer_attr *dreamer_find_sync(struct dreamer_attr *dreamer, int level, const char *name, int role)
+/*
+ * pthread_create for the threads of the dream. In virtual time the thread is counted running
+ * by its creator, so the clock cannot move before it first waits, and leaves the count on return.
+ */
+static int dream_thread_create(pthread_t *thread, const pthread_attr_t *attr,
+                               void *(*function)(void *), void *arg)
 {
-    struct dreamer_attr *dattr;
-    if(!level) return NULL;
-    pthread_mutex_lock(&dreamer_mutex[level-1]);
-    dattr = dreamer_find_sync_locked(dreamer, level, name, role);
-    pthread_mutex_unlock(&dreamer_mutex[level-1]);
-    return dattr;
+    struct dream_thread_start *start;
+    int err;
+    if(!dream_vclock.enabled)
+        return pthread_create(thread, attr, function, arg);
+    start = malloc(sizeof(*start));
+    assert(start != NULL);
+    start->function = function;
+    start->arg = arg;
+    dream_vclock_busy();
+    if( (err = pthread_create(thread, attr, dream_thread_start, start)) )
+    {
+        free(start);
+        dream_vclock_idle();
+    }
+    return err;
 }
 
 /*
- * In a dream, you run 12 times slower : 5 mins of realtime = 60 mins
- * Fake the slowness by reduction in threads priority or the 
- * scheduling priority of the dreamer
+ * Stackful coroutines for the dreamers below level 1 (-c). A coroutine is pinned to the carrier
+ * thread it starts on, so the locks it takes always belong to one thread. Its condition waits,
+ * sleeps and barrier waits park it on the address it waits for and switch back to the carrier,
+ * which runs its next runnable coroutine or sleeps till the earliest deadline of the parked ones.
+ * Signals of the conditions of the dream unpark the coroutines waiting on them.
+ * A coroutine only parks with the lock of its wait held, which is dropped while parked.
+ * The batch being built and the read section state are per thread: the carrier swaps them
+ * with the coroutine it runs, so a coroutine parked in a batch or a read section keeps its own.
  */
+#define DREAM_FIBER_STACK (256 << 10)
 
-static void set_thread_priority(struct dreamer_attr *dattr, int level)
+struct dream_carrier;
+struct dream_batch;
+
+struct dream_fiber
 {
-    struct sched_param dream_param = {0};
-    int policy = 0;
+    struct list list; /* run queue of the carrier or the parked coroutines */
+    struct arch_context context;
+    struct dream_carrier *carrier;
+    void *(*function)(void *);
+    void *arg;
+    void *stack;
+    const void *addr; /* waited for while parked */
+    unsigned long long deadline; /* 0 to wait for the unpark only */
+    struct dream_batch *batch; /* dream_batch_current of the coroutine while switched out */
+    int rcu_slot;
+    int rcu_nesting;
+    int done;
+};
 
-    assert(pthread_getschedparam(pthread_self(), &policy, &dream_param) == 0);
-    if(dream_param.sched_priority > 12)
-        dream_param.sched_priority -= 12;
+struct dream_carrier
+{
+    pthread_t thread;
+    pthread_cond_t cond;
+    struct arch_context context;
+    struct list_head runnable;
+    unsigned long switches;
+} __attribute__((aligned(64)));
 
-    output("Dreamer [%s], level [%d], priority [%d], policy [%s]\n",
-           dattr->name, level, dream_param.sched_priority, 
-           policy == SCHED_FIFO ? "FIFO" : 
-           (policy == SCHED_RR ? "RR" : "OTHER"));
+static struct dream_fibers
+{
+    pthread_mutex_t mutex;
+    struct dream_carrier *carriers;
+    int ncarriers;
+    int next;
+    struct list_head parked;
+    unsigned long created;
+    unsigned long parks;
+} dream_fibers = { .mutex = PTHREAD_MUTEX_INITIALIZER };
 
-    assert(pthread_setschedparam(pthread_self(), policy, &dream_param) == 0);
-    
-}
+static int dream_carriers; /* carrier threads for the coroutines. 0 for a thread per dreamer per level */
+static int dream_nested; /* the levels of a dreamer run as coroutines on a carrier of its own */
+static __thread struct dream_fiber *dream_fiber_self;
+static __thread struct dream_batch *dream_batch_current;
+static __thread int dream_rcu_slot = -1;
+static __thread int dream_rcu_nesting;
+
+static void dream_rcu_slot_release(void *arg);
 
 /*
- * Wake up an individual dreamer in one level and let him propagate the kick down to levels below.
+ * Called with the coroutine lock held, which is dropped before the switch to the carrier
+ * along with the lock of the wait. The wait lock is taken again on the way back.
  */
-static void wake_up_dreamer(struct dreamer_attr *dattr, int level)
+static void dream_fiber_park_locked(const void *addr, pthread_mutex_t *mutex, unsigned long long deadline)
 {
-    register struct list *iter;
-    if(!level || (dattr->shared_state & DREAMER_IN_LIMBO)) return;
-    pthread_mutex_lock(&dreamer_mutex[level-1]);
-    for(iter = dreamer_queue[level-1].head; iter; iter = iter->next)
-    {
-        struct dreamer_attr *dreamer = LIST_ENTRY(iter, struct dreamer_attr, list);
-        if( !(dreamer->role ^ dattr->role) )
-        {
-            dream_enqueue_cmd(dreamer, DREAMER_KICK_BACK, NULL, dreamer->level);
-            break;
-        }
-    }
-    pthread_mutex_unlock(&dreamer_mutex[level-1]);
+    struct dream_fiber *fiber = dream_fiber_self;
+    fiber->addr = addr;
+    fiber->deadline = deadline;
+    list_add_tail(&fiber->list, &dream_fibers.parked);
+    ++dream_fibers.parks;
+    pthread_mutex_unlock(&dream_fibers.mutex);
+    if(mutex)
+        pthread_mutex_unlock(mutex);
+    arch_context_switch(&fiber->context, &fiber->carrier->context);
+    if(mutex)
+        pthread_mutex_lock(mutex);
 }
 
 /*
- * Level 0 is wake up dreamers on all levels.
- * Skip guys in a limbo from that level to all the way down.
+ * Park the running coroutine on an address till it is unparked or the deadline of dream_time_ns passes.
+ * Returns ETIMEDOUT once the deadline has passed.
  */
-static void wake_up_dreamers(int level)
+static int dream_fiber_park(const void *addr, pthread_mutex_t *mutex, unsigned long long deadline)
 {
-    int start = DREAM_LEVELS-1,end = 0;
-    register int i;
-    if(level > 0)
-    {
-        start = level - 1;
-        end = level - 1;
-    }
-    for(i = start; i >= end; --i)
-    {
-        struct list *iter;
-        pthread_mutex_lock(&dreamer_mutex[i]);
-        for(iter = dreamer_queue[i].head; iter; iter = iter->next)
-        {
-            struct dreamer_attr *dattr = LIST_ENTRY(iter, struct dreamer_attr, list);
-            if( (dattr->shared_state & DREAMER_IN_LIMBO) )
-                continue;
-            dream_enqueue_cmd(dattr, DREAMER_KICK_BACK, NULL, dattr->level);
-        }
-        pthread_mutex_unlock(&dreamer_mutex[i]);
-    }
+    pthread_mutex_lock(&dream_fibers.mutex);
+    dream_fiber_park_locked(addr, mutex, deadline);
+    return deadline && dream_time_ns() >= deadline ? ETIMEDOUT : 0;
 }
 
 /*
- * Update states on all the levels and down.
+ * Park on a futex word while it holds the value.
  */
-static void set_state(struct dreamer_attr *dattr, int state)
+static void dream_fiber_futex_wait(int *addr, int val)
 {
-    register int i;
-    for(i = DREAM_LEVELS - 1; i >= 0; --i)
+    pthread_mutex_lock(&dream_fibers.mutex);
+    if(__atomic_load_n(addr, __ATOMIC_ACQUIRE) != val)
     {
-        register struct list *iter;
-        pthread_mutex_lock(&dreamer_mutex[i]);
-        for(iter = dreamer_queue[i].head; iter; iter = iter->next)
-        {
-            struct dreamer_attr *dreamer = LIST_ENTRY(iter, struct dreamer_attr, list);
-            if(!(dreamer->role ^ dattr->role))
-            {
-                dreamer->shared_state |= state;
-                break;
-            }
-        }
-        pthread_mutex_unlock(&dreamer_mutex[i]);
+        pthread_mutex_unlock(&dream_fibers.mutex);
+        return;
     }
+    dream_fiber_park_locked(addr, NULL, 0);
 }
 
 /*
- * Set the limbo state on all levels of this dreamer so he cannot get a kick back
- * Called with the lock on that level.
+ * Called with the coroutine lock held.
  */
-static void set_limbo_state(struct dreamer_attr *dattr)
+static void dream_fiber_ready(struct dream_fiber *fiber)
 {
-    set_state(dattr, DREAMER_IN_LIMBO);
+    list_del(&fiber->list, &dream_fibers.parked);
+    list_add_tail(&fiber->list, &fiber->carrier->runnable);
+    dream_vclock_wake(&fiber->carrier->cond);
+    pthread_cond_signal(&fiber->carrier->cond);
+}
+
+static void dream_fiber_unpark(const void *addr, int all)
+{
+    struct list *iter, *next;
+    if(!__atomic_load_n(&dream_fibers.ncarriers, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&dream_fibers.mutex);
+    for(iter = dream_fibers.parked.head; iter; iter = next)
+    {
+        struct dream_fiber *fiber = LIST_ENTRY(iter, struct dream_fiber, list);
+        next = iter->next;
+        if(fiber->addr != addr)
+            continue;
+        dream_fiber_ready(fiber);
+        if(!all)
+            break;
+    }
+    pthread_mutex_unlock(&dream_fibers.mutex);
 }
 
 /*
- * Called with the dreamer attr mutex held for the appropriate level.
+ * In virtual time a signal wakes up every waiter: they have all been counted running.
  */
-static void wait_for_kick(struct dreamer_attr *dattr)
+static void dream_cond_signal(pthread_cond_t *cond)
 {
-    struct dreamer_request *req = NULL;
-    for(;;)
+    if(dream_vclock.enabled)
     {
-        struct timespec ts = {0};
-        while ( (req = dream_dequeue_cmd_locked(dattr)) )
-        {
-            if(req->cmd == DREAMER_KICK_BACK)
-            {
-                free(req);
-                if(dattr->level > 1)
-                {
-                    output("[%s] got Kick at level [%d]. Exiting back to level [%d]\n",
-                           dattr->name, dattr->level, dattr->level - 1);
-                }
-                else
-                {
-                    output("[%s] got Kick at level [%d]. Exiting back to reality\n",
-                           dattr->name, dattr->level);
-                }
-                goto out;
-            }
-            free(req);
-        }
-        arch_gettime(dream_delay_map[dattr->level-1], &ts);
-        pthread_cond_timedwait(dattr->cond[dattr->level-1], &dattr->mutex, &ts);
+        dream_vclock_wake(cond);
+        pthread_cond_broadcast(cond);
     }
-    out:
-    return;
+    else
+        pthread_cond_signal(cond);
+    dream_fiber_unpark(cond, 0);
 }
 
-static struct dreamer_attr *dream_attr_clone(int level, struct dreamer_attr *dattr)
+static void dream_cond_broadcast(pthread_cond_t *cond)
 {
-    struct dreamer_attr *dattr_clone = calloc(1, sizeof(*dattr_clone));
-    assert(dattr_clone != NULL);
-    memcpy(dattr_clone, dattr, sizeof(*dattr_clone));
-    dattr_clone->level = level;
-    memset(&dattr_clone->mutex, 0, sizeof(dattr_clone->mutex));
-    assert(pthread_mutex_init(&dattr_clone->mutex, NULL) == 0);
-    list_init(&dattr_clone->request_queue);
-    return dattr_clone;
+    dream_vclock_wake(cond);
+    pthread_cond_broadcast(cond);
+    dream_fiber_unpark(cond, 1);
 }
 
-static __inline__ void dream_level_create(int level, void * (*dream_function) (void *), struct dreamer_attr *dattr)
+static void dream_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
 {
-    pthread_attr_t attr;
-    pthread_t dream;
-    struct dreamer_attr *dattr_clone = dream_attr_clone(level, dattr);
-    assert(dattr_clone != NULL);
-    assert(pthread_attr_init(&attr)==0);
-    assert(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0);
-    assert(pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED)==0);
-    assert(pthread_create(&dream, &attr, dream_function, dattr_clone) == 0);
+    struct dream_vclock_waiter waiter = { .addr = cond, .mutex = mutex };
+    if(dream_fiber_self)
+        dream_fiber_park(cond, mutex, 0);
+    else if(!dream_vclock.enabled)
+        pthread_cond_wait(cond, mutex);
+    else
+    {
+        dream_vclock_wait_begin(&waiter);
+        pthread_cond_wait(cond, mutex);
+        dream_vclock_wait_end(&waiter);
+    }
 }
 
 /*
- * Now this is the state where Cobb. meets Saito.
- * The beauty of the Films ending is: Did Cobb take a kick back to reality on seeing Saito remind him
- * that he has been in a limbo with his wife and has to come back to become Young.
- * And does Saito take the kick back when Cobb. pulls the trigger on him implicitly in limbo to give him the kick back.
- * Either way based on whether Cobb. got the kick back from limbo or not, the end is a reality or limbo.
- * Thats the ingenuity of Inception. So I think its better if we don't mess this up for ourselves and
- * just sleep here till infinity!
+ * Futex wait of a thread or coroutine of the dream. Woken up by dream_futex_wake.
  */
-
-static void infinite_subconsciousness(struct dreamer_attr *dattr)
+static void dream_futex_wait(int *addr, int val)
 {
-    struct timespec ts = {0};
-    static int dreamers;
-
-    pthread_mutex_lock(&limbo_mutex);
-    ++dreamers;
-    while(dreamers != 2) 
+    struct dream_vclock_waiter waiter = { .addr = addr };
+    if(dream_fiber_self)
+    {
+        dream_fiber_futex_wait(addr, val);
+        return;
+    }
+    if(!dream_vclock.enabled)
     {
-        arch_gettime(2, &ts);
-        pthread_cond_timedwait(&limbo_cond, &limbo_mutex, &ts);
+        arch_futex_wait(addr, val);
+        return;
     }
     /*
-     * Wait for the signal from Fischer
+     * A waker changes the word before taking the clock lock to count the waiters running
      */
-    while(!dreamers_in_reality)
+    pthread_mutex_lock(&dream_vclock.mutex);
+    if(__atomic_load_n(addr, __ATOMIC_SEQ_CST) != val)
     {
-        arch_gettime(1, &ts);
-        pthread_cond_timedwait(&limbo_cond, &limbo_mutex, &ts);
+        pthread_mutex_unlock(&dream_vclock.mutex);
+        return;
     }
+    list_add_tail(&waiter.list, &dream_vclock.waiters);
+    dream_vclock_idle();
+    pthread_mutex_unlock(&dream_vclock.mutex);
+    arch_futex_wait(addr, val);
+    dream_vclock_wait_end(&waiter);
+}
 
-    if((dattr->role & DREAM_INCEPTION_PERFORMER))
+static void dream_futex_wake(int *addr, int all)
+{
+    if(dream_vclock.enabled)
     {
-        output("\n\nCobbs' search for Saito ends in Limbo. Now either both take the kick back to reality "
-               "or the ending is still a state of limbo from Cobbs' perspective, which is what Nolan wants us to think\n");
-        output("This is in spite of witnessing his children turn towards him for the first time which we're never shown in his projections.\n");
-        output("So, let me end the limbo state abruptly like the Movie with the totem spinning and leave it to the reviewers to decide the infinite sleep:-)\n\n");
+        dream_vclock_wake(addr);
+        arch_futex_wake_all(addr);
     }
-    pthread_cond_signal(&limbo_cond);
-    pthread_mutex_unlock(&limbo_mutex);
-    sleep(1<<31);
+    else if(all)
+        arch_futex_wake_all(addr);
+    else
+        arch_futex_wake_one(addr);
+    dream_fiber_unpark(addr, all);
 }
 
 /*
- * Limbo is a state of infinite subconciousness
+ * Timed wait of a condition of arch_cond_init up to a deadline of dream_time_ns.
+ * Called with the mutex held. Returns ETIMEDOUT once the deadline has passed.
+ * In virtual time the waiter stays registered with the clock till it has taken the clock lock
+ * again, and the clock signals the condition with the mutex of the waiter held,
+ * so it never signals the condition of a waiter that has returned.
  */
-static void enter_limbo(struct dreamer_attr *dattr)
+static int dream_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, unsigned long long deadline)
 {
-    struct dreamer_attr *clone = NULL;
-    struct dreamer_request *req = NULL;
-
-    pthread_mutex_lock(&dattr->mutex);
-    dattr->shared_state |= DREAMER_IN_LIMBO;
-    clone = dream_attr_clone(dattr->level+1, dattr);
-    pthread_mutex_unlock(&dattr->mutex);
-
-    assert(clone != NULL);
-    pthread_mutex_lock(&dreamer_mutex[3]);
-    list_add_tail(&clone->list, &dreamer_queue[3]);
-    while( (dreamer_queue[3].nodes + 3) != DREAMERS)
+    struct dream_vclock_waiter waiter = { .deadline = deadline, .addr = cond, .mutex = mutex };
+    struct timespec ts = {0};
+    if(dream_fiber_self)
     {
-        pthread_mutex_unlock(&dreamer_mutex[3]);
-        usleep(100000);
-        pthread_mutex_lock(&dreamer_mutex[3]);
+        if(dream_time_ns() >= deadline)
+            return ETIMEDOUT;
+        return dream_fiber_park(cond, mutex, deadline);
     }
-    pthread_mutex_unlock(&dreamer_mutex[3]);
-
-    switch( (clone->role & DREAM_ROLE_MASK) )
+    if(!dream_vclock.enabled)
     {
-    case DREAM_INCEPTION_PERFORMER: /* Cobb */
+        arch_deadline(deadline, &ts);
+        return pthread_cond_timedwait(cond, mutex, &ts);
+    }
+    if(dream_time_ns() >= deadline)
+        return ETIMEDOUT;
+    dream_vclock_wait_begin(&waiter);
+    pthread_cond_wait(cond, mutex);
+    dream_vclock_wait_end(&waiter);
+    return dream_time_ns() >= deadline ? ETIMEDOUT : 0;
+}
+
+static void dream_sleep_ns(unsigned long long ns)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond;
+    unsigned long long deadline;
+    if(dream_fiber_self)
+    {
+        deadline = dream_time_ns() + ns;
+        while(dream_fiber_park(NULL, NULL, deadline) != ETIMEDOUT);
+        return;
+    }
+    if(!dream_vclock.enabled)
+    {
+        struct timespec ts = { .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL };
+        while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+        return;
+    }
+    deadline = dream_time_ns() + ns;
+    assert(arch_cond_init(&cond) == 0);
+    pthread_mutex_lock(&mutex);
+    while(dream_cond_timedwait(&cond, &mutex, deadline) != ETIMEDOUT);
+    pthread_mutex_unlock(&mutex);
+    pthread_cond_destroy(&cond);
+}
+
+static __inline__ void dream_sleep(unsigned int secs)
+{
+    dream_sleep_ns(secs * 1000000000ULL);
+}
+
+static __inline__ void dream_usleep(unsigned long usecs)
+{
+    dream_sleep_ns(usecs * 1000ULL);
+}
+
+/*
+ * Never woken up. Out of the running threads for the virtual clock.
+ */
+static void dream_sleep_forever(void)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    pthread_mutex_lock(&mutex);
+    for(;;)
+        dream_cond_wait(&cond, &mutex);
+}
+
+/*
+ * Move the clock to the next deadline once no thread of the dream is running.
+ * The waiter picked is signalled with its lock held, taken with a trylock against the order
+ * of the waits, which register with the clock under their lock.
+ */
+static void *dream_vclock_thread(void *unused)
+{
+    struct dream_vclock_waiter *picked = NULL;
+    for(;;)
+    {
+        struct dream_vclock_waiter *next = NULL;
+        struct list *iter;
+        int due = 0, pick, running;
+        if( (running = __atomic_load_n(&dream_vclock.running, __ATOMIC_SEQ_CST)) )
+        {
+            arch_futex_wait(&dream_vclock.running, running);
+            continue;
+        }
+        pthread_mutex_lock(&dream_vclock.mutex);
+        for(iter = dream_vclock.waiters.head; iter; iter = iter->next)
+        {
+            struct dream_vclock_waiter *waiter = LIST_ENTRY(iter, struct dream_vclock_waiter, list);
+            if(!waiter->deadline || waiter->woken)
+                continue;
+            if(waiter == picked)
+            {
+                /*
+                 * Still waiting for its lock
+                 */
+                next = waiter;
+                due = 0;
+                break;
+            }
+            if(!next || waiter->deadline < next->deadline)
+            {
+                next = waiter;
+                due = 1;
+            }
+            else if(waiter->deadline == next->deadline)
+                ++due;
+        }
+        if(!next || __atomic_load_n(&dream_vclock.running, __ATOMIC_SEQ_CST))
+        {
+            pthread_mutex_unlock(&dream_vclock.mutex);
+            if(!next)
+                arch_futex_wait(&dream_vclock.running, 0);
+            continue;
+        }
+        /*
+         * Pick one of the waiters due first with the seed
+         */
+        pick = due ? rand_r(&dream_vclock.seed) % due : -1;
+        for(iter = dream_vclock.waiters.head; pick >= 0 && iter; iter = iter->next)
+        {
+            struct dream_vclock_waiter *waiter = LIST_ENTRY(iter, struct dream_vclock_waiter, list);
+            if(waiter->deadline && !waiter->woken && waiter->deadline == next->deadline && !pick--)
+            {
+                next = waiter;
+                break;
+            }
+        }
+        if(pthread_mutex_trylock(next->mutex))
+        {
+            /*
+             * The waiter has yet to drop its lock in pthread_cond_wait. Retry the same waiter
+             * without drawing again, so the seed does not depend on the real timing.
+             */
+            picked = next;
+            pthread_mutex_unlock(&dream_vclock.mutex);
+            usleep(DREAM_VCLOCK_POLL);
+            continue;
+        }
+        picked = NULL;
+        if(next->deadline > dream_vclock.now)
+            __atomic_store_n(&dream_vclock.now, next->deadline, __ATOMIC_RELEASE);
+        ++dream_vclock.events;
+        dream_vclock_wake_locked(next->addr);
+        pthread_cond_broadcast((pthread_cond_t*)next->addr);
+        pthread_mutex_unlock(next->mutex);
+        pthread_mutex_unlock(&dream_vclock.mutex);
+    }
+    return NULL;
+}
+
+static void dream_vclock_start(unsigned int seed)
+{
+    pthread_t clock;
+    list_init(&dream_vclock.waiters);
+    dream_vclock.seed = seed;
+    dream_vclock.now = dream_vclock.start = arch_time_ns();
+    dream_vclock.enabled = 1;
+    assert(pthread_create(&clock, NULL, dream_vclock_thread, NULL) == 0);
+    assert(pthread_detach(clock) == 0);
+}
+
+static void dream_vclock_stats_print(void)
+{
+    if(!dream_vclock.enabled)
+        return;
+    pthread_mutex_lock(&dream_vclock.mutex);
+    output("Virtual clock: events [%lu], virtual time [%.3f s]\n", dream_vclock.events,
+           (double)(dream_vclock.now - dream_vclock.start)/1000000000ULL);
+    pthread_mutex_unlock(&dream_vclock.mutex);
+}
+
+static void dream_fiber_entry(void)
+{
+    struct dream_fiber *fiber = dream_fiber_self;
+    fiber->function(fiber->arg);
+    fiber->done = 1;
+    arch_context_switch(&fiber->context, &fiber->carrier->context);
+    assert(0);
+}
+
+/*
+ * Run the coroutines of the carrier. The finished ones are reclaimed by the carrier off their stack.
+ */
+static void *dream_carrier_thread(void *arg)
+{
+    struct dream_carrier *carrier = arg;
+    struct sched_param param = {0};
+    int policy = 0;
+    /*
+     * Run at the priority of the level 2 dreamers. The carrier of a dreamer in nested mode
+     * keeps the priority of the movie like the thread of a dreamer at level 1
+     */
+    assert(pthread_getschedparam(pthread_self(), &policy, &param) == 0);
+    if(!dream_nested && param.sched_priority > 24)
+    {
+        param.sched_priority -= 24;
+        assert(pthread_setschedparam(pthread_self(), policy, &param) == 0);
+    }
+    pthread_mutex_lock(&dream_fibers.mutex);
+    for(;;)
+    {
+        unsigned long long now = dream_time_ns(), next = 0;
+        struct dream_fiber *fiber;
+        struct list *iter, *following;
+        for(iter = dream_fibers.parked.head; iter; iter = following)
+        {
+            fiber = LIST_ENTRY(iter, struct dream_fiber, list);
+            following = iter->next;
+            if(fiber->carrier != carrier || !fiber->deadline)
+                continue;
+            if(fiber->deadline <= now)
+                dream_fiber_ready(fiber);
+            else if(!next || fiber->deadline < next)
+                next = fiber->deadline;
+        }
+        if(!carrier->runnable.head)
+        {
+            if(next)
+                dream_cond_timedwait(&carrier->cond, &dream_fibers.mutex, next);
+            else
+                dream_cond_wait(&carrier->cond, &dream_fibers.mutex);
+            continue;
+        }
+        fiber = LIST_ENTRY(carrier->runnable.head, struct dream_fiber, list);
+        list_del(&fiber->list, &carrier->runnable);
+        ++carrier->switches;
+        pthread_mutex_unlock(&dream_fibers.mutex);
+        dream_fiber_self = fiber;
+        dream_batch_current = fiber->batch;
+        dream_rcu_slot = fiber->rcu_slot;
+        dream_rcu_nesting = fiber->rcu_nesting;
+        arch_context_switch(&carrier->context, &fiber->context);
+        fiber->batch = dream_batch_current;
+        fiber->rcu_slot = dream_rcu_slot;
+        fiber->rcu_nesting = dream_rcu_nesting;
+        dream_batch_current = NULL;
+        dream_rcu_slot = -1;
+        dream_rcu_nesting = 0;
+        dream_fiber_self = NULL;
+        if(fiber->done)
+        {
+            assert(!fiber->batch && !fiber->rcu_nesting);
+            if(fiber->rcu_slot >= 0)
+                dream_rcu_slot_release((void*)(long)(fiber->rcu_slot + 1));
+            assert(munmap(fiber->stack, DREAM_FIBER_STACK) == 0);
+            free(fiber);
+        }
+        pthread_mutex_lock(&dream_fibers.mutex);
+    }
+    return NULL;
+}
+
+/*
+ * Start the carriers with the scheduling of the caller.
+ */
+static void dream_fibers_start(int carriers)
+{
+    register int i;
+    assert(carriers > 0);
+    assert(!dream_fibers.ncarriers);
+    list_init(&dream_fibers.parked);
+    dream_fibers.carriers = calloc(carriers, sizeof(*dream_fibers.carriers));
+    assert(dream_fibers.carriers != NULL);
+    for(i = 0; i < carriers; ++i)
+    {
+        struct dream_carrier *carrier = &dream_fibers.carriers[i];
+        pthread_attr_t attr;
+        assert(arch_cond_init(&carrier->cond) == 0);
+        list_init(&carrier->runnable);
+        assert(pthread_attr_init(&attr) == 0);
+        assert(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0);
+        assert(pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED) == 0);
+        assert(dream_thread_create(&carrier->thread, &attr, dream_carrier_thread, carrier) == 0);
+    }
+    __atomic_store_n(&dream_fibers.ncarriers, carriers, __ATOMIC_RELEASE);
+}
+
+/*
+ * Start a coroutine on the next carrier, round robin, or on the carrier of the calling coroutine
+ * for the next level of a dreamer in nested mode (-n). The stack has a guard page at the bottom.
+ */
+static void dream_fiber_create(void *(*function)(void *), void *arg)
+{
+    struct dream_fiber *fiber = calloc(1, sizeof(*fiber));
+    assert(fiber != NULL);
+    fiber->function = function;
+    fiber->arg = arg;
+    fiber->rcu_slot = -1;
+    fiber->stack = mmap(0, DREAM_FIBER_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(fiber->stack != MAP_FAILED);
+    assert(mprotect(fiber->stack, getpagesize(), PROT_NONE) == 0);
+    arch_context_init(&fiber->context, fiber->stack, DREAM_FIBER_STACK, dream_fiber_entry);
+    pthread_mutex_lock(&dream_fibers.mutex);
+    if(dream_nested && dream_fiber_self)
+        fiber->carrier = dream_fiber_self->carrier;
+    else
+        fiber->carrier = &dream_fibers.carriers[dream_fibers.next++ % dream_fibers.ncarriers];
+    ++dream_fibers.created;
+    list_add_tail(&fiber->list, &fiber->carrier->runnable);
+    dream_vclock_wake(&fiber->carrier->cond);
+    pthread_cond_signal(&fiber->carrier->cond);
+    pthread_mutex_unlock(&dream_fibers.mutex);
+}
+
+static void dream_fibers_stats_print(void)
+{
+    unsigned long switches = 0;
+    register int i;
+    if(!dream_fibers.ncarriers)
+        return;
+    pthread_mutex_lock(&dream_fibers.mutex);
+    for(i = 0; i < dream_fibers.ncarriers; ++i)
+        switches += dream_fibers.carriers[i].switches;
+    output("Coroutines: carriers [%d], created [%lu], parks [%lu], switches [%lu]\n",
+           dream_fibers.ncarriers, dream_fibers.created, dream_fibers.parks, switches);
+    pthread_mutex_unlock(&dream_fibers.mutex);
+}
+
+static void fischer_dream_level1(void) __attribute__((unused));
+
+static void dream_future_init(struct dream_future *future)
+{
+    memset(future, 0, sizeof(*future));
+    assert(pthread_mutex_init(&future->mutex, NULL) == 0);
+    assert(arch_cond_init(&future->cond) == 0);
+}
+
+static void dream_future_destroy(struct dream_future *future)
+{
+    pthread_cond_destroy(&future->cond);
+    pthread_mutex_destroy(&future->mutex);
+}
+
+static void dream_future_complete(struct dream_future *future, void *reply)
+{
+    pthread_mutex_lock(&future->mutex);
+    assert(!future->done);
+    future->reply = reply;
+    future->done = 1;
+    dream_cond_signal(&future->cond);
+    pthread_mutex_unlock(&future->mutex);
+}
+
+/*
+ * Wait for the reply. Returns NULL if the request was dropped unanswered.
+ */
+static void *dream_future_wait(struct dream_future *future)
+{
+    void *reply;
+    pthread_mutex_lock(&future->mutex);
+    while(!future->done)
+        dream_cond_wait(&future->cond, &future->mutex);
+    reply = future->reply;
+    pthread_mutex_unlock(&future->mutex);
+    return reply;
+}
+
+/*
+ * Request allocator. Requests are carved out of slabs and kept in per thread caches
+ * of two magazines each, as in the Bonwick magazine allocator.
+ * A request is typically allocated by the producer and freed by the consumer thread.
+ * So the consumer cache fills up and hands full magazines over to the depot
+ * from where the producer cache reloads. Only a depot running dry hits the heap.
+ */
+struct dream_magazine
+{
+    struct llist_node *rounds;
+    int count;
+};
+
+struct dream_request_cache
+{
+    struct dream_magazine loaded;
+    struct dream_magazine previous; /* either full or empty */
+    int registered;
+};
+
+static struct dream_request_depot
+{
+    pthread_mutex_t mutex;
+    pthread_key_t key; /* to return the thread cache back to the depot on thread exit */
+    struct dream_magazine *magazines;
+    int nmagazines;
+    int capacity;
+    int requests; /* total requests carved out of slabs */
+    int started; /* set once the startup slabs are in place */
+    unsigned long depot_gets;
+    unsigned long depot_puts;
+    unsigned long heap_allocs;
+    unsigned long heap_allocs_after_startup;
+} dream_request_depot = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct dream_request_cache dream_request_cache;
+
+/*
+ * Called with the depot lock held.
+ */
+static void dream_request_slab_grow(void)
+{
+    struct dream_request_depot *depot = &dream_request_depot;
+    struct dreamer_request *slab = NULL;
+    register int i;
+    assert(posix_memalign((void**)&slab, DREAM_CACHE_LINE,
+                          DREAM_REQUEST_SLAB * sizeof(*slab)) == 0);
+    depot->requests += DREAM_REQUEST_SLAB;
+    /*
+     * Enough room for every request in a magazine of its own.
+     */
+    depot->capacity = depot->requests;
+    depot->magazines = realloc(depot->magazines, depot->capacity * sizeof(*depot->magazines));
+    assert(depot->magazines != NULL);
+    depot->heap_allocs += 2;
+    if(depot->started)
+        depot->heap_allocs_after_startup += 2;
+    for(i = 0; i < DREAM_REQUEST_SLAB; i += DREAM_REQUEST_MAGAZINE)
+    {
+        struct dream_magazine *mag = &depot->magazines[depot->nmagazines++];
+        register int j;
+        mag->rounds = NULL;
+        mag->count = 0;
+        for(j = i; j < i + DREAM_REQUEST_MAGAZINE && j < DREAM_REQUEST_SLAB; ++j)
+        {
+            slab[j].mailbox.next = mag->rounds;
+            mag->rounds = &slab[j].mailbox;
+            ++mag->count;
+        }
+    }
+}
+
+static void dream_depot_get(struct dream_magazine *mag)
+{
+    struct dream_request_depot *depot = &dream_request_depot;
+    pthread_mutex_lock(&depot->mutex);
+    if(!depot->nmagazines)
+        dream_request_slab_grow();
+    *mag = depot->magazines[--depot->nmagazines];
+    ++depot->depot_gets;
+    pthread_mutex_unlock(&depot->mutex);
+}
+
+static void dream_depot_put(struct dream_magazine *mag)
+{
+    struct dream_request_depot *depot = &dream_request_depot;
+    if(!mag->count) return;
+    pthread_mutex_lock(&depot->mutex);
+    assert(depot->nmagazines < depot->capacity);
+    depot->magazines[depot->nmagazines++] = *mag;
+    ++depot->depot_puts;
+    pthread_mutex_unlock(&depot->mutex);
+    mag->rounds = NULL;
+    mag->count = 0;
+}
+
+static void dream_request_cache_destroy(void *arg)
+{
+    struct dream_request_cache *cache = arg;
+    dream_depot_put(&cache->loaded);
+    dream_depot_put(&cache->previous);
+    cache->registered = 0;
+}
+
+static __inline__ struct dream_request_cache *dream_request_cache_get(void)
+{
+    struct dream_request_cache *cache = &dream_request_cache;
+    if(!cache->registered)
+    {
+        assert(pthread_setspecific(dream_request_depot.key, cache) == 0);
+        cache->registered = 1;
+    }
+    return cache;
+}
+
+static __inline__ void dream_magazine_swap(struct dream_request_cache *cache)
+{
+    struct dream_magazine mag = cache->loaded;
+    cache->loaded = cache->previous;
+    cache->previous = mag;
+}
+
+static struct dreamer_request *dream_request_alloc(void)
+{
+    struct dream_request_cache *cache = dream_request_cache_get();
+    struct dreamer_request *req = NULL;
+    struct llist_node *round = NULL;
+    if(!cache->loaded.count)
+    {
+        if(cache->previous.count)
+            dream_magazine_swap(cache);
+        else
+            dream_depot_get(&cache->loaded);
+    }
+    round = cache->loaded.rounds;
+    cache->loaded.rounds = round->next;
+    --cache->loaded.count;
+    req = LIST_ENTRY(round, struct dreamer_request, mailbox);
+    memset(req, 0, sizeof(*req));
+    return req;
+}
+
+/*
+ * Fulfill the future of a synchronous request. The caller wakes up right away.
+ */
+static void dream_request_reply(struct dreamer_request *req, void *reply)
+{
+    if(!req->future)
+        return;
+    dream_future_complete(req->future, reply);
+    req->future = NULL;
+}
+
+static void dream_request_free(struct dreamer_request *req)
+{
+    struct dream_request_cache *cache = dream_request_cache_get();
+    dream_request_reply(req, NULL);
+    if(cache->loaded.count == DREAM_REQUEST_MAGAZINE)
+    {
+        if(cache->previous.count)
+            dream_depot_put(&cache->previous);
+        dream_magazine_swap(cache);
+    }
+    req->mailbox.next = cache->loaded.rounds;
+    cache->loaded.rounds = &req->mailbox;
+    ++cache->loaded.count;
+}
+
+static void dream_request_pool_init(void)
+{
+    struct dream_request_depot *depot = &dream_request_depot;
+    assert(pthread_key_create(&depot->key, dream_request_cache_destroy) == 0);
+    pthread_mutex_lock(&depot->mutex);
+    dream_request_slab_grow();
+    depot->started = 1;
+    pthread_mutex_unlock(&depot->mutex);
+}
+
+static void dream_request_pool_stats(void)
+{
+    struct dream_request_depot *depot = &dream_request_depot;
+    pthread_mutex_lock(&depot->mutex);
+    output("Request pool: [%d] requests, [%lu] depot gets, [%lu] depot puts, "
+           "[%lu] heap allocations, [%lu] after startup\n",
+           depot->requests, depot->depot_gets, depot->depot_puts,
+           depot->heap_allocs, depot->heap_allocs_after_startup);
+    pthread_mutex_unlock(&depot->mutex);
+}
+
+static void dream_cmd_classes_init(void)
+{
+    register int i;
+    for(i = 0; i < DREAMER_CMDS; ++i)
+    {
+        assert(dream_cmd_classes[i].cmd == (1 << i));
+        assert(dream_cmd_classes[i].lane >= 0 && dream_cmd_classes[i].lane < DREAM_LANES);
+        assert(dream_cmd_classes[i].overflow >= 0 
+               && dream_cmd_classes[i].overflow < DREAM_OVERFLOW_POLICIES);
+    }
+}
+
+/*
+ * Epoch based read sections for the lock-less sends to the registered dreamers, in the spirit of RCU.
+ * A reader publishes the global epoch in its slot on entry and clears it on exit.
+ * A writer bumps the epoch and waits for the readers that entered before the bump,
+ * which is the grace period after which nobody can still see what the writer unpublished.
+ * A reader leaving its section while a writer waits wakes it up.
+ */
+#define DREAM_RCU_READERS (64)
+
+static struct dream_rcu
+{
+    unsigned long epoch;
+    pthread_key_t key; /* to give back the reader slot on thread exit */
+    pthread_once_t once;
+    unsigned long readers[DREAM_RCU_READERS]; /* epoch of the reader in a read section, 0 otherwise */
+    int used[DREAM_RCU_READERS];
+    int unslotted; /* readers in a read section that found no free slot */
+    int writers; /* writers waiting for a grace period */
+    int exits; /* futex word bumped by the readers leaving while a writer waits */
+    unsigned long grace_periods;
+} dream_rcu = { .epoch = 1, .once = PTHREAD_ONCE_INIT };
+
+static void dream_rcu_slot_release(void *arg)
+{
+    int slot = (int)(long)arg - 1;
+    __atomic_store_n(&dream_rcu.readers[slot], 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&dream_rcu.used[slot], 0, __ATOMIC_RELEASE);
+}
+
+static void dream_rcu_key_create(void)
+{
+    assert(pthread_key_create(&dream_rcu.key, dream_rcu_slot_release) == 0);
+}
+
+/*
+ * Slot of the reader. -1 if all the slots are taken: the read section is then counted
+ * in dream_rcu.unslotted and the thread tries again on its next read section.
+ * A coroutine owns its slot, given back by its carrier when it finishes.
+ */
+static int dream_rcu_slot_get(void)
+{
+    register int i;
+    if(dream_rcu_slot >= 0)
+        return dream_rcu_slot;
+    pthread_once(&dream_rcu.once, dream_rcu_key_create);
+    for(i = 0; i < DREAM_RCU_READERS; ++i)
+    {
+        int unused = 0;
+        if(__atomic_compare_exchange_n(&dream_rcu.used[i], &unused, 1, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            if(!dream_fiber_self)
+                assert(pthread_setspecific(dream_rcu.key, (void*)(long)(i + 1)) == 0);
+            return dream_rcu_slot = i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Give back the slot of a thread that stops reading for a while, as a parked thread of the cache.
+ */
+static void dream_rcu_slot_put(void)
+{
+    assert(!dream_rcu_nesting);
+    if(dream_rcu_slot < 0)
+        return;
+    assert(pthread_setspecific(dream_rcu.key, NULL) == 0);
+    dream_rcu_slot_release((void*)(long)(dream_rcu_slot + 1));
+    dream_rcu_slot = -1;
+}
+
+static __inline__ void dream_rcu_read_lock(void)
+{
+    int slot;
+    if(dream_rcu_nesting++)
+        return;
+    if( (slot = dream_rcu_slot_get()) < 0)
+    {
+        __atomic_add_fetch(&dream_rcu.unslotted, 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+    __atomic_store_n(&dream_rcu.readers[slot], __atomic_load_n(&dream_rcu.epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+}
+
+static __inline__ void dream_rcu_read_unlock(void)
+{
+    assert(dream_rcu_nesting > 0);
+    if(--dream_rcu_nesting)
+        return;
+    if(dream_rcu_slot < 0)
+        __atomic_sub_fetch(&dream_rcu.unslotted, 1, __ATOMIC_SEQ_CST);
+    else
+        __atomic_store_n(&dream_rcu.readers[dream_rcu_slot], 0, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&dream_rcu.writers, __ATOMIC_SEQ_CST))
+    {
+        __atomic_add_fetch(&dream_rcu.exits, 1, __ATOMIC_RELEASE);
+        dream_futex_wake(&dream_rcu.exits, 1);
+    }
+}
+
+/*
+ * Wait for a reader to leave its section after the exits were sampled.
+ */
+static void dream_rcu_wait(int exits)
+{
+    dream_futex_wait(&dream_rcu.exits, exits);
+}
+
+/*
+ * Wait for the readers that could still see an unpublished entry. Not from a read section.
+ */
+static void dream_rcu_synchronize(void)
+{
+    unsigned long epoch;
+    register int i;
+    int exits;
+    assert(!dream_rcu_nesting);
+    __atomic_add_fetch(&dream_rcu.writers, 1, __ATOMIC_SEQ_CST);
+    epoch = __atomic_add_fetch(&dream_rcu.epoch, 1, __ATOMIC_SEQ_CST);
+    for(i = 0; i < DREAM_RCU_READERS; ++i)
+    {
+        unsigned long reader;
+        for(;;)
+        {
+            exits = __atomic_load_n(&dream_rcu.exits, __ATOMIC_SEQ_CST);
+            reader = __atomic_load_n(&dream_rcu.readers[i], __ATOMIC_SEQ_CST);
+            if(!reader || reader >= epoch)
+                break;
+            dream_rcu_wait(exits);
+        }
+    }
+    /*
+     * Readers without a slot carry no epoch. Wait for all of them, the ones that came after too.
+     */
+    for(;;)
+    {
+        exits = __atomic_load_n(&dream_rcu.exits, __ATOMIC_SEQ_CST);
+        if(!__atomic_load_n(&dream_rcu.unslotted, __ATOMIC_SEQ_CST))
+            break;
+        dream_rcu_wait(exits);
+    }
+    __atomic_sub_fetch(&dream_rcu.writers, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dream_rcu.grace_periods, 1, __ATOMIC_RELAXED);
+}
+
+static void dream_mailbox_init(struct dreamer_mailbox *mbox)
+{
+    register int lane;
+    for(lane = 0; lane < DREAM_LANES; ++lane)
+    {
+        llist_init(&mbox->inbox[lane]);
+        list_init(&mbox->pending[lane]);
+    }
+    memset(mbox->coalesce, 0, sizeof(mbox->coalesce));
+    mbox->capacity = dream_mailbox_capacity;
+    memset(mbox->overflow, 0, sizeof(mbox->overflow));
+    mbox->depth = mbox->high_water = mbox->waiters = mbox->closed = 0;
+    assert(arch_cond_init(&mbox->room) == 0);
+}
+
+static void dream_mailbox_stats_print(void)
+{
+    register int i;
+    output("Mailbox merged commands:");
+    for(i = 0; i < DREAMER_CMDS; ++i)
+    {
+        if(!(dream_cmd_classes[i].flags & DREAM_CMD_COALESCE))
+            continue;
+        output(" %s [%lu]", dream_cmd_classes[i].name,
+               __atomic_load_n(&dream_mailbox_stats.merged[i], __ATOMIC_RELAXED));
+    }
+    output("\nMailbox overflows (capacity [%d]):", dream_mailbox_capacity);
+    for(i = 0; i < DREAM_OVERFLOW_POLICIES; ++i)
+        output(" %s [%lu]", dream_overflow_names[i],
+               __atomic_load_n(&dream_mailbox_stats.overflow[i], __ATOMIC_RELAXED));
+    output(" block timeouts [%lu] closed [%lu]\n", __atomic_load_n(&dream_mailbox_stats.block_timeouts, __ATOMIC_RELAXED),
+           __atomic_load_n(&dream_mailbox_stats.closed, __ATOMIC_RELAXED));
+}
+
+/*
+ * Mailbox high-water marks of the dreamers at every level, to size the capacity from a run.
+ */
+static void dream_mailbox_high_water_print(void)
+{
+    register int level;
+    output("Mailbox high-water marks:");
+    for(level = 1; level <= dream_depth; ++level)
+    {
+        register struct list *iter;
+        int projections = 0, projection_high_water = 0;
+        pthread_mutex_lock(&dreamer_mutex[level-1]);
+        for(iter = dreamer_queue[level-1].head; iter; iter = iter->next)
+        {
+            struct dreamer_attr *dreamer = LIST_ENTRY(iter, struct dreamer_attr, list);
+            int high_water = __atomic_load_n(&dreamer->mailbox.high_water, __ATOMIC_RELAXED);
+            /*
+             * Projections are summed up
+             */
+            if( (dreamer->role & DREAM_PROJECTION) )
+            {
+                ++projections;
+                if(high_water > projection_high_water)
+                    projection_high_water = high_water;
+                continue;
+            }
+            output(" %s@%d [%d]", dreamer->name, level, high_water);
+        }
+        pthread_mutex_unlock(&dreamer_mutex[level-1]);
+        if(projections)
+            output(" %d Projections@%d [%d]", projections, level, projection_high_water);
+    }
+    output("\n");
+}
+
+/*
+ * A coalescing slot is one word: the sender owning it and the top bit, never set in a
+ * user space pointer, once an enqueue was merged into its request.
+ */
+#define DREAM_COALESCE_MERGED (1UL << (sizeof(unsigned long) * 8 - 1))
+
+/*
+ * Try merging a coalescable command into the request of the same sender still queued in the mailbox.
+ * Returns 1 if merged. Returns 0 if a request has to be queued, with *coalesce set
+ * when the request takes the free slot. The slot is freed by the consumer when it dequeues
+ * the request, so an enqueue that sees the slot taken by its sender comes before the dispatch.
+ */
+static int dream_mailbox_coalesce(struct dreamer_mailbox *mbox, int cmd, void *sender, int *coalesce)
+{
+    struct dream_cmd_class *class = dream_cmd_class(cmd);
+    unsigned long *slot, word, key = (unsigned long)sender;
+    *coalesce = 0;
+    if(!(class->flags & DREAM_CMD_COALESCE) || !sender)
+        return 0;
+    assert(!(key & DREAM_COALESCE_MERGED));
+    slot = &mbox->coalesce[class - dream_cmd_classes];
+    word = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    for(;;)
+    {
+        if(!word)
+        {
+            if(__atomic_compare_exchange_n(slot, &word, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                *coalesce = 1;
+                return 0;
+            }
+            continue;
+        }
+        if( (word & ~DREAM_COALESCE_MERGED) != key)
+            return 0;
+        if( (word & DREAM_COALESCE_MERGED)
+            ||
+            __atomic_compare_exchange_n(slot, &word, key | DREAM_COALESCE_MERGED, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+    }
+    __atomic_add_fetch(&dream_mailbox_stats.merged[class - dream_cmd_classes], 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ * Free the slot of a request leaving the mailbox. Returns 1 if enqueues were merged into it.
+ */
+static int dream_mailbox_coalesce_release(struct dreamer_mailbox *mbox, int cmd)
+{
+    return !!(__atomic_exchange_n(&mbox->coalesce[__builtin_ctz(cmd)], 0, __ATOMIC_ACQ_REL)
+              & DREAM_COALESCE_MERGED);
+}
+
+/*
+ * Called by the consumer for each dequeued request to close its coalescing window
+ * and give back its room in the mailbox. Returns NULL if the request was dropped
+ * to settle an overflow of the drop oldest policy.
+ */
+static struct dreamer_request *dream_mailbox_dequeued(struct dreamer_request *req)
+{
+    struct dreamer_attr *dattr = req->dattr;
+    struct dreamer_mailbox *mbox = &dattr->mailbox;
+    int depth;
+    if(req->coalesce)
+        req->merged = dream_mailbox_coalesce_release(mbox, req->cmd);
+    depth = __atomic_sub_fetch(&mbox->depth, 1, __ATOMIC_SEQ_CST);
+    if(!mbox->capacity)
+        return req;
+    if(depth <= mbox->capacity && __atomic_load_n(&mbox->waiters, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&dattr->mutex);
+        dream_cond_broadcast(&mbox->room);
+        pthread_mutex_unlock(&dattr->mutex);
+    }
+    /*
+     * Only the consumer takes the overflow down, on the oldest periodic request of the class.
+     * A request standing for merged enqueues is kept as they could be one-shots.
+     */
+    if(req->periodic && !req->merged
+       &&
+       __atomic_load_n(&mbox->overflow[__builtin_ctz(req->cmd)], __ATOMIC_ACQUIRE) > 0)
+    {
+        __atomic_sub_fetch(&mbox->overflow[__builtin_ctz(req->cmd)], 1, __ATOMIC_RELEASE);
+        dream_request_free(req);
+        return NULL;
+    }
+    return req;
+}
+
+/*
+ * Work stealing executor for the dreamers that only react to their mailbox.
+ * A fixed pool of workers, one per cpu by default, each with a Chase-Lev deque:
+ * the owner pushes and takes at the bottom, the other workers steal from the top.
+ * Tasks scheduled from outside the pool go through a lock-less injection list
+ * that a worker grabs in one swap. Idle workers sleep on a futex word bumped by every submit.
+ * A task is queued at most once at a time, so a deque never holds more than all the tasks.
+ */
+struct dream_task
+{
+    struct llist_node inject;
+    void (*run)(struct dream_task *task);
+    int scheduled; /* queued or running */
+};
+
+struct dream_deque
+{
+    long top;
+    long bottom;
+    long mask;
+    struct dream_task **tasks;
+};
+
+struct dream_worker
+{
+    struct dream_deque deque;
+    pthread_t thread;
+    unsigned int rand;
+    unsigned long executed;
+    unsigned long stolen;
+    unsigned long sleeps;
+} __attribute__((aligned(64)));
+
+static struct dream_executor
+{
+    struct dream_worker *workers;
+    int nworkers;
+    struct llist_head inject;
+    int seq; /* futex word bumped on every submit */
+    int idle; /* workers about to sleep or sleeping */
+    int exited; /* dreamer tasks that left their level */
+} dream_executor;
+
+static int dream_workers = -1; /* workers of the executor. 0 for a thread per dreamer. One per cpu by default */
+static __thread struct dream_worker *dream_worker_self;
+
+static void dream_deque_push(struct dream_deque *deque, struct dream_task *task)
+{
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    assert(bottom - top <= deque->mask);
+    __atomic_store_n(&deque->tasks[bottom & deque->mask], task, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+static struct dream_task *dream_deque_take(struct dream_deque *deque)
+{
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    long top;
+    struct dream_task *task;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    if(top > bottom)
+    {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    task = __atomic_load_n(&deque->tasks[bottom & deque->mask], __ATOMIC_RELAXED);
+    if(top == bottom)
+    {
+        /*
+         * The last task. Race the thieves for it.
+         */
+        if(!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            task = NULL;
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+static struct dream_task *dream_deque_steal(struct dream_deque *deque)
+{
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    long bottom;
+    struct dream_task *task;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if(top >= bottom)
+        return NULL;
+    task = __atomic_load_n(&deque->tasks[top & deque->mask], __ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return task;
+}
+
+/*
+ * Let a sleeping worker know about new work.
+ */
+static __inline__ void dream_executor_kick(void)
+{
+    __atomic_add_fetch(&dream_executor.seq, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&dream_executor.idle, __ATOMIC_SEQ_CST))
+        dream_futex_wake(&dream_executor.seq, 0);
+}
+
+/*
+ * Queue a task unless it is queued or running already.
+ */
+static void dream_task_schedule(struct dream_task *task)
+{
+    if(__atomic_exchange_n(&task->scheduled, 1, __ATOMIC_SEQ_CST))
+        return;
+    if(dream_worker_self)
+        dream_deque_push(&dream_worker_self->deque, task);
+    else
+        llist_add(&task->inject, &dream_executor.inject);
+    dream_executor_kick();
+}
+
+static struct dream_task *dream_worker_next(struct dream_worker *worker)
+{
+    struct dream_task *task;
+    struct llist_node *inject;
+    register int i;
+    int victim;
+    if( (task = dream_deque_take(&worker->deque)) )
+        return task;
+    if( (inject = llist_reverse_order(llist_del_all(&dream_executor.inject))) )
+    {
+        task = LIST_ENTRY(inject, struct dream_task, inject);
+        if( (inject = inject->next) )
+        {
+            while(inject)
+            {
+                struct dream_task *next = LIST_ENTRY(inject, struct dream_task, inject);
+                inject = inject->next;
+                dream_deque_push(&worker->deque, next);
+            }
+            dream_executor_kick();
+        }
+        return task;
+    }
+    victim = rand_r(&worker->rand) % dream_executor.nworkers;
+    for(i = 0; i < dream_executor.nworkers; ++i, victim = (victim + 1) % dream_executor.nworkers)
+    {
+        if(&dream_executor.workers[victim] == worker)
+            continue;
+        if( (task = dream_deque_steal(&dream_executor.workers[victim].deque)) )
+        {
+            ++worker->stolen;
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void *dream_worker_thread(void *arg)
+{
+    struct dream_worker *worker = arg;
+    struct sched_param param = {0};
+    int policy = 0;
+    /*
+     * Run at the priority of the level 1 dreamers
+     */
+    assert(pthread_getschedparam(pthread_self(), &policy, &param) == 0);
+    if(param.sched_priority > 12)
+    {
+        param.sched_priority -= 12;
+        assert(pthread_setschedparam(pthread_self(), policy, &param) == 0);
+    }
+    dream_worker_self = worker;
+    for(;;)
+    {
+        int seq = __atomic_load_n(&dream_executor.seq, __ATOMIC_SEQ_CST);
+        struct dream_task *task = dream_worker_next(worker);
+        if(task)
+        {
+            ++worker->executed;
+            task->run(task);
+            continue;
+        }
+        __atomic_add_fetch(&dream_executor.idle, 1, __ATOMIC_SEQ_CST);
+        ++worker->sleeps;
+        dream_futex_wait(&dream_executor.seq, seq);
+        __atomic_sub_fetch(&dream_executor.idle, 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+/*
+ * Start the workers with the scheduling of the caller, sized for up to tasks tasks.
+ */
+static void dream_executor_start(int workers, int tasks)
+{
+    long size = 64;
+    register int i;
+    assert(workers > 0);
+    assert(!dream_executor.nworkers);
+    while(size < tasks)
+        size <<= 1;
+    llist_init(&dream_executor.inject);
+    dream_executor.workers = calloc(workers, sizeof(*dream_executor.workers));
+    assert(dream_executor.workers != NULL);
+    dream_executor.nworkers = workers;
+    for(i = 0; i < workers; ++i)
+    {
+        struct dream_worker *worker = &dream_executor.workers[i];
+        pthread_attr_t attr;
+        worker->deque.mask = size - 1;
+        worker->deque.tasks = calloc(size, sizeof(*worker->deque.tasks));
+        assert(worker->deque.tasks != NULL);
+        worker->rand = i + 1;
+        assert(pthread_attr_init(&attr) == 0);
+        assert(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0);
+        assert(pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED) == 0);
+        assert(dream_thread_create(&worker->thread, &attr, dream_worker_thread, worker) == 0);
+    }
+}
+
+static void dream_executor_stats_print(void)
+{
+    unsigned long executed = 0, stolen = 0, sleeps = 0;
+    register int i;
+    if(!dream_executor.nworkers)
+        return;
+    for(i = 0; i < dream_executor.nworkers; ++i)
+    {
+        executed += __atomic_load_n(&dream_executor.workers[i].executed, __ATOMIC_RELAXED);
+        stolen += __atomic_load_n(&dream_executor.workers[i].stolen, __ATOMIC_RELAXED);
+        sleeps += __atomic_load_n(&dream_executor.workers[i].sleeps, __ATOMIC_RELAXED);
+    }
+    output("Executor: workers [%d], tasks run [%lu], stolen [%lu], sleeps [%lu], dreamers out [%d]\n",
+           dream_executor.nworkers, executed, stolen, sleeps,
+           __atomic_load_n(&dream_executor.exited, __ATOMIC_RELAXED));
+}
+
+/*
+ * Wake up the dreamer waiting on its mailbox. The dreamer mutex is only taken to signal
+ * the dreamer when an inbox turns non-empty as the dreamer checks the inboxes
+ * with the mutex held before waiting.
+ */
+static void dream_mailbox_wakeup(struct dreamer_attr *dattr, int locked)
+{
+    if(dattr->task)
+    {
+        dream_task_schedule(dattr->task);
+        return;
+    }
+    if(!locked)
+        pthread_mutex_lock(&dattr->mutex);
+    dream_cond_signal(&dattr->cond);
+    if(!locked)
+        pthread_mutex_unlock(&dattr->mutex);
+}
+
+/*
+ * Reclaim a chain of requests sent to a closed mailbox. The synchronous callers get a NULL reply.
+ */
+static void dream_mailbox_discard(struct dreamer_attr *dattr, struct llist_node *first,
+                                  struct llist_node *last, int locked)
+{
+    struct dreamer_mailbox *mbox = &dattr->mailbox;
+    for(;;)
+    {
+        struct dreamer_request *req = LIST_ENTRY(first, struct dreamer_request, mailbox);
+        struct llist_node *next = first->next;
+        int end = first == last;
+        if(req->coalesce)
+            dream_mailbox_coalesce_release(mbox, req->cmd);
+        __atomic_sub_fetch(&mbox->depth, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&dream_mailbox_stats.closed, 1, __ATOMIC_RELAXED);
+        dream_request_free(req);
+        if(end)
+            break;
+        first = next;
+    }
+    if(mbox->capacity && __atomic_load_n(&mbox->waiters, __ATOMIC_SEQ_CST))
+    {
+        if(!locked)
+            pthread_mutex_lock(&dattr->mutex);
+        dream_cond_broadcast(&mbox->room);
+        if(!locked)
+            pthread_mutex_unlock(&dattr->mutex);
+    }
+}
+
+/*
+ * Publish a chain of requests (newest first) into a lane of the dreamers mailbox.
+ * The push is lock-less. It is a read section against the dreamer closing its mailbox
+ * on leaving its level, so it either lands before the last drain or sees the mailbox closed.
+ */
+static void dream_mailbox_publish(struct dreamer_attr *dattr, int lane, struct llist_node *first,
+                                  struct llist_node *last, int locked)
+{
+    int wakeup;
+    dream_rcu_read_lock();
+    if(__atomic_load_n(&dattr->mailbox.closed, __ATOMIC_SEQ_CST))
+    {
+        dream_rcu_read_unlock();
+        dream_mailbox_discard(dattr, first, last, locked);
+        return;
+    }
+    wakeup = llist_add_batch(first, last, &dattr->mailbox.inbox[lane]);
+    dream_rcu_read_unlock();
+    if(wakeup)
+        dream_mailbox_wakeup(dattr, locked);
+}
+
+/*
+ * Batch of commands for one or more dreamers, published with one splice
+ * and at most one wakeup per dreamer. Commands to the same dreamer keep their order.
+ * Either fill one with dream_batch_add and publish it with dream_batch_flush
+ * or bracket existing dream_enqueue_cmd calls with dream_batch_begin/dream_batch_end.
+ * Flush without holding the mutex of any dreamer in the batch.
+ */
+#define DREAM_BATCH_TARGETS (DREAMERS + 1)
+
+struct dream_batch
+{
+    struct dream_batch_target
+    {
+        struct dreamer_attr *dattr;
+        struct llist_node *first[DREAM_LANES]; /* latest request as the inbox is LIFO */
+        struct llist_node *last[DREAM_LANES]; /* earliest request */
+    } targets[DREAM_BATCH_TARGETS];
+    int ntargets;
+    struct dream_batch *outer; /* batch being built when this one began */
+};
+
+static __inline__ void dream_batch_init(struct dream_batch *batch)
+{
+    batch->ntargets = 0;
+    batch->outer = NULL;
+}
+
+static void dream_batch_flush(struct dream_batch *batch)
+{
+    register int i;
+    for(i = 0; i < batch->ntargets; ++i)
+    {
+        struct dream_batch_target *target = &batch->targets[i];
+        int wakeup = 0;
+        register int lane;
+        for(lane = 0; lane < DREAM_LANES; ++lane)
+        {
+            if(!target->first[lane])
+                continue;
+            wakeup |= llist_add_batch(target->first[lane], target->last[lane],
+                                      &target->dattr->mailbox.inbox[lane]);
+        }
+        if(wakeup)
+            dream_mailbox_wakeup(target->dattr, 0);
+    }
+    batch->ntargets = 0;
+}
+
+/*
+ * Publish the requests of the batch to one dreamer only, ahead of a request published
+ * to him directly which would otherwise overtake them. The dreamer mutex may be held.
+ */
+static void dream_batch_flush_target(struct dream_batch *batch, struct dreamer_attr *dattr, int locked)
+{
+    register int i;
+    for(i = 0; i < batch->ntargets; ++i)
+    {
+        struct dream_batch_target *target = &batch->targets[i];
+        register int lane;
+        if(target->dattr != dattr)
+            continue;
+        for(lane = 0; lane < DREAM_LANES; ++lane)
+        {
+            if(!target->first[lane])
+                continue;
+            dream_mailbox_publish(dattr, lane, target->first[lane], target->last[lane], locked);
+            target->first[lane] = target->last[lane] = NULL;
+        }
+        break;
+    }
+}
+
+/*
+ * Wait for the dreamer to make room in its mailbox. Bounded by the level period of the dreamer.
+ */
+static void dream_mailbox_wait_room(struct dreamer_attr *dattr, int locked)
+{
+    struct dreamer_mailbox *mbox = &dattr->mailbox;
+    unsigned long long deadline;
+    if(!locked)
+        pthread_mutex_lock(&dattr->mutex);
+    __atomic_add_fetch(&mbox->waiters, 1, __ATOMIC_SEQ_CST);
+    deadline = dream_time_ns() + dream_period(dattr->level);
+    while(__atomic_load_n(&mbox->depth, __ATOMIC_SEQ_CST) > mbox->capacity)
+    {
+        if(dream_cond_timedwait(&mbox->room, &dattr->mutex, deadline) == ETIMEDOUT)
+        {
+            __atomic_add_fetch(&dream_mailbox_stats.block_timeouts, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    __atomic_sub_fetch(&mbox->waiters, 1, __ATOMIC_SEQ_CST);
+    if(!locked)
+        pthread_mutex_unlock(&dattr->mutex);
+}
+
+/*
+ * Account a request about to be queued against the mailbox capacity.
+ * Returns -1 if the overflow policy of the command refuses the request.
+ * Requests of the batch being built are published before blocking as they take room in the mailbox.
+ */
+static int dream_mailbox_reserve(struct dreamer_attr *dattr, int cmd, int flags,
+                                 struct dream_batch *batch, int locked)
+{
+    struct dreamer_mailbox *mbox = &dattr->mailbox;
+    int policy;
+    int depth = __atomic_add_fetch(&mbox->depth, 1, __ATOMIC_SEQ_CST);
+    int high_water = __atomic_load_n(&mbox->high_water, __ATOMIC_RELAXED);
+    if(mbox->capacity && depth > mbox->capacity)
+    {
+        policy = dream_cmd_class(cmd)->overflow;
+        if(!(flags & DREAM_SEND_PERIODIC) && policy >= DREAM_OVERFLOW_DROP_OLDEST)
+            policy = DREAM_OVERFLOW_BLOCK;
+        if( (flags & DREAM_SEND_NOWAIT) && policy == DREAM_OVERFLOW_BLOCK)
+            policy = DREAM_OVERFLOW_FAIL;
+        __atomic_add_fetch(&dream_mailbox_stats.overflow[policy], 1, __ATOMIC_RELAXED);
+        switch(policy)
+        {
+        case DREAM_OVERFLOW_FAIL:
+        case DREAM_OVERFLOW_DROP_NEWEST:
+            __atomic_sub_fetch(&mbox->depth, 1, __ATOMIC_SEQ_CST);
+            return -1;
+        case DREAM_OVERFLOW_DROP_OLDEST:
+            __atomic_add_fetch(&mbox->overflow[__builtin_ctz(cmd)], 1, __ATOMIC_RELEASE);
+            break;
+        case DREAM_OVERFLOW_BLOCK:
+        default:
+            if( (flags & DREAM_SEND_FORCE) )
+            {
+                __atomic_add_fetch(&dream_mailbox_stats.block_timeouts, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            if(batch)
+                dream_batch_flush(batch);
+            dream_mailbox_wait_room(dattr, locked);
+            break;
+        }
+    }
+    while(depth > high_water
+          &&
+          !__atomic_compare_exchange_n(&mbox->high_water, &high_water, depth, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/*
+ * Give up the coalescing slot of a request refused by the mailbox.
+ * Enqueues merged into it meanwhile go with it.
+ */
+static __inline__ void dream_mailbox_uncoalesce(struct dreamer_attr *dattr, int cmd)
+{
+    dream_mailbox_coalesce_release(&dattr->mailbox, cmd);
+}
+
+static void dream_batch_add_request(struct dream_batch *batch, struct dreamer_request *req)
+{
+    struct dream_batch_target *target = NULL;
+    int lane = dream_cmd_lane(req->cmd);
+    register int i;
+    for(i = 0; i < batch->ntargets; ++i)
+    {
+        if(batch->targets[i].dattr == req->dattr)
+        {
+            target = &batch->targets[i];
+            break;
+        }
+    }
+    if(!target)
+    {
+        /*
+         * Out of targets. Publish what we have so far to keep the order per dreamer.
+         */
+        if(batch->ntargets == DREAM_BATCH_TARGETS)
+            dream_batch_flush(batch);
+        target = &batch->targets[batch->ntargets++];
+        memset(target, 0, sizeof(*target));
+        target->dattr = req->dattr;
+    }
+    if(!target->first[lane])
+    {
+        target->first[lane] = target->last[lane] = &req->mailbox;
+        return;
+    }
+    req->mailbox.next = target->first[lane];
+    target->first[lane] = &req->mailbox;
+}
+
+static int __dream_batch_add(struct dream_batch *batch, struct dreamer_attr *dattr, int cmd, void *arg, int level,
+                             int flags)
+{
+    struct dreamer_request *req = NULL;
+    int coalesce = 0;
+    assert(level > 0 && level <= dream_depth);
+    if(__atomic_load_n(&dattr->mailbox.closed, __ATOMIC_ACQUIRE))
+    {
+        __atomic_add_fetch(&dream_mailbox_stats.closed, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if(dream_mailbox_coalesce(&dattr->mailbox, cmd, arg, &coalesce))
+        return 0;
+    if(dream_mailbox_reserve(dattr, cmd, flags, batch, 0) < 0)
+    {
+        if(coalesce)
+            dream_mailbox_uncoalesce(dattr, cmd);
+        return -1;
+    }
+    req = dream_request_alloc();
+    req->coalesce = coalesce;
+    req->periodic = !!(flags & DREAM_SEND_PERIODIC);
+    req->dattr = dattr;
+    req->cmd = cmd;
+    req->arg = arg;
+    dream_batch_add_request(batch, req);
+    return 0;
+}
+
+static __inline__ int dream_batch_add(struct dream_batch *batch, struct dreamer_attr *dattr, int cmd, void *arg,
+                                      int level)
+{
+    return __dream_batch_add(batch, dattr, cmd, arg, level, 0);
+}
+
+static void dream_batch_begin(struct dream_batch *batch)
+{
+    dream_batch_init(batch);
+    batch->outer = dream_batch_current;
+    dream_batch_current = batch;
+}
+
+static void dream_batch_end(struct dream_batch *batch)
+{
+    assert(dream_batch_current == batch);
+    dream_batch_current = batch->outer;
+    dream_batch_flush(batch);
+}
+
+/*
+ * Queue the command to the dreamers mailbox or to the batch being built by this thread.
+ * Locked and future enqueues are published right away, behind the requests of the batch to the same dreamer.
+ * Returns -1 if the command was refused by a full mailbox or the dreamer has left its level.
+ */
+static int __dream_enqueue_cmd(struct dreamer_attr *dattr, int cmd, void *arg, int level, int locked,
+                               struct dream_future *future)
+{
+    struct dreamer_request *req = NULL;
+    struct dream_batch *batch = locked || future ? NULL : dream_batch_current;
+    int coalesce = 0;
+    assert(level > 0 && level <= dream_depth);
+    if(__atomic_load_n(&dattr->mailbox.closed, __ATOMIC_ACQUIRE))
+    {
+        __atomic_add_fetch(&dream_mailbox_stats.closed, 1, __ATOMIC_RELAXED);
+        if(future)
+            dream_future_complete(future, NULL);
+        return -1;
+    }
+    if(!future && dream_mailbox_coalesce(&dattr->mailbox, cmd, arg, &coalesce))
+        return 0;
+    if(dream_mailbox_reserve(dattr, cmd, 0, batch, locked) < 0)
+    {
+        if(coalesce)
+            dream_mailbox_uncoalesce(dattr, cmd);
+        if(future)
+            dream_future_complete(future, NULL);
+        return -1;
+    }
+    req = dream_request_alloc();
+    req->coalesce = coalesce;
+    req->dattr = dattr;
+    req->cmd = cmd;
+    req->arg = arg;
+    req->future = future;
+    if(batch)
+    {
+        dream_batch_add_request(batch, req);
+        return 0;
+    }
+    if(dream_batch_current)
+        dream_batch_flush_target(dream_batch_current, dattr, locked);
+    dream_mailbox_publish(dattr, dream_cmd_lane(cmd), &req->mailbox, &req->mailbox, locked);
+    return 0;
+}
+
+static __inline__ int dream_enqueue_cmd(struct dreamer_attr *dattr, int cmd, void *arg, int level)
+{
+    return __dream_enqueue_cmd(dattr, cmd, arg, level, 0, NULL);
+}
+
+static __inline__ void dream_enqueue_cmd_safe(struct dreamer_attr *dattr, int cmd, 
+                                              void *arg, int level, pthread_mutex_t *dreamer_lock)
+{
+    /*
+     * Drop the current level dreamer lock before reacquiring.
+     */
+    pthread_mutex_unlock(dreamer_lock);
+    __dream_enqueue_cmd(dattr, cmd, arg, level, 0, NULL);
+    pthread_mutex_lock(dreamer_lock);
+}
+
+static __inline__ int dream_enqueue_cmd_locked(struct dreamer_attr *dattr, int cmd, void *arg, int level)
+{
+    return __dream_enqueue_cmd(dattr, cmd, arg, level, 1, NULL);
+}
+
+/*
+ * Send a synchronous request and wait for the reply. Never coalesced or batched
+ * as the caller blocks right away. Returns the reply or NULL if the request was refused or dropped.
+ */
+static void *dream_call_cmd(struct dreamer_attr *dattr, int cmd, void *arg, int level)
+{
+    struct dream_future future;
+    void *reply;
+    dream_future_init(&future);
+    __dream_enqueue_cmd(dattr, cmd, arg, level, 0, &future);
+    reply = dream_future_wait(&future);
+    dream_future_destroy(&future);
+    return reply;
+}
+
+/*
+ * Hierarchical timer wheel for scheduled and periodic commands.
+ * DREAM_WHEELS wheels of DREAM_WHEEL_SLOTS slots. The first wheel has a slot per tick and
+ * every next wheel a slot per turn of the wheel below, so arming and cancelling a timer is O(1)
+ * however far out it expires. Timers cascade down a wheel when their slot comes up.
+ * A single thread turns the wheels. It sleeps till the next slot holding timers and publishes
+ * the commands due at that point as one batch, so no dreamer needs a timed wait of its own
+ * for periodic work. Commands are never delivered before they are due.
+ * The commands are published with the wheel unlocked and the wheel thread never waits
+ * for room in a mailbox: a one-shot refused by a full mailbox is retried on the next tick,
+ * and queued beyond the capacity after a level period of retries like a blocked send.
+ */
+#define DREAM_WHEEL_BITS (6)
+#define DREAM_WHEEL_SLOTS (1 << DREAM_WHEEL_BITS)
+#define DREAM_WHEEL_MASK (DREAM_WHEEL_SLOTS - 1)
+#define DREAM_WHEELS (4)
+#define DREAM_WHEEL_TICK (1000000ULL) /* ns */
+#define DREAM_WHEEL_MAX_TICKS ( (1ULL << (DREAM_WHEELS * DREAM_WHEEL_BITS)) - 1)
+#define DREAM_WHEEL_IDLE (~0ULL)
+
+struct dream_timer
+{
+    struct list list;
+    struct list_head *slot;
+    struct list fired; /* in the commands being published by the wheel thread */
+    unsigned long long expires; /* tick */
+    unsigned long long period; /* ticks. 0 for a one shot */
+    unsigned long long due; /* time the command being published was due */
+    unsigned long long first; /* time a one-shot was first published. It is forced after a period of retries */
+    struct dreamer_attr *dattr;
+    int cmd;
+    void *arg;
+    int level;
+    int inflight; /* commands being published */
+    int cancelled;
+    int retry; /* the one-shot was refused by a full mailbox */
+};
+
+static struct dream_wheel
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_cond_t published; /* broadcast as the commands in flight of cancelled timers are done */
+    unsigned long long start; /* time of tick 0 */
+    unsigned long long tick; /* next tick to run */
+    unsigned long long sleep; /* tick the wheel thread sleeps till. 0 while running */
+    struct list_head slots[DREAM_WHEELS][DREAM_WHEEL_SLOTS];
+    int timers; /* armed timers */
+    unsigned long fired;
+    unsigned long cascaded;
+    unsigned long wakeups;
+    unsigned long retries; /* one-shots retried on a full mailbox */
+    unsigned long long worst_lateness; /* ns of dream_time_ns from the due time to the publish */
+} dream_wheel = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static __inline__ unsigned long long dream_wheel_ticks(unsigned long long ns)
+{
+    if(ns <= dream_wheel.start)
+        return 0;
+    return (ns - dream_wheel.start + DREAM_WHEEL_TICK - 1) / DREAM_WHEEL_TICK;
+}
+
+static void dream_wheel_add(struct dream_timer *timer)
+{
+    unsigned long long delta;
+    register int wheel;
+    if(timer->expires < dream_wheel.tick)
+        timer->expires = dream_wheel.tick;
+    delta = timer->expires - dream_wheel.tick;
+    if(delta > DREAM_WHEEL_MAX_TICKS)
+    {
+        delta = DREAM_WHEEL_MAX_TICKS;
+        timer->expires = dream_wheel.tick + delta;
+    }
+    for(wheel = 0; wheel < DREAM_WHEELS - 1; ++wheel)
+    {
+        if(delta < 1ULL << ( (wheel + 1) * DREAM_WHEEL_BITS))
+            break;
+    }
+    timer->slot = &dream_wheel.slots[wheel][(timer->expires >> (wheel * DREAM_WHEEL_BITS)) & DREAM_WHEEL_MASK];
+    list_add_tail(&timer->list, timer->slot);
+}
+
+/*
+ * Re-add the timers of the current slot of a wheel to the wheels below.
+ */
+static void dream_wheel_cascade(int wheel)
+{
+    LIST_DECLARE(timers);
+    list_splice_tail(&dream_wheel.slots[wheel][(dream_wheel.tick >> (wheel * DREAM_WHEEL_BITS)) & DREAM_WHEEL_MASK],
+                     &timers);
+    while(timers.head)
+    {
+        struct dream_timer *timer = LIST_ENTRY(timers.head, struct dream_timer, list);
+        list_del(&timer->list, &timers);
+        dream_wheel_add(timer);
+        ++dream_wheel.cascaded;
+    }
+}
+
+/*
+ * Run the current tick. Timers due go into the fired list to be published and periodic timers
+ * are re-armed on their own schedule, skipping the periods already missed.
+ */
+static void dream_wheel_run_tick(struct list_head *fired)
+{
+    LIST_DECLARE(due);
+    register int wheel;
+    for(wheel = 1;
+        wheel < DREAM_WHEELS && !( (dream_wheel.tick >> ( (wheel - 1) * DREAM_WHEEL_BITS)) & DREAM_WHEEL_MASK);
+        ++wheel)
+        dream_wheel_cascade(wheel);
+    list_splice_tail(&dream_wheel.slots[0][dream_wheel.tick & DREAM_WHEEL_MASK], &due);
+    ++dream_wheel.tick;
+    while(due.head)
+    {
+        struct dream_timer *timer = LIST_ENTRY(due.head, struct dream_timer, list);
+        list_del(&timer->list, &due);
+        /*
+         * A periodic command still in flight from the previous tick is not sent twice
+         */
+        if(!timer->inflight)
+        {
+            timer->due = dream_wheel.start + timer->expires * DREAM_WHEEL_TICK;
+            ++timer->inflight;
+            list_add_tail(&timer->fired, fired);
+        }
+        if(!timer->period)
+            continue; /* the publish frees it */
+        while(timer->expires < dream_wheel.tick)
+            timer->expires += timer->period;
+        dream_wheel_add(timer);
+    }
+}
+
+/*
+ * Publish the commands of the fired timers as one batch with the wheel unlocked,
+ * so arming and cancelling timers never waits on a full mailbox.
+ * A timer cancelled meanwhile is skipped. Its canceller waits for the command in flight.
+ */
+static void dream_wheel_publish(struct list_head *fired)
+{
+    struct dream_batch batch;
+    unsigned long long now = dream_time_ns(), worst_lateness = 0;
+    register struct list *iter;
+    dream_batch_init(&batch);
+    for(iter = fired->head; iter; iter = iter->next)
+    {
+        struct dream_timer *timer = LIST_ENTRY(iter, struct dream_timer, fired);
+        if(__atomic_load_n(&timer->cancelled, __ATOMIC_ACQUIRE))
+            continue;
+        if(now > timer->due && now - timer->due > worst_lateness)
+            worst_lateness = now - timer->due;
+        if(timer->period)
+        {
+            __dream_batch_add(&batch, timer->dattr, timer->cmd, timer->arg, timer->level, DREAM_SEND_PERIODIC);
+            continue;
+        }
+        if(!timer->first)
+            timer->first = now;
+        timer->retry = __dream_batch_add(&batch, timer->dattr, timer->cmd, timer->arg, timer->level,
+                                         now - timer->first < dream_period(timer->level) ?
+                                         DREAM_SEND_NOWAIT : DREAM_SEND_FORCE) < 0;
+    }
+    dream_batch_flush(&batch);
+    pthread_mutex_lock(&dream_wheel.mutex);
+    if(worst_lateness > dream_wheel.worst_lateness)
+        dream_wheel.worst_lateness = worst_lateness;
+    while(fired->head)
+    {
+        struct dream_timer *timer = LIST_ENTRY(fired->head, struct dream_timer, fired);
+        list_del(&timer->fired, fired);
+        --timer->inflight;
+        if(timer->cancelled)
+        {
+            dream_cond_broadcast(&dream_wheel.published);
+            continue;
+        }
+        if(timer->retry)
+        {
+            timer->retry = 0;
+            ++dream_wheel.retries;
+            timer->expires = dream_wheel.tick;
+            dream_wheel_add(timer);
+            continue;
+        }
+        ++dream_wheel.fired;
+        if(!timer->period)
+        {
+            --dream_wheel.timers;
+            free(timer);
+        }
+    }
+}
+
+/*
+ * The first tick holding a timer or a cascade. DREAM_WHEEL_IDLE if the wheels are empty.
+ */
+static unsigned long long dream_wheel_next(void)
+{
+    unsigned long long next = DREAM_WHEEL_IDLE;
+    register int wheel, i;
+    if(!dream_wheel.timers)
+        return next;
+    for(i = 0; i < DREAM_WHEEL_SLOTS; ++i)
+    {
+        if(dream_wheel.slots[0][(dream_wheel.tick + i) & DREAM_WHEEL_MASK].head)
+            return dream_wheel.tick + i;
+    }
+    for(wheel = 1; wheel < DREAM_WHEELS; ++wheel)
+    {
+        int shift = wheel * DREAM_WHEEL_BITS;
+        for(i = 0; i <= DREAM_WHEEL_SLOTS; ++i)
+        {
+            unsigned long long block = (dream_wheel.tick >> shift) + i;
+            if( (block << shift) < dream_wheel.tick)
+                continue;
+            if(dream_wheel.slots[wheel][block & DREAM_WHEEL_MASK].head)
+            {
+                if( (block << shift) < next)
+                    next = block << shift;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+static void *dream_wheel_thread(void *unused)
+{
+    pthread_mutex_lock(&dream_wheel.mutex);
+    for(;;)
+    {
+        unsigned long long now = (dream_time_ns() - dream_wheel.start) / DREAM_WHEEL_TICK;
+        unsigned long long next = dream_wheel_next();
+        if(next <= now)
+        {
+            LIST_DECLARE(fired);
+            /*
+             * Nothing happens on the ticks before the next one holding timers
+             */
+            if(dream_wheel.tick < next)
+                dream_wheel.tick = next;
+            while(dream_wheel.tick <= now)
+                dream_wheel_run_tick(&fired);
+            if(fired.head)
+            {
+                pthread_mutex_unlock(&dream_wheel.mutex);
+                dream_wheel_publish(&fired);
+            }
+            continue;
+        }
+        dream_wheel.sleep = next;
+        ++dream_wheel.wakeups;
+        if(next == DREAM_WHEEL_IDLE)
+            dream_cond_wait(&dream_wheel.cond, &dream_wheel.mutex);
+        else
+            dream_cond_timedwait(&dream_wheel.cond, &dream_wheel.mutex, dream_wheel.start + next * DREAM_WHEEL_TICK);
+        dream_wheel.sleep = 0;
+    }
+    return NULL;
+}
+
+/*
+ * Start the wheel thread with the scheduling of the caller.
+ */
+static void dream_wheel_start(void)
+{
+    pthread_attr_t attr;
+    pthread_t wheel;
+    register int i, j;
+    assert(arch_cond_init(&dream_wheel.cond) == 0);
+    assert(arch_cond_init(&dream_wheel.published) == 0);
+    for(i = 0; i < DREAM_WHEELS; ++i)
+        for(j = 0; j < DREAM_WHEEL_SLOTS; ++j)
+            list_init(&dream_wheel.slots[i][j]);
+    dream_wheel.start = dream_time_ns();
+    assert(pthread_attr_init(&attr) == 0);
+    assert(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0);
+    assert(pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED) == 0);
+    assert(dream_thread_create(&wheel, &attr, dream_wheel_thread, NULL) == 0);
+}
+
+static struct dream_timer *dream_timer_arm(struct dreamer_attr *dattr, int cmd, void *arg, int level,
+                                           unsigned long long when, unsigned long long period)
+{
+    struct dream_timer *timer = calloc(1, sizeof(*timer));
+    assert(timer != NULL);
+    assert(level > 0 && level <= dream_depth);
+    timer->dattr = dattr;
+    timer->cmd = cmd;
+    timer->arg = arg;
+    timer->level = level;
+    timer->period = period;
+    pthread_mutex_lock(&dream_wheel.mutex);
+    /*
+     * Nothing to cascade on empty wheels. Catch up with the clock so the timer lands on the first wheel.
+     */
+    if(!dream_wheel.timers)
+    {
+        unsigned long long now = dream_wheel_ticks(dream_time_ns());
+        if(now > dream_wheel.tick)
+            dream_wheel.tick = now;
+    }
+    timer->expires = dream_wheel_ticks(when);
+    dream_wheel_add(timer);
+    ++dream_wheel.timers;
+    if(timer->expires < dream_wheel.sleep)
+        dream_cond_signal(&dream_wheel.cond);
+    pthread_mutex_unlock(&dream_wheel.mutex);
+    return timer;
+}
+
+/*
+ * Deliver the command at the time given by dream_time_ns.
+ */
+static __inline__ void dream_enqueue_cmd_at(struct dreamer_attr *dattr, int cmd, void *arg, int level,
+                                            unsigned long long when)
+{
+    dream_timer_arm(dattr, cmd, arg, level, when, 0);
+}
+
+/*
+ * Deliver the command every period ns, starting a period from now, till the timer is cancelled.
+ */
+static __inline__ struct dream_timer *dream_enqueue_cmd_every(struct dreamer_attr *dattr, int cmd, void *arg,
+                                                              int level, unsigned long long period)
+{
+    unsigned long long ticks = period / DREAM_WHEEL_TICK;
+    return dream_timer_arm(dattr, cmd, arg, level, dream_time_ns() + period, ticks ? ticks : 1);
+}
+
+/*
+ * No command of the timer is delivered once this returns.
+ */
+static void dream_timer_cancel(struct dream_timer *timer)
+{
+    if(!timer)
+        return;
+    pthread_mutex_lock(&dream_wheel.mutex);
+    list_del(&timer->list, timer->slot);
+    __atomic_store_n(&timer->cancelled, 1, __ATOMIC_RELEASE);
+    while(timer->inflight)
+        dream_cond_wait(&dream_wheel.published, &dream_wheel.mutex);
+    --dream_wheel.timers;
+    pthread_mutex_unlock(&dream_wheel.mutex);
+    free(timer);
+}
+
+static void dream_wheel_stats_print(void)
+{
+    pthread_mutex_lock(&dream_wheel.mutex);
+    output("Timer wheel: fired [%lu], cascaded [%lu], wakeups [%lu], retries [%lu], armed [%d], "
+           "worst lateness [%.1f us]\n",
+           dream_wheel.fired, dream_wheel.cascaded, dream_wheel.wakeups, dream_wheel.retries, dream_wheel.timers,
+           (double)dream_wheel.worst_lateness/1000);
+    pthread_mutex_unlock(&dream_wheel.mutex);
+}
+
+/*
+ * Move the producers inbox of a lane into its pending FIFO. Only called by the mailbox owner.
+ */
+static void dream_mailbox_fetch(struct dreamer_mailbox *mbox, int lane)
+{
+    struct llist_node *iter = llist_reverse_order(llist_del_all(&mbox->inbox[lane]));
+    while(iter)
+    {
+        struct dreamer_request *req = LIST_ENTRY(iter, struct dreamer_request, mailbox);
+        iter = iter->next;
+        list_add_tail(&req->list, &mbox->pending[lane]);
+    }
+}
+
+/*
+ * The mailbox is drained lock-less by its owner. The _locked variant is kept for the
+ * request loops that hold the dreamer mutex for their condition waits.
+ */
+static struct dreamer_request *dream_dequeue_cmd_locked(struct dreamer_attr *dattr)
+{
+    struct dreamer_mailbox *mbox = &dattr->mailbox;
+    register int lane;
+    for(lane = 0; lane < DREAM_LANES; ++lane)
+    {
+        for(;;)
+        {
+            struct dreamer_request *req = NULL;
+            struct list *head = NULL;
+            if(!mbox->pending[lane].nodes)
+            {
+                dream_mailbox_fetch(mbox, lane);
+                if(!mbox->pending[lane].nodes)
+                    break;
+            }
+            head = mbox->pending[lane].head;
+            assert(head != NULL);
+            list_del(head, &mbox->pending[lane]);
+            if( (req = dream_mailbox_dequeued(LIST_ENTRY(head, struct dreamer_request, list))) )
+                return req;
+        }
+    }
+    return NULL;
+}
+
+static __inline__ struct dreamer_request *dream_dequeue_cmd(struct dreamer_attr *dattr)
+{
+    return dream_dequeue_cmd_locked(dattr);
+}
+
+static __inline__ int dream_mailbox_empty(struct dreamer_mailbox *mbox)
+{
+    register int lane;
+    for(lane = 0; lane < DREAM_LANES; ++lane)
+    {
+        if(mbox->pending[lane].nodes || !llist_empty(&mbox->inbox[lane]))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Called with the dreamer mutex held. Producers only signal the empty to non-empty
+ * transition of the inbox. So recheck the mailbox before sleeping on the level condition.
+ */
+static void dream_wait_cmd_locked(struct dreamer_attr *dattr, unsigned long long deadline)
+{
+    if(!dream_mailbox_empty(&dattr->mailbox))
+        return;
+    if(deadline)
+        dream_cond_timedwait(&dattr->cond, &dattr->mutex, deadline);
+    else
+        dream_cond_wait(&dattr->cond, &dattr->mutex);
+}
+
+/*
+ * Wait up to the deadline of the request loop for the mailbox to turn non-empty.
+ * The deadline starts a level period out and moves on by whole periods once passed,
+ * so the loop keeps its period across early wakeups and the time spent on the requests.
+ * Without a deadline the wait lasts till the next request.
+ * The dreamer mutex is only held across the mailbox check and the wait.
+ */
+static void dream_wait_cmd(struct dreamer_attr *dattr, unsigned long long *deadline)
+{
+    unsigned long long now;
+    if(!dream_mailbox_empty(&dattr->mailbox))
+        return;
+    if(deadline)
+    {
+        now = dream_time_ns();
+        if(!*deadline)
+            *deadline = now + dream_period(dattr->level);
+        while(*deadline <= now)
+            *deadline += dream_period(dattr->level);
+    }
+    pthread_mutex_lock(&dattr->mutex);
+    dream_wait_cmd_locked(dattr, deadline ? *deadline : 0);
+    pthread_mutex_unlock(&dattr->mutex);
+}
+
+/*
+ * Detach the whole mailbox into the callers list, control lane first. The pending FIFOs
+ * are spliced in O(1) so the batch is processed with no lock held while the producers keep pushing.
+ * Only called by the mailbox owner.
+ */
+static int dream_drain_cmds(struct dreamer_attr *dattr, struct list_head *cmds)
+{
+    register int lane;
+    for(lane = 0; lane < DREAM_LANES; ++lane)
+    {
+        dream_mailbox_fetch(&dattr->mailbox, lane);
+        list_splice_tail(&dattr->mailbox.pending[lane], cmds);
+    }
+    return cmds->nodes;
+}
+
+static __inline__ struct dreamer_request *dream_cmd_pop(struct list_head *cmds)
+{
+    struct list *head;
+    while( (head = cmds->head) )
+    {
+        struct dreamer_request *req;
+        list_del(head, cmds);
+        if( (req = dream_mailbox_dequeued(LIST_ENTRY(head, struct dreamer_request, list))) )
+            return req;
+    }
+    return NULL;
+}
+
+/*
+ * Next command of a drained batch. Control commands that arrived while the batch is
+ * being worked through overtake the data commands left in it.
+ */
+static __inline__ struct dreamer_request *dream_cmd_next(struct dreamer_attr *dattr, struct list_head *cmds)
+{
+    struct dreamer_mailbox *mbox = &dattr->mailbox;
+    struct list *head = cmds->head;
+    if(head
+       &&
+       dream_cmd_lane((LIST_ENTRY(head, struct dreamer_request, list))->cmd) != DREAM_LANE_CONTROL
+       &&
+       !llist_empty(&mbox->inbox[DREAM_LANE_CONTROL]))
+    {
+        dream_mailbox_fetch(mbox, DREAM_LANE_CONTROL);
+        list_splice_tail(cmds, &mbox->pending[DREAM_LANE_CONTROL]);
+        list_splice_tail(&mbox->pending[DREAM_LANE_CONTROL], cmds);
+    }
+    return dream_cmd_pop(cmds);
+}
+
+/*
+ * Drop the rest of a drained batch when leaving a level.
+ */
+static void dream_cmds_release(struct list_head *cmds)
+{
+    struct dreamer_request *req;
+    while( (req = dream_cmd_pop(cmds)) )
+        dream_request_free(req);
+}
+
+/*
+ * Reusable barrier the dreamers entering a level meet at. Arrivals are counted atomically
+ * and the last arrival bumps the generation and wakes up all the waiters with one futex wake.
+ */
+struct dream_barrier
+{
+    int expected;
+    int arrived;
+    int generation; /* futex word */
+    unsigned long long released; /* time of the last release */
+    unsigned long long release_latency; /* worst time from the last arrival to a waiter running */
+};
+
+/*
+ * Dreamers expected at each level. Yusuf stays back at level 1 and Arthur at level 2.
+ * Eames stays at level 3 while the others enter limbo. The levels on their way to limbo
+ * expect them too.
+ */
+static struct dream_barrier dream_level_barriers[DREAM_LEVELS_MAX] = {
+    { .expected = DREAMERS },
+    { .expected = DREAMERS - 1 },
+    { .expected = DREAMERS - 2 },
+    { .expected = DREAMERS - 3 },
+};
+
+/*
+ * Count an arrival. Returns 1 for the last arrival that released the waiters.
+ */
+static int dream_barrier_arrive(struct dream_barrier *barrier)
+{
+    if(__atomic_add_fetch(&barrier->arrived, 1, __ATOMIC_ACQ_REL) != barrier->expected)
+        return 0;
+    __atomic_store_n(&barrier->arrived, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&barrier->released, arch_time_ns(), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&barrier->generation, 1, __ATOMIC_RELEASE);
+    dream_futex_wake(&barrier->generation, 1);
+    return 1;
+}
+
+/*
+ * Arrive and wait for the last arrival.
+ */
+static void dream_barrier_wait(struct dream_barrier *barrier)
+{
+    int generation = __atomic_load_n(&barrier->generation, __ATOMIC_ACQUIRE);
+    unsigned long long latency, worst;
+    if(dream_barrier_arrive(barrier))
+        return;
+    while(__atomic_load_n(&barrier->generation, __ATOMIC_ACQUIRE) == generation)
+        dream_futex_wait(&barrier->generation, generation);
+    latency = arch_time_ns() - __atomic_load_n(&barrier->released, __ATOMIC_RELAXED);
+    worst = __atomic_load_n(&barrier->release_latency, __ATOMIC_RELAXED);
+    while(latency > worst
+          &&
+          !__atomic_compare_exchange_n(&barrier->release_latency, &worst, latency, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void dream_barrier_stats_print(void)
+{
+    register int level;
+    output("Level barriers, worst release latency:");
+    for(level = 1; level <= dream_depth; ++level)
+        output(" level %d [%d] [%.1f us]", level, dream_level_barriers[level-1].expected,
+               (double)dream_level_barriers[level-1].release_latency/1000);
+    output("\n");
+}
+
+/*
+ * Set the depth of the dream before the registry is sized. The period keeps doubling
+ * past level 4 up to DREAM_DELAY_MAX, so time runs slower the deeper the level.
+ * The dreamers past level 3 all go down to limbo, so they meet in the same numbers.
+ */
+static void dream_levels_init(int depth)
+{
+    register int level;
+    assert(depth >= DREAM_LEVELS && depth <= DREAM_LEVELS_MAX);
+    dream_depth = depth;
+    for(level = DREAM_LEVELS + 1; level <= depth; ++level)
+    {
+        dream_delay_map[level-1] = dream_delay_map[level-2] < DREAM_DELAY_MAX / 2 ?
+            dream_delay_map[level-2] * 2 : DREAM_DELAY_MAX;
+        dream_level_barriers[level-1].expected = dream_level_barriers[DREAM_LEVELS-1].expected;
+    }
+}
+
+/*
+ * Size the registry for a number of dreamers. Drops the dreamers interned so far.
+ * Called before any dreamer is created.
+ */
+static void dream_registry_init(int dreamers)
+{
+    register int level;
+    void *states = NULL;
+    free(dream_ids);
+    free(dream_states);
+    dream_ids = calloc(dreamers, sizeof(*dream_ids));
+    assert(dream_ids != NULL);
+    dream_state_words = (dream_depth + DREAM_STATE_LEVELS - 1) / DREAM_STATE_LEVELS;
+    assert(posix_memalign(&states, DREAM_CACHE_LINE, dreamers * dream_state_words * sizeof(*dream_states)) == 0);
+    dream_states = memset(states, 0, dreamers * dream_state_words * sizeof(*dream_states));
+    for(level = 0; level < DREAM_LEVELS_MAX; ++level)
+    {
+        free(dreamer_table[level]);
+        dreamer_table[level] = NULL;
+        if(level >= dream_depth)
+            continue;
+        dreamer_table[level] = calloc(dreamers, sizeof(*dreamer_table[level]));
+        assert(dreamer_table[level] != NULL);
+    }
+    memset(dream_role_ids, 0, sizeof(dream_role_ids));
+    dream_nids = 0;
+    dream_max_ids = dreamers;
+}
+
+/*
+ * Called once per dreamer from lucid_dreamer before the dreamer is started.
+ */
+static int dream_id_intern(const char *name, int role)
+{
+    int id = dream_nids;
+    int *role_id = &dream_role_ids[DREAM_ROLE_INDEX(role)];
+    assert(id < dream_max_ids);
+    dream_ids[id].name = name;
+    dream_ids[id].role = role;
+    dream_nids = id + 1;
+    if(!*role_id)
+        __atomic_store_n(role_id, id + 1, __ATOMIC_RELEASE);
+    return id;
+}
+
+/*
+ * Returns -1 if no dreamer of the role was created yet. The first one for roles with many dreamers.
+ */
+static __inline__ int dream_role_id(int role)
+{
+    return __atomic_load_n(&dream_role_ids[DREAM_ROLE_INDEX(role)], __ATOMIC_ACQUIRE) - 1;
+}
+
+/*
+ * Publish the dreamer at its level and wake up the dreamers waiting for it to join.
+ * Called with the level lock held after queueing the dreamer.
+ */
+static __inline__ void dreamer_table_add(struct dreamer_attr *dattr)
+{
+    __atomic_store_n(&dreamer_table[dattr->level-1][dattr->id], dattr, __ATOMIC_RELEASE);
+    dream_cond_broadcast(&dreamer_join_cond[dattr->level-1]);
+}
+
+/*
+ * Unpublish the dreamer leaving its level and close its mailbox. Once the publishers are past
+ * the grace period, the requests left in the mailbox are reclaimed, and the ones sent later
+ * by the dreamers still holding on to it from earlier lookups or timers are reclaimed by the senders.
+ * The dreamer itself stays around for those and for its state.
+ */
+static void dreamer_table_del(struct dreamer_attr *dattr)
+{
+    struct dreamer_request *req;
+    LIST_DECLARE(cmds);
+    pthread_mutex_lock(&dreamer_mutex[dattr->level-1]);
+    if(dreamer_table[dattr->level-1][dattr->id] == dattr)
+        __atomic_store_n(&dreamer_table[dattr->level-1][dattr->id], NULL, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&dreamer_mutex[dattr->level-1]);
+    __atomic_store_n(&dattr->mailbox.closed, 1, __ATOMIC_SEQ_CST);
+    dream_rcu_synchronize();
+    dream_drain_cmds(dattr, &cmds);
+    while( (req = dream_cmd_pop(&cmds)) )
+        dream_request_free(req);
+}
+
+static void dream_level_add(struct dreamer_attr *dattr)
+{
+    pthread_mutex_lock(&dreamer_mutex[dattr->level-1]);
+    list_add_tail(&dattr->list, &dreamer_queue[dattr->level-1]);
+    dreamer_table_add(dattr);
+    pthread_mutex_unlock(&dreamer_mutex[dattr->level-1]);
+}
+
+/*
+ * Join the dreamers at the level of the dreamer and wait for the ones expected there.
+ */
+static void dream_level_join(struct dreamer_attr *dattr)
+{
+    dream_level_add(dattr);
+    dream_barrier_wait(&dream_level_barriers[dattr->level-1]);
+}
+
+/*
+ * Join the level without waiting for the others. For the dreamers without a thread to block.
+ */
+static void dream_level_enter(struct dreamer_attr *dattr)
+{
+    dream_level_add(dattr);
+    dream_barrier_arrive(&dream_level_barriers[dattr->level-1]);
+}
+
+/*
+ * Lock-less. The dreamers are never freed and the sends to a dreamer that has left
+ * its level meanwhile are reclaimed, so the walks need no read section.
+ */
+static __inline__ struct dreamer_attr *dreamer_get(int level, int id)
+{
+    return __atomic_load_n(&dreamer_table[level-1][id], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * State word holding the lane of a level of the dreamer id
+ */
+static __inline__ unsigned long long *dream_state_word(int id, int level)
+{
+    return &dream_states[id * dream_state_words + (level-1) / DREAM_STATE_LEVELS];
+}
+
+/*
+ * State of the dreamer at its level
+ */
+static __inline__ int dream_state(struct dreamer_attr *dattr)
+{
+    return (__atomic_load_n(dream_state_word(dattr->id, dattr->level), __ATOMIC_ACQUIRE)
+            >> DREAM_STATE_SHIFT(dattr->level)) & DREAM_STATE_MASK;
+}
+
+static __inline__ void dream_state_set(struct dreamer_attr *dattr, int state)
+{
+    __atomic_or_fetch(dream_state_word(dattr->id, dattr->level),
+                      (unsigned long long)state << DREAM_STATE_SHIFT(dattr->level), __ATOMIC_ACQ_REL);
+}
+
+static __inline__ void dream_state_clear(struct dreamer_attr *dattr, int state)
+{
+    __atomic_and_fetch(dream_state_word(dattr->id, dattr->level),
+                       ~((unsigned long long)state << DREAM_STATE_SHIFT(dattr->level)), __ATOMIC_ACQ_REL);
+}
+
+/*
+ * Carry the state of the dreamer over to a level it enters.
+ */
+static __inline__ void dream_state_inherit(struct dreamer_attr *dattr, int level)
+{
+    __atomic_or_fetch(dream_state_word(dattr->id, level),
+                      (unsigned long long)dream_state(dattr) << DREAM_STATE_SHIFT(level), __ATOMIC_ACQ_REL);
+}
+
+/*
+ * Check if all the dreamers at a level but the ones with a state in skip have all the bits of state set.
+ * One branch free pass over the state words. The acquire fence orders the relaxed loads of the scan
+ * before whatever the caller does on the result.
+ */
+static int dream_state_all(int level, int state, int skip)
+{
+    unsigned long long all = DREAM_STATE_MASK;
+    int nids = __atomic_load_n(&dream_nids, __ATOMIC_ACQUIRE);
+    register int id;
+    for(id = 0; id < nids; ++id)
+    {
+        unsigned long long lane = (__atomic_load_n(dream_state_word(id, level), __ATOMIC_RELAXED)
+                                   >> DREAM_STATE_SHIFT(level)) & DREAM_STATE_MASK;
+        all &= lane | -(unsigned long long)!!(lane & skip);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (all & state) == (unsigned long long)state;
+}
+
+/*
+ * Lookup the dreamer of a role at a level. Lock-less. NULL if the dreamer hasn't joined the level yet
+ * or has left it.
+ */
+static __inline__ struct dreamer_attr *dreamer_lookup(int level, int role)
+{
+    int id = dream_role_id(role);
+    if(id < 0)
+        return NULL;
+    return dreamer_get(level, id);
+}
+
+/*
+ * Name based lookup. The slow path kept for tooling and debugging, like from gdb.
+ */
+static struct dreamer_attr *dreamer_find(int level, const char *name) __attribute__((unused));
+
+static struct dreamer_attr *dreamer_find(int level, const char *name)
+{
+    register int i;
+    for(i = 0; i < __atomic_load_n(&dream_nids, __ATOMIC_ACQUIRE); ++i)
+    {
+        if(!strcasecmp(dream_ids[i].name, name))
+            return dreamer_get(level, i);
+    }
+    return NULL;
+}
+
+/*
+ * Wait for the dreamer of a role to join the level. Called with the level lock held.
+ * The level lock is dropped while waiting for the join notification.
+ */
+static struct dreamer_attr *dreamer_find_sync_locked(struct dreamer_attr *dreamer, int level, int role)
+{
+    struct dreamer_attr *dattr = NULL;
+    unsigned long long deadline;
+    if(!level) return NULL;
+    deadline = dream_time_ns() + 1000000000ULL;
+    while(!(dattr = dreamer_lookup(level, role)))
+    {
+        if(dream_cond_timedwait(&dreamer_join_cond[level-1], &dreamer_mutex[level-1], deadline) == ETIMEDOUT)
+        {
+            int id = dream_role_id(role);
+            output("[%s] waiting for [%s] to join at level [%d]\n", dreamer->name,
+                   id < 0 ? "Unknown" : dream_ids[id].name, level);
+            deadline += 1000000000ULL;
+        }
+    }
+    return dattr;
+}
+
+static struct dreamer_attr *dreamer_find_sync(struct dreamer_attr *dreamer, int level, int role)
+{
+    struct dreamer_attr *dattr;
+    if(!level) return NULL;
+    pthread_mutex_lock(&dreamer_mutex[level-1]);
+    dattr = dreamer_find_sync_locked(dreamer, level, role);
+    pthread_mutex_unlock(&dreamer_mutex[level-1]);
+    return dattr;
+}
+
+/*
+ * Clone the request command to all the dreamers of a level but dattr.
+ */
+static void dream_clone_cmd(int cmd, void *arg, struct dreamer_attr *dattr, int level)
+{
+    struct dream_batch batch;
+    register int id;
+    dream_batch_init(&batch);
+    for(id = 0; id < dream_nids; ++id)
+    {
+        struct dreamer_attr *dreamer = dreamer_get(level, id);
+        if(!dreamer || dreamer == dattr)
+            continue; /*skip cloning it on this dreamer*/
+        dream_batch_add(&batch, dreamer, cmd, arg, level);
+    }
+    dream_batch_flush(&batch);
+}
+
+/*
+ * Placement of the dreamer threads on the cpus, applied as each dreamer enters a level.
+ * pack keeps the levels of a dreamer on one cpu (core) or the cpus sharing its L2 (l2),
+ * spread puts each level on a numa node of its own (a cpu of its own on one node)
+ * and isolate pins each level on a cpu isolated from the scheduler.
+ */
+#define DREAM_CPUS_MAX (1024)
+#define DREAM_NODES_MAX (64)
+
+enum dream_placement
+{
+    DREAM_PLACE_NONE,
+    DREAM_PLACE_CORE,
+    DREAM_PLACE_L2,
+    DREAM_PLACE_SPREAD,
+    DREAM_PLACE_ISOLATE,
+    DREAM_PLACEMENTS,
+};
+
+static const char *dream_placement_names[DREAM_PLACEMENTS] = {
+    [DREAM_PLACE_NONE] = "none",
+    [DREAM_PLACE_CORE] = "core",
+    [DREAM_PLACE_L2] = "l2",
+    [DREAM_PLACE_SPREAD] = "spread",
+    [DREAM_PLACE_ISOLATE] = "isolate",
+};
+
+struct dream_cpus
+{
+    int ncpus;
+    int cpus[DREAM_CPUS_MAX];
+};
+
+static struct dream_topology
+{
+    struct dream_cpus online;
+    struct dream_cpus isolated;
+    struct dream_cpus *nodes;
+    int nnodes;
+    unsigned long pinned;
+} dream_topology;
+
+static int dream_placement = DREAM_PLACE_NONE;
+
+static int dream_placement_lookup(const char *name)
+{
+    register int i;
+    for(i = 0; i < DREAM_PLACEMENTS; ++i)
+        if(!strcasecmp(dream_placement_names[i], name))
+            return i;
+    return -1;
+}
+
+static void dream_topology_init(void)
+{
+    struct dream_topology *topology = &dream_topology;
+    register int i;
+    if(topology->online.ncpus)
+        return;
+    topology->online.ncpus = arch_cpulist_read("/sys/devices/system/cpu/online",
+                                               topology->online.cpus, DREAM_CPUS_MAX);
+    if(!topology->online.ncpus)
+    {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for(i = 0; i < ncpus && i < DREAM_CPUS_MAX; ++i)
+            topology->online.cpus[i] = i;
+        topology->online.ncpus = i ? : 1;
+    }
+    topology->isolated.ncpus = arch_cpulist_read("/sys/devices/system/cpu/isolated",
+                                                 topology->isolated.cpus, DREAM_CPUS_MAX);
+    topology->nodes = calloc(DREAM_NODES_MAX, sizeof(*topology->nodes));
+    assert(topology->nodes != NULL);
+    for(i = 0; i < DREAM_NODES_MAX; ++i)
+    {
+        struct dream_cpus *node = &topology->nodes[topology->nnodes];
+        char path[80];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", i);
+        if( (node->ncpus = arch_cpulist_read(path, node->cpus, DREAM_CPUS_MAX)) )
+            ++topology->nnodes;
+    }
+}
+
+/*
+ * The cpus of a dreamer at a level for the policy. Returns 0 to leave it to the scheduler.
+ */
+static int dream_placement_cpus(int placement, int id, int level, struct dream_cpus *set)
+{
+    struct dream_topology *topology = &dream_topology;
+    int cpu;
+    char path[80];
+    set->ncpus = 0;
+    switch(placement)
+    {
+    case DREAM_PLACE_CORE:
+    case DREAM_PLACE_L2:
+        cpu = topology->online.cpus[id % topology->online.ncpus];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index2/shared_cpu_list", cpu);
+        if(placement == DREAM_PLACE_L2)
+            set->ncpus = arch_cpulist_read(path, set->cpus, DREAM_CPUS_MAX);
+        if(!set->ncpus)
+        {
+            set->cpus[0] = cpu;
+            set->ncpus = 1;
+        }
+        break;
+    case DREAM_PLACE_SPREAD:
+        if(topology->nnodes > 1)
+        {
+            *set = topology->nodes[(level - 1) % topology->nnodes];
+            break;
+        }
+        set->cpus[0] = topology->online.cpus[(level - 1) % topology->online.ncpus];
+        set->ncpus = 1;
+        break;
+    case DREAM_PLACE_ISOLATE:
+        if(!topology->isolated.ncpus)
+            break;
+        set->cpus[0] = topology->isolated.cpus[(level - 1) % topology->isolated.ncpus];
+        set->ncpus = 1;
+        break;
+    default:
+        break;
+    }
+    return set->ncpus;
+}
+
+static void dream_place(struct dreamer_attr *dattr, int level)
+{
+    struct dream_cpus set;
+    /*
+     * Coroutines run wherever their carrier runs
+     */
+    if(dream_placement == DREAM_PLACE_NONE || dream_fiber_self)
+        return;
+    if(!dream_placement_cpus(dream_placement, dattr->id, level, &set))
+        return;
+    if(arch_thread_pin(set.cpus, set.ncpus) == 0)
+        __atomic_add_fetch(&dream_topology.pinned, 1, __ATOMIC_RELAXED);
+}
+
+static void dream_placement_start(void)
+{
+    dream_topology_init();
+    if(dream_placement == DREAM_PLACE_ISOLATE && !dream_topology.isolated.ncpus)
+        output("No isolated cpus. Leaving the placement of the dreamers to the scheduler\n");
+}
+
+static void dream_placement_stats_print(void)
+{
+    if(dream_placement == DREAM_PLACE_NONE)
+        return;
+    output("Placement: policy [%s], cpus [%d], nodes [%d], isolated [%d], pinned [%lu]\n",
+           dream_placement_names[dream_placement], dream_topology.online.ncpus,
+           dream_topology.nnodes, dream_topology.isolated.ncpus,
+           __atomic_load_n(&dream_topology.pinned, __ATOMIC_RELAXED));
+}
+
+/*
+ * In a dream, you run 12 times slower : 5 mins of realtime = 60 mins
+ * Fake the slowness by reduction in threads priority or the 
+ * scheduling priority of the dreamer
+ */
+
+static void set_thread_priority(struct dreamer_attr *dattr, int level)
+{
+    struct sched_param dream_param = {0};
+    int policy = 0;
+
+    assert(pthread_getschedparam(pthread_self(), &policy, &dream_param) == 0);
+    if(dream_param.sched_priority > 12)
+        dream_param.sched_priority -= 12;
+
+    if(!(dattr->role & DREAM_PROJECTION))
+        output("Dreamer [%s], level [%d], priority [%d], policy [%s]\n",
+           dattr->name, level, dream_param.sched_priority, 
+           policy == SCHED_FIFO ? "FIFO" : 
+           (policy == SCHED_RR ? "RR" : "OTHER"));
+
+    /*
+     * Coroutines share the priority of their carrier
+     */
+    if(!dream_fiber_self)
+        assert(pthread_setschedparam(pthread_self(), policy, &dream_param) == 0);
+    dream_place(dattr, level);
+}
+
+/*
+ * Wake up an individual dreamer in one level and let him propagate the kick down to levels below.
+ */
+static void wake_up_dreamer(struct dreamer_attr *dattr, int level)
+{
+    struct dreamer_attr *dreamer;
+    if(!level || (dream_state(dattr) & DREAMER_IN_LIMBO)) return;
+    dreamer = dreamer_get(level, dattr->id);
+    if(dreamer)
+        dream_enqueue_cmd(dreamer, DREAMER_KICK_BACK, NULL, dreamer->level);
+}
+
+/*
+ * Level 0 is wake up dreamers on all levels.
+ * Skip guys in a limbo from that level to all the way down.
+ */
+static void wake_up_dreamers(int level)
+{
+    int start = dream_depth-1,end = 0;
+    struct dream_batch batch;
+    register int i;
+    if(level > 0)
+    {
+        start = level - 1;
+        end = level - 1;
+    }
+    /*
+     * Collect the kicks and publish them once all the levels are scanned
+     */
+    dream_batch_init(&batch);
+    for(i = start; i >= end; --i)
+    {
+        register int id;
+        for(id = 0; id < dream_nids; ++id)
+        {
+            struct dreamer_attr *dattr = dreamer_get(i+1, id);
+            if(!dattr || (dream_state(dattr) & DREAMER_IN_LIMBO) )
+                continue;
+            dream_batch_add(&batch, dattr, DREAMER_KICK_BACK, NULL, dattr->level);
+        }
+    }
+    dream_batch_flush(&batch);
+}
+
+/*
+ * Kick back all the projections at a level. Projections are interned after the cast
+ * so the scan starts at the first one.
+ */
+static int wake_up_projections(int level)
+{
+    struct dream_batch batch;
+    register int id;
+    int projections = 0;
+    dream_batch_init(&batch);
+    for(id = dream_role_id(DREAM_PROJECTION); id >= 0 && id < dream_nids; ++id)
+    {
+        struct dreamer_attr *dattr = dreamer_get(level, id);
+        if(!dattr || !(dattr->role & DREAM_PROJECTION))
+            continue;
+        dream_batch_add(&batch, dattr, DREAMER_KICK_BACK, NULL, level);
+        ++projections;
+    }
+    dream_batch_flush(&batch);
+    return projections;
+}
+
+/*
+ * Update states on all the levels and down.
+ */
+static void set_state(struct dreamer_attr *dattr, int state)
+{
+    register int word;
+    for(word = 0; word < dream_state_words; ++word)
+        __atomic_or_fetch(&dream_states[dattr->id * dream_state_words + word],
+                          state * DREAM_STATE_ALL_LEVELS, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * Set the limbo state on all levels of this dreamer so he cannot get a kick back
+ * Called with the lock on that level.
+ */
+static void set_limbo_state(struct dreamer_attr *dattr)
+{
+    set_state(dattr, DREAMER_IN_LIMBO);
+}
+
+/*
+ * Table driven request dispatch. Handlers are keyed by (role, level, cmd) in dream_dispatch_table,
+ * built once at startup from dream_dispatch_entries. Every request loop runs the same
+ * drain, dispatch and wait skeleton in dream_dispatch_loop.
+ */
+#define DREAM_DISPATCH_CONTINUE (0) /* go on with the next request */
+#define DREAM_DISPATCH_BREAK (1) /* leave the loop. Requests left in the batch stay queued */
+#define DREAM_DISPATCH_EXIT (2) /* leave the level. Requests left in the batch are dropped */
+#define DREAM_DISPATCH_WAIT (3) /* idle hook: wait for requests */
+
+/*
+ * Loop state of a dreamer at a level shared by the handlers of the loop.
+ */
+struct dream_context
+{
+    struct dreamer_attr *cobb;
+    struct dreamer_attr *ariadne;
+    struct dreamer_attr *arthur;
+    struct dreamer_attr *eames;
+    struct dreamer_attr *fischer;
+    struct dreamer_attr *saito;
+    struct dreamer_attr *self; /* the same dreamer at another level */
+    struct dreamer_attr *origin; /* the dreamer a limbo clone was made from */
+    struct dream_future *reply; /* owed to a synchronous caller */
+    struct dream_timer *timer; /* periodic command of the dreamer */
+    int wait_for_dreamers;
+    int inception_done;
+    int search_for_saito;
+    int ret_from_limbo;
+    int reconciled;
+    int recovered; /* acted on the first recover. A repeat only keeps the recovery going */
+    unsigned long long deadline; /* end of the current period of the request loop */
+};
+
+struct dream_dispatch_entry
+{
+    int role;
+    int level;
+    int cmd;
+    int (*handler)(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx);
+};
+
+#define DREAM_LIMBO (-1) /* level of the limbo entries. Limbo is at the depth of the dream */
+
+static const struct dream_dispatch_entry *dream_dispatch_table[DREAM_ROLES][DREAM_LEVELS_MAX][DREAMER_CMDS];
+
+static __inline__ const struct dream_dispatch_entry **dream_dispatch_handlers(struct dreamer_attr *dattr)
+{
+    return dream_dispatch_table[DREAM_ROLE_INDEX(dattr->role)][dattr->level-1];
+}
+
+static __inline__ int dream_dispatch(const struct dream_dispatch_entry **handlers, struct dreamer_attr *dattr,
+                                     struct dreamer_request *req, struct dream_context *ctx)
+{
+    const struct dream_dispatch_entry *entry = handlers[__builtin_ctz(req->cmd)];
+    if(!entry)
+        return DREAM_DISPATCH_CONTINUE; /* not handled at this level */
+    return entry->handler(dattr, req, ctx);
+}
+
+/*
+ * Put the rest of a drained batch back in front of the mailbox for the next loop,
+ * each request in the lane of its command so the control commands keep their priority.
+ */
+static void dream_cmds_requeue(struct dreamer_attr *dattr, struct list_head *cmds)
+{
+    struct list_head lanes[DREAM_LANES];
+    register int lane;
+    for(lane = 0; lane < DREAM_LANES; ++lane)
+        list_init(&lanes[lane]);
+    while(cmds->head)
+    {
+        struct list *head = cmds->head;
+        list_del(head, cmds);
+        list_add_tail(head, &lanes[dream_cmd_lane((LIST_ENTRY(head, struct dreamer_request, list))->cmd)]);
+    }
+    for(lane = 0; lane < DREAM_LANES; ++lane)
+    {
+        struct list_head *pending = &dattr->mailbox.pending[lane];
+        list_splice_tail(pending, &lanes[lane]);
+        list_splice_tail(&lanes[lane], pending);
+    }
+}
+
+/*
+ * Drain the mailbox and dispatch the batch. Returns DREAM_DISPATCH_WAIT once the batch is done
+ * or DREAM_DISPATCH_BREAK/EXIT from the handler leaving the loop.
+ */
+static int dream_dispatch_pending(struct dreamer_attr *dattr, struct dream_context *ctx,
+                                  const struct dream_dispatch_entry **handlers)
+{
+    struct dreamer_request *req = NULL;
+    int status;
+    LIST_DECLARE(cmds);
+    dream_drain_cmds(dattr, &cmds);
+    while( (req = dream_cmd_next(dattr, &cmds)) )
+    {
+        status = dream_dispatch(handlers, dattr, req, ctx);
+        dream_request_free(req);
+        if(status == DREAM_DISPATCH_EXIT)
+        {
+            dream_cmds_release(&cmds);
+            return status;
+        }
+        if(status == DREAM_DISPATCH_BREAK)
+        {
+            dream_cmds_requeue(dattr, &cmds);
+            return status;
+        }
+    }
+    return DREAM_DISPATCH_WAIT;
+}
+
+/*
+ * Request loop of a dreamer at a level: drain the mailbox, dispatch the batch and wait.
+ * The idle hook runs after each batch and returns DREAM_DISPATCH_WAIT to wait for requests,
+ * DREAM_DISPATCH_CONTINUE if it waited itself or DREAM_DISPATCH_BREAK/EXIT to leave the loop.
+ */
+static int dream_dispatch_loop(struct dreamer_attr *dattr, struct dream_context *ctx,
+                               int (*idle)(struct dreamer_attr *dattr, struct dream_context *ctx))
+{
+    const struct dream_dispatch_entry **handlers = dream_dispatch_handlers(dattr);
+    for(;;)
+    {
+        int status = dream_dispatch_pending(dattr, ctx, handlers);
+        if(status != DREAM_DISPATCH_WAIT)
+            return status;
+        status = idle ? idle(dattr, ctx) : DREAM_DISPATCH_WAIT;
+        if(status == DREAM_DISPATCH_BREAK || status == DREAM_DISPATCH_EXIT)
+            return status;
+        if(status == DREAM_DISPATCH_WAIT)
+            dream_wait_cmd(dattr, &ctx->deadline);
+    }
+}
+
+/*
+ * A dreamer run as a task: every run dispatches its mailbox once and gives the worker back.
+ * Producers schedule it on the empty to non-empty transition of an inbox, so it holds no thread
+ * while waiting for requests or timers. Once it leaves the level it stays scheduled and never runs again.
+ */
+struct dream_dreamer_task
+{
+    struct dream_task task;
+    struct dreamer_attr *dattr;
+    const struct dream_dispatch_entry **handlers;
+    struct dream_context ctx;
+};
+
+static void dream_dreamer_task_run(struct dream_task *task)
+{
+    struct dream_dreamer_task *dtask = LIST_ENTRY(task, struct dream_dreamer_task, task);
+    struct dreamer_attr *dattr = dtask->dattr;
+    int status = dream_dispatch_pending(dattr, &dtask->ctx, dtask->handlers);
+    if(status != DREAM_DISPATCH_WAIT)
+    {
+        dream_state_set(dattr, DREAMER_KICK_BACK);
+        __atomic_add_fetch(&dream_executor.exited, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    /*
+     * Requests queued while running found the task scheduled and did not queue it
+     */
+    __atomic_store_n(&task->scheduled, 0, __ATOMIC_SEQ_CST);
+    if(!dream_mailbox_empty(&dattr->mailbox))
+        dream_task_schedule(task);
+}
+
+static void dream_dreamer_task_create(struct dreamer_attr *dattr)
+{
+    struct dream_dreamer_task *dtask = calloc(1, sizeof(*dtask));
+    assert(dtask != NULL);
+    dtask->task.run = dream_dreamer_task_run;
+    dtask->dattr = dattr;
+    dtask->handlers = dream_dispatch_handlers(dattr);
+    dattr->task = &dtask->task;
+}
+
+/*
+ * Kick back to the level below for the dreamers just waiting for it.
+ */
+static int dreamer_kick_back(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    if(dattr->level > 1)
+    {
+        output("[%s] got Kick at level [%d]. Exiting back to level [%d]\n",
+               dattr->name, dattr->level, dattr->level - 1);
+    }
+    else
+    {
+        output("[%s] got Kick at level [%d]. Exiting back to reality\n",
+               dattr->name, dattr->level);
+    }
+    return DREAM_DISPATCH_EXIT;
+}
+
+/*
+ * Wait at this level for a kick back to the level below.
+ */
+static void wait_for_kick(struct dreamer_attr *dattr)
+{
+    struct dream_context ctx = {0};
+    dream_dispatch_loop(dattr, &ctx, NULL);
+}
+
+/*
+ * Threads of the dreamers. They get small stacks with a guard of their own (-k, -g) so a large cast
+ * does not reserve the default stack per thread. The levels run on a cache of parked threads (-t)
+ * pre-spawned at startup: dream_level_create hands the level to a parked thread with the scheduling
+ * of the creator and the thread parks again once done with the level. The cache grows
+ * when all its threads are busy. Threads never leave the cache.
+ */
+#define DREAM_THREAD_CACHE (DREAMERS * 2) /* a thread per dreamer for the levels below 1 */
+#define DREAM_THREAD_STACK (256 << 10)
+
+struct dream_thread
+{
+    struct list list;
+    pthread_t thread;
+    pthread_cond_t cond;
+    void *(*function)(void *);
+    void *arg;
+};
+
+static struct dream_threads
+{
+    pthread_mutex_t mutex;
+    struct list_head idle;
+    int nidle;
+    unsigned long spawned;
+    unsigned long reused;
+    unsigned long retired; /* exited on finding the cache full */
+} dream_threads = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static int dream_thread_cache = DREAM_THREAD_CACHE; /* pre-spawned and most idle threads. 0 for a thread per level */
+static size_t dream_stack_size = DREAM_THREAD_STACK; /* 0 for the default of the system */
+static size_t dream_guard_size = 4096;
+
+static void dream_thread_attr_init(pthread_attr_t *attr)
+{
+    assert(pthread_attr_init(attr) == 0);
+    assert(pthread_attr_setdetachstate(attr, PTHREAD_CREATE_DETACHED) == 0);
+    /*
+     * inherit attributes from the creator
+     */
+    assert(pthread_attr_setinheritsched(attr, PTHREAD_INHERIT_SCHED) == 0);
+    if(dream_stack_size)
+        assert(pthread_attr_setstacksize(attr, dream_stack_size) == 0);
+    assert(pthread_attr_setguardsize(attr, dream_guard_size) == 0);
+}
+
+/*
+ * A thread done with its level parks in the cache, giving back its reader slot,
+ * or exits if the cache already holds dream_thread_cache idle threads.
+ */
+static void *dream_thread_main(void *arg)
+{
+    struct dream_thread *thread = arg;
+    pthread_mutex_lock(&dream_threads.mutex);
+    for(;;)
+    {
+        void *(*function)(void *);
+        while(!thread->function)
+            dream_cond_wait(&thread->cond, &dream_threads.mutex);
+        function = thread->function;
+        pthread_mutex_unlock(&dream_threads.mutex);
+        function(thread->arg);
+        dream_rcu_slot_put();
+        pthread_mutex_lock(&dream_threads.mutex);
+        if(dream_threads.nidle >= dream_thread_cache)
+            break;
+        thread->function = NULL;
+        list_add(&thread->list, &dream_threads.idle); /* most recently used first */
+        ++dream_threads.nidle;
+    }
+    ++dream_threads.retired;
+    pthread_mutex_unlock(&dream_threads.mutex);
+    pthread_cond_destroy(&thread->cond);
+    free(thread);
+    return NULL;
+}
+
+static struct dream_thread *dream_thread_spawn(void)
+{
+    struct dream_thread *thread = calloc(1, sizeof(*thread));
+    pthread_attr_t attr;
+    assert(thread != NULL);
+    assert(arch_cond_init(&thread->cond) == 0);
+    dream_thread_attr_init(&attr);
+    assert(dream_thread_create(&thread->thread, &attr, dream_thread_main, thread) == 0);
+    pthread_attr_destroy(&attr);
+    __atomic_add_fetch(&dream_threads.spawned, 1, __ATOMIC_RELAXED);
+    return thread;
+}
+
+/*
+ * Pre-spawn the cache with the scheduling of the caller.
+ */
+static void dream_threads_start(int threads)
+{
+    register int i;
+    for(i = 0; i < threads; ++i)
+    {
+        struct dream_thread *thread = dream_thread_spawn();
+        pthread_mutex_lock(&dream_threads.mutex);
+        list_add_tail(&thread->list, &dream_threads.idle);
+        ++dream_threads.nidle;
+        pthread_mutex_unlock(&dream_threads.mutex);
+    }
+}
+
+/*
+ * Run the function on a parked thread of the cache, or a new one, with the scheduling of the caller.
+ */
+static void dream_thread_run(void *(*function)(void *), void *arg)
+{
+    struct dream_thread *thread = NULL;
+    struct sched_param param = {0};
+    int policy = 0;
+    pthread_mutex_lock(&dream_threads.mutex);
+    if(dream_threads.idle.head)
+    {
+        thread = LIST_ENTRY(dream_threads.idle.head, struct dream_thread, list);
+        list_del(&thread->list, &dream_threads.idle);
+        --dream_threads.nidle;
+        ++dream_threads.reused;
+    }
+    pthread_mutex_unlock(&dream_threads.mutex);
+    if(!thread)
+        thread = dream_thread_spawn();
+    /*
+     * Before the hand off so the parked thread does not preempt the caller on waking up
+     */
+    assert(pthread_getschedparam(pthread_self(), &policy, &param) == 0);
+    assert(pthread_setschedparam(thread->thread, policy, &param) == 0);
+    pthread_mutex_lock(&dream_threads.mutex);
+    thread->arg = arg;
+    thread->function = function;
+    dream_cond_signal(&thread->cond);
+    pthread_mutex_unlock(&dream_threads.mutex);
+}
+
+static void dream_threads_stats_print(void)
+{
+    if(!__atomic_load_n(&dream_threads.spawned, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&dream_threads.mutex);
+    output("Thread cache: spawned [%lu], reused [%lu], retired [%lu], stack [%zu KB], guard [%zu KB]\n",
+           dream_threads.spawned, dream_threads.reused, dream_threads.retired,
+           dream_stack_size >> 10, dream_guard_size >> 10);
+    pthread_mutex_unlock(&dream_threads.mutex);
+}
+
+static struct dreamer_attr *dream_attr_clone(int level, struct dreamer_attr *dattr)
+{
+    struct dreamer_attr *dattr_clone = calloc(1, sizeof(*dattr_clone));
+    assert(dattr_clone != NULL);
+    memcpy(dattr_clone, dattr, sizeof(*dattr_clone));
+    /*
+     * A task on the executor is the dreamer at one level. The clone gets a thread or a coroutine
+     */
+    dattr_clone->task = NULL;
+    dattr_clone->level = level;
+    dream_state_inherit(dattr, level);
+    memset(&dattr_clone->mutex, 0, sizeof(dattr_clone->mutex));
+    memset(&dattr_clone->cond, 0, sizeof(dattr_clone->cond));
+    assert(pthread_mutex_init(&dattr_clone->mutex, NULL) == 0);
+    assert(arch_cond_init(&dattr_clone->cond) == 0);
+    dream_mailbox_init(&dattr_clone->mailbox);
+    return dattr_clone;
+}
+
+/*
+ * In nested mode (-n) the next level runs in the thread of the dreamer, as a coroutine next to
+ * the levels above it on the carrier of the dreamer. The parent level goes on with its own code
+ * and its loop, and gets the kick back from the level below with a switch on the same carrier.
+ */
+static __inline__ void dream_level_create(int level, void * (*dream_function) (void *), struct dreamer_attr *dattr)
+{
+    pthread_attr_t attr;
+    pthread_t dream;
+    struct dreamer_attr *dattr_clone = dream_attr_clone(level, dattr);
+    assert(dattr_clone != NULL);
+    if(dream_fibers.ncarriers && (!dream_nested || dream_fiber_self))
+    {
+        dream_fiber_create(dream_function, dattr_clone);
+        return;
+    }
+    if(dream_thread_cache)
+    {
+        dream_thread_run(dream_function, dattr_clone);
+        return;
+    }
+    dream_thread_attr_init(&attr);
+    assert(dream_thread_create(&dream, &attr, dream_function, dattr_clone) == 0);
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Now this is the state where Cobb. meets Saito.
+ * The beauty of the Films ending is: Did Cobb take a kick back to reality on seeing Saito remind him
+ * that he has been in a limbo with his wife and has to come back to become Young.
+ * And does Saito take the kick back when Cobb. pulls the trigger on him implicitly in limbo to give him the kick back.
+ * Either way based on whether Cobb. got the kick back from limbo or not, the end is a reality or limbo.
+ * Thats the ingenuity of Inception. So I think its better if we don't mess this up for ourselves and
+ * just sleep here till infinity!
+ */
+
+static void infinite_subconsciousness(struct dreamer_attr *dattr)
+{
+    unsigned long long deadline;
+    static int dreamers;
+
+    pthread_mutex_lock(&limbo_mutex);
+    ++dreamers;
+    deadline = dream_time_ns() + 2000000000ULL;
+    while(dreamers != 2) 
+    {
+        if(dream_cond_timedwait(&limbo_cond, &limbo_mutex, deadline) == ETIMEDOUT)
+            deadline += 2000000000ULL;
+    }
+    /*
+     * Wait for the signal from Fischer
+     */
+    deadline = dream_time_ns() + 1000000000ULL;
+    while(!dreamers_in_reality)
+    {
+        if(dream_cond_timedwait(&limbo_cond, &limbo_mutex, deadline) == ETIMEDOUT)
+            deadline += 1000000000ULL;
+    }
+
+    if((dattr->role & DREAM_INCEPTION_PERFORMER))
+    {
+        output("\n\nCobbs' search for Saito ends in Limbo. Now either both take the kick back to reality "
+               "or the ending is still a state of limbo from Cobbs' perspective, which is what Nolan wants us to think\n");
+        output("This is in spite of witnessing his children turn towards him for the first time which we're never shown in his projections.\n");
+        output("So, let me end the limbo state abruptly like the Movie with the totem spinning and leave it to the reviewers to decide the infinite sleep:-)\n\n");
+    }
+    dream_cond_signal(&limbo_cond);
+    pthread_mutex_unlock(&limbo_mutex);
+    dream_sleep_forever();
+}
+
+/*
+ * Cobb. stays back in limbo to search for Saito
+ */
+static void cobb_search_for_saito(struct dreamer_attr *clone)
+{
+    output("[%s] enters limbo to search for Saito in limbo at level [%d]\n",
+           clone->name, clone->level);
+    set_limbo_state(clone);
+    dream_usleep(10000);
+    infinite_subconsciousness(clone);
+    output("[%s] returned after searching for Saito in limbo at level [%d]\n",
+           clone->name, clone->level);
+    assert(0); /* should not return back here*/
+}
+
+/*
+ * Meets Mal
+ */
+static int cobb_limbo_in_my_dream(struct dreamer_attr *clone, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("%s in level [%d] while in limbo\n", (const char*)req->arg, clone->level);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+/*
+ * Mal killed
+ */
+static int cobb_limbo_killed(struct dreamer_attr *clone, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] finds %s in level [%d] while in limbo\n", 
+           clone->name, (const char*)req->arg, clone->level);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+/*
+ * Recover to search for Saito. Here mark the inception
+ */
+static int cobb_limbo_recover(struct dreamer_attr *clone, struct dreamer_request *req, struct dream_context *ctx)
+{
+    struct dreamer_attr *source = (struct dreamer_attr*)req->arg;
+    /*
+     * If the recovery trigger is from ariadne
+     */
+    if( (source->role & DREAM_WORLD_ARCHITECT) )
+    {
+        if(!ctx->inception_done)
+            ctx->search_for_saito = 1;
+        else
+            cobb_search_for_saito(clone);
+    }
+    /*
+     * Indicator from Fischer for the final shot.
+     */
+    else if( (source->role & DREAM_INCEPTION_TARGET) && !ctx->inception_done)
+    {
+        ctx->inception_done = 1;
+        memcpy(fischers_mind_state, inception_thoughts, sizeof(inception_thoughts));
+        /*
+         * Send recovery indicator to Ariadne
+         */
+        dream_enqueue_cmd(ctx->ariadne, DREAMER_RECOVER, clone, ctx->ariadne->level);
+        if(ctx->search_for_saito)
+            cobb_search_for_saito(clone);
+    }
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int ariadne_limbo_in_my_dream(struct dreamer_attr *clone, struct dreamer_request *req, struct dream_context *ctx)
+{
+    struct dreamer_attr *cobb = ctx->cobb;
+    struct dreamer_attr *fischer = ctx->fischer;
+    output("[%s] follows [%s] in Elevator to level [%d] in Limbo to meet his wife\n",
+           clone->name, cobb->name, clone->level);
+    unsigned long long when = dream_time_ns() + dream_period(clone->level);
+    /*
+     * Give Cobb. a breather to interact with his wife and tell her about his inception.
+     */
+    dream_enqueue_cmd_at(cobb, DREAMER_KILLED, (void*)"[Mal] killed", cobb->level, when);
+    /*
+     * Quick breather. Then send Fischer a kick back from limbo down to reconcile.
+     */
+    when += 10000000ULL;
+    dream_enqueue_cmd_at(fischer, DREAMER_KICK_BACK, clone, fischer->level, when);
+    /*
+     * And tell Cobb. to recover and go and search Saito as he is the only one who can
+     * search her in limbo.
+     */
+    output("[%s] tells [%s] to search for Saito in limbo at level [%d]\n",
+           clone->name, cobb->name, clone->level);
+    dream_enqueue_cmd_at(cobb, DREAMER_RECOVER, clone, cobb->level, when);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+/*
+ * Indication for us to take the kick back.
+ */
+static int ariadne_limbo_recover(struct dreamer_attr *clone, struct dreamer_request *req, struct dream_context *ctx)
+{
+    if(ctx->recovered)
+        return DREAM_DISPATCH_CONTINUE;
+    ctx->recovered = 1;
+    dream_enqueue_cmd(clone, DREAMER_KICK_BACK, clone, clone->level);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int ariadne_limbo_kick_back(struct dreamer_attr *clone, struct dreamer_request *req, struct dream_context *ctx)
+{
+    struct dreamer_attr *self = NULL; /*ourself in lower level*/
+    /*
+     * Return back
+     */
+    dream_state_clear(ctx->origin, DREAMER_IN_LIMBO);
+    dream_state_clear(clone, DREAMER_IN_LIMBO);
+    dream_usleep(10000);
+    self = dreamer_find_sync(clone, clone->level-1, DREAM_WORLD_ARCHITECT);
+    dream_enqueue_cmd(self, DREAMER_KICK_BACK, clone, self->level);
+    output("[%s] taking the kick back from limbo at level [%d] to level [%d]\n",
+           clone->name, clone->level, clone->level-1);
+    return DREAM_DISPATCH_EXIT;
+}
+
+static int fischer_limbo_kick_back(struct dreamer_attr *clone, struct dreamer_request *req, struct dream_context *ctx)
+{
+    dream_state_clear(ctx->origin, DREAMER_IN_LIMBO);
+    dream_state_clear(clone, DREAMER_IN_LIMBO);
+    dream_enqueue_cmd(ctx->self, DREAMER_KICK_BACK, clone, ctx->self->level);
+    output("[%s] kicking off from limbo at [%d] to level [%d]\n",
+           clone->name, clone->level, clone->level-1);
+    return DREAM_DISPATCH_EXIT;
+}
+
+/*
+ * Kick back of the dreamer at a level on the way down to limbo. The level takes the kick
+ * back up as it unwinds.
+ */
+static int dream_descend_kick_back(struct dreamer_attr *clone, struct dreamer_request *req, struct dream_context *ctx)
+{
+    dream_state_clear(clone, DREAMER_IN_LIMBO);
+    return DREAM_DISPATCH_EXIT;
+}
+
+static const struct dream_dispatch_entry dream_descend_kick_back_entry = {
+    0, 0, DREAMER_KICK_BACK, dream_descend_kick_back,
+};
+
+/*
+ * Descend from the level of the dreamer down to a level, one level at a time as nested activations
+ * in the thread of the dreamer. The dreamer joins every level on the way and dreams at the last one.
+ * The level above the last one waits for the kick back from there. The kick then unwinds the levels
+ * further up as plain returns, each level done with the requests left for it on the way.
+ * The level the descent started from runs its own loop, so it gets the kick as a request.
+ * Returns 1 once kicked back.
+ */
+static int dream_descend_level(struct dreamer_attr *dattr, int level,
+                               void (*dream)(struct dreamer_attr *clone, struct dreamer_attr *origin),
+                               struct dreamer_attr *origin, int nested)
+{
+    struct dream_context ctx = { .self = dattr, .origin = origin };
+    struct dreamer_attr *clone = NULL;
+    int kicked = 0;
+    pthread_mutex_lock(&dattr->mutex);
+    clone = dream_attr_clone(dattr->level+1, dattr);
+    pthread_mutex_unlock(&dattr->mutex);
+    dream_level_join(clone);
+    if(clone->level == level)
+        dream(clone, origin);
+    else if(dream_descend_level(clone, level, dream, origin, 1))
+    {
+        dream_state_clear(clone, DREAMER_IN_LIMBO);
+        dream_dispatch_pending(clone, &ctx, dream_dispatch_handlers(clone));
+        kicked = 1;
+    }
+    else
+        kicked = dream_dispatch_loop(clone, &ctx, NULL) == DREAM_DISPATCH_EXIT;
+    dreamer_table_del(clone);
+    if(kicked && !nested)
+        dream_enqueue_cmd(dattr, DREAMER_KICK_BACK, clone, dattr->level);
+    return kicked;
+}
+
+static void dream_descend(struct dreamer_attr *dattr, int level,
+                          void (*dream)(struct dreamer_attr *clone, struct dreamer_attr *origin),
+                          struct dreamer_attr *origin)
+{
+    dream_descend_level(dattr, level, dream, origin, 0);
+}
+
+/*
+ * Limbo is a state of infinite subconciousness
+ */
+static void limbo_dream(struct dreamer_attr *clone, struct dreamer_attr *origin)
+{
+    struct dream_context ctx = { .origin = origin };
+
+    switch( (clone->role & DREAM_ROLE_MASK) )
+    {
+    case DREAM_INCEPTION_PERFORMER: /* Cobb */
         {
-            struct timespec ts;
-            struct dreamer_attr *ariadne = NULL;
-            int inception_done = 0;
-            int search_for_saito = 0;
-            ariadne = dreamer_find(&dreamer_queue[3], "ariadne", DREAM_WORLD_ARCHITECT);
+            struct dream_batch batch;
+            ctx.ariadne = dreamer_lookup(clone->level, DREAM_WORLD_ARCHITECT);
             /*
              * Self enqueue Mal and her thoughts into the dream
              */
+            dream_batch_begin(&batch);
             dream_enqueue_cmd(clone, DREAMER_IN_MY_DREAM, (void*)"Cobb takes Elevator to meet Mal", clone->level);
             dream_enqueue_cmd(clone, DREAMER_IN_MY_DREAM, 
                               (void*)"[Cobb] tells [Mal] about his inception on her to think that the WORLD is unreal", 
@@ -488,202 +3955,274 @@ static void enter_limbo(struct dreamer_attr *dattr)
             dream_enqueue_cmd(clone, DREAMER_IN_MY_DREAM,
                               (void*)"[Mal] wants [Cobb] to go back with him into the world they built in their dreams",
                               clone->level);
-            pthread_mutex_lock(&clone->mutex);
-            for(;;)
-            {
-                while( (req = dream_dequeue_cmd_locked(clone)) )
-                {
-                    /*
-                     * Meets Mal
-                     */
-                    if(req->cmd == DREAMER_IN_MY_DREAM)
-                    {
-                        output("%s in level [%d] while in limbo\n", (const char*)req->arg, clone->level);
-                    }
-                    /*
-                     * Mal killed
-                     */
-                    else if(req->cmd == DREAMER_KILLED)
-                    {
-                        output("[%s] finds %s in level [%d] while in limbo\n", 
-                               clone->name, (const char*)req->arg, clone->level);
-                    }
-                    /*
-                     * Recover to search for Saito. Here mark the inception
-                     */
-                    else if(req->cmd == DREAMER_RECOVER)
-                    {
-                        struct dreamer_attr *source = (struct dreamer_attr*)req->arg;
-                        /*
-                         * If the recovery trigger is from ariadne
-                         */
-                        if( (source->role & DREAM_WORLD_ARCHITECT) )
-                        {
-                            if(!inception_done)
-                            {
-                                search_for_saito = 1;
-                            }
-                            else
-                            {
-                                pthread_mutex_unlock(&clone->mutex);
-                                search_saito:
-                                output("[%s] enters limbo to search for Saito in limbo at level [%d]\n",
-                                       clone->name, clone->level);
-                                set_limbo_state(clone);
-                                usleep(10000);
-                                infinite_subconsciousness(clone);
-                                pthread_mutex_lock(&clone->mutex);
-                                output("[%s] returned after searching for Saito in limbo at level [%d]\n",
-                                       clone->name, clone->level);
-                                assert(0); /* should not return back here*/
-                            }
-                        }
-                        /*
-                         * Indicator from Fischer for the final shot.
-                         */
-                        else if( (source->role & DREAM_INCEPTION_TARGET) )
-                        {
-                            pthread_mutex_unlock(&clone->mutex);
-                            inception_done = 1;
-                            memcpy(fischers_mind_state, inception_thoughts, sizeof(inception_thoughts));
-                            /*
-                             * Send recovery indicator to Ariadne
-                             */
-                            dream_enqueue_cmd(ariadne, DREAMER_RECOVER, clone, ariadne->level);
-                            if(search_for_saito)
-                            {
-                                goto search_saito;
-                            }
-                            pthread_mutex_lock(&clone->mutex);
-                        }
-                    }
-                }
-                arch_gettime(dream_delay_map[clone->level-1], &ts);
-                pthread_cond_timedwait(clone->cond[3], &clone->mutex, &ts);
-            }
+            dream_batch_end(&batch);
+            dream_dispatch_loop(clone, &ctx, NULL);
         }
         break;
 
     case DREAM_WORLD_ARCHITECT: /* Ariadne */
         {
-            struct dreamer_attr *cobb = NULL;
-            struct dreamer_attr *fischer = NULL;
-            struct timespec ts = {0};
-            cobb = dreamer_find(&dreamer_queue[3], "cobb", DREAM_INCEPTION_PERFORMER);
-            fischer = dreamer_find(&dreamer_queue[3], "fischer", DREAM_INCEPTION_TARGET);
+            ctx.cobb = dreamer_lookup(clone->level, DREAM_INCEPTION_PERFORMER);
+            ctx.fischer = dreamer_lookup(clone->level, DREAM_INCEPTION_TARGET);
             /*  
              * Self enqueue to follow Cobb. in the Elevator to his wife.
              */
-            dream_enqueue_cmd(clone, DREAMER_IN_MY_DREAM, cobb, clone->level);
-            pthread_mutex_lock(&clone->mutex);
-            for(;;)
-            {
-                while ( (req = dream_dequeue_cmd_locked(clone) ) )
-                {
-                    if(req->cmd == DREAMER_IN_MY_DREAM)
-                    {
-                        output("[%s] follows [%s] in Elevator to level [%d] in Limbo to meet his wife\n",
-                               clone->name, cobb->name, clone->level);
-                        pthread_mutex_unlock(&clone->mutex);
-                        /*
-                         * Take a breather while Cobb. interacts with his and tells her about his inception.
-                         */
-                        sleep(dream_delay_map[clone->level-1]);
-                        dream_enqueue_cmd(cobb, DREAMER_KILLED, (void*)"[Mal] killed", cobb->level);
-                        /*
-                         * Quick breather
-                         */
-                        usleep(10000);
-                        /*
-                         * Now send Fischer a kick back from limbo down to reconcile.
-                         */
-                        dream_enqueue_cmd(fischer, DREAMER_KICK_BACK, clone, fischer->level);
-                        /*
-                         * Now tell Cobb. to recover and go and search Saito as he is the only one who can
-                         * search her in limbo.
-                         */
-                        output("[%s] tells [%s] to search for Saito in limbo at level [%d]\n",
-                               clone->name, cobb->name, clone->level);
-                        dream_enqueue_cmd(cobb, DREAMER_RECOVER, clone, cobb->level);
-                        pthread_mutex_lock(&clone->mutex);
-                    }
-                    else if(req->cmd == DREAMER_RECOVER)
-                    {
-                        /*
-                         * Indication for us to take the kick back.
-                         */
-                        dream_enqueue_cmd_safe(clone, DREAMER_KICK_BACK, clone, clone->level, &clone->mutex);
-                    }
-                    else if(req->cmd == DREAMER_KICK_BACK)
-                    {
-                        struct dreamer_attr *self = NULL; /*ourself in lower level*/
-                        /*
-                         * Return back
-                         */
-                        dattr->shared_state &= ~DREAMER_IN_LIMBO;
-                        clone->shared_state &= ~DREAMER_IN_LIMBO;
-                        pthread_mutex_unlock(&clone->mutex);
-                        free(req);
-                        usleep(10000);
-                        self = dreamer_find_sync(clone, clone->level-1, "ariadne", DREAM_WORLD_ARCHITECT);
-                        dream_enqueue_cmd(self, DREAMER_KICK_BACK, clone, self->level);
-                        output("[%s] taking the kick back from limbo at level [%d] to level [%d]\n",
-                               clone->name, clone->level, clone->level-1);
-                        goto out;
-                    }
-                    free(req);
-                }
-                arch_gettime(dream_delay_map[clone->level-1], &ts);
-                pthread_cond_timedwait(clone->cond[3], &clone->mutex, &ts);
-            }
+            dream_enqueue_cmd(clone, DREAMER_IN_MY_DREAM, ctx.cobb, clone->level);
+            dream_dispatch_loop(clone, &ctx, NULL);
         }
         break;
 
     case DREAM_OVERLOOKER: /* Saito */
         {
             set_limbo_state(clone);
-            usleep(1000);
+            dream_usleep(1000);
             infinite_subconsciousness(clone);
         }
         break;
 
     case DREAM_INCEPTION_TARGET: /*Fischer*/
         {
-            struct dreamer_attr *self = NULL;
-            struct timespec ts = {0};
             /*
              * Find ourselves in the lower level to take the kick back.
              */
-            self = dreamer_find_sync(clone, clone->level-1, "fischer", DREAM_INCEPTION_TARGET);
-            pthread_mutex_lock(&clone->mutex);
-            for(;;)
-            {
-                while ( (req = dream_dequeue_cmd_locked(clone)) )
-                {
-                    if(req->cmd == DREAMER_KICK_BACK)
-                    {
-                        dattr->shared_state &= ~DREAMER_IN_LIMBO;
-                        clone->shared_state &= ~DREAMER_IN_LIMBO;
-                        pthread_mutex_unlock(&clone->mutex);
-                        free(req);
-                        dream_enqueue_cmd(self, DREAMER_KICK_BACK, clone, self->level);
-                        output("[%s] kicking off from limbo at [%d] to level [%d]\n",
-                               clone->name, clone->level, clone->level-1);
-                        goto out;
-                    }
-                    free(req);
-                }
-                arch_gettime(dream_delay_map[clone->level-1], &ts);
-                pthread_cond_timedwait(clone->cond[3], &clone->mutex, &ts);
-            }
+            ctx.self = dreamer_find_sync(clone, clone->level-1, DREAM_INCEPTION_TARGET);
+            dream_dispatch_loop(clone, &ctx, NULL);
         }
         break;
     }
+}
 
-    out:
-    return ; 
+/*
+ * Fall down to limbo at the depth of the dream. The levels on the way are in limbo as well.
+ */
+static void enter_limbo(struct dreamer_attr *dattr)
+{
+    pthread_mutex_lock(&dattr->mutex);
+    dream_state_set(dattr, DREAMER_IN_LIMBO);
+    pthread_mutex_unlock(&dattr->mutex);
+    dream_descend(dattr, dream_depth, limbo_dream, dattr);
+}
+
+
+static int cobb_level3_fight(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] fights [%s] defense projections in level [%d]\n",
+           dattr->name, (char*)req->arg, dattr->level);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int cobb_level3_in_my_dream(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    struct dream_batch batch;
+    output("[%s] sees his wife [%s] in his dream. [%s] shoots Fischer\n",
+           dattr->name, (char*)req->arg, (char*)req->arg);
+    dream_batch_begin(&batch);
+    dream_enqueue_cmd(ctx->fischer, DREAMER_SHOT, (void*)"Mal", ctx->fischer->level);
+    /*
+     * Let Eames know so he could start recovery on Fischer
+     */
+    dream_enqueue_cmd(ctx->eames, DREAMER_SHOT, ctx->fischer, dattr->level);
+    dream_batch_end(&batch);
+    /*
+     * Hint to Ariadne about Fischers death from Mal's hands and wait for her reply.
+     */
+    dream_call_cmd(ctx->ariadne, DREAMER_SHOT, (void*)"Fischer shot by Mal", dattr->level);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int cobb_level3_next_level(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] follows [%s] and enters limbo with his Wifes projections in level [%d]\n",
+           dattr->name, ((struct dreamer_attr*)req->arg)->name, dattr->level);
+    enter_limbo(dattr);
+    /*
+     * should not be reached
+     */
+    output("[%s] returned from limbo. Exiting out at level [%d]\n", dattr->name, 
+           dattr->level);
+    exit(0);
+    return DREAM_DISPATCH_EXIT;
+}
+
+static int cobb_level3_idle(struct dreamer_attr *dattr, struct dream_context *ctx)
+{
+    /*
+     * Ariadne's reply could have landed while processing the batch
+     */
+    if(dream_mailbox_empty(&dattr->mailbox))
+        dream_sleep(2);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int ariadne_level3_shot(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    struct dreamer_attr *cobb = ctx->cobb;
+    output("[%s] sees %s in level [%d]\n", dattr->name, 
+           (char*)req->arg, dattr->level);
+    output("[%s] tells [%s] to follow Fischer to level [%d] in Mal's world in limbo\n",
+           dattr->name, cobb->name, dream_depth);
+    dream_enqueue_cmd(cobb, DREAMER_NEXT_LEVEL, dattr, cobb->level);
+    dream_request_reply(req, dattr);
+    output("[%s] enters Limbo at level [%d]\n",
+           dattr->name, dream_depth);
+    enter_limbo(dattr);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int ariadne_level3_kick_back(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    struct dreamer_attr *yusuf = NULL;
+    if(ctx->ret_from_limbo)
+    {
+        output("[%s] got Kick back from level [%d]. Exiting back to level [%d]\n",
+               dattr->name, dattr->level, dattr->level-1);
+        return DREAM_DISPATCH_EXIT;
+    }
+    ctx->ret_from_limbo = 1;
+    output("[%s] returned from Fischers limbo to level [%d] to take the synchronized kick\n", 
+           dattr->name, dattr->level);
+    yusuf = dreamer_find_sync(dattr, 1, DREAM_SEDATIVE_CREATOR);
+    dream_enqueue_cmd(yusuf, DREAMER_SYNCHRONIZE_KICK, dattr, yusuf->level);
+    /*
+     * Take a breather while Yusuf does his work so we can rescan for a kick back
+     * Otherwise we miss and get it after our delayed sleep
+     */
+    dream_usleep(10000);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int eames_level3_fight(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] fights Fischers defense projections at level [%d]\n",
+           dattr->name, dattr->level);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int eames_level3_shot(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    struct dream_batch batch;
+    struct dreamer_attr *saito = ctx->saito;
+    ctx->fischer = ( (struct dreamer_attr*)req->arg);
+    output("[%s] sees [%s] shot in level [%d]. Starts recovery\n",
+           dattr->name, ctx->fischer->name, dattr->level);
+    output("[%s] tells [%s] to keep fighting Fischers projections in level [%d]\n",
+           dattr->name, saito->name, dattr->level);
+    dream_batch_begin(&batch);
+    dream_enqueue_cmd(saito, DREAMER_FIGHT, dattr, saito->level);
+    dream_enqueue_cmd(dattr, DREAMER_RECOVER, ctx->fischer, dattr->level);
+    dream_batch_end(&batch);
+    /*
+     * Keep recovering fischer every period while he is shot in this level.
+     */
+    if(!ctx->timer)
+        ctx->timer = dream_enqueue_cmd_every(dattr, DREAMER_RECOVER, ctx->fischer, dattr->level,
+                                             dream_period(dattr->level));
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int eames_level3_recover(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] doing recovery on [%s] who is shot at level [%d]\n",
+           dattr->name, ( (struct dreamer_attr*)req->arg)->name, dattr->level);
+    if(ctx->recovered)
+        return DREAM_DISPATCH_CONTINUE;
+    ctx->recovered = 1;
+    /*
+     * Dream about Saito getting killed ultimately as I am the dreamer in this level.
+     */
+    dream_enqueue_cmd(ctx->saito, DREAMER_KILLED, dattr, ctx->saito->level);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int eames_level3_kick_back(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    struct dreamer_attr *src = (struct dreamer_attr*)req->arg;
+    if(src && (src->role & DREAM_INCEPTION_TARGET))
+    {
+        output("[%s] sees [%s] get a recovery kick at level [%d]. "
+               "Starts faking Fischers Father's projections for the final Inception\n",
+               dattr->name, src->name, src->level);
+        dream_enqueue_cmd(src, DREAMER_FAKE_SHAPE, "Maurice Fischer", src->level);
+        return DREAM_DISPATCH_CONTINUE;
+    }
+    return dreamer_kick_back(dattr, req, ctx);
+}
+
+static int saito_level3_fight(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] fights Fischers projections in level [%d]\n", 
+           dattr->name, dattr->level);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+/*
+ * Killed. Enter limbo
+ */
+static int saito_level3_killed(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] gets killed at level [%d]. Enters limbo\n", dattr->name, dattr->level);
+    /*
+     * Update killed status on all the levels. just for the sake of being
+     * consistent
+     */
+    set_state(dattr, DREAMER_KILLED);
+    enter_limbo(dattr);
+    /*
+     * Unreached.
+     */
+    output("[%s] returned back from Limbo at level [%d]\n", dattr->name, dattr->level);
+    exit(0);
+    return DREAM_DISPATCH_EXIT;
+}
+
+static int fischer_level3_shot(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] shot by [%s] in level [%d]\n", 
+           dattr->name, (char*)req->arg, dattr->level);
+    /*
+     * Freeze for sometime before joining Cobb and Ariadne in limbo.
+     */
+    dream_usleep(100000);
+    enter_limbo(dattr);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int fischer_level3_kick_back(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    struct dreamer_attr *eames = NULL;
+    if(ctx->reconciled)
+    {
+        output("[%s] got a kick at level [%d]. Falling back to level [%d]\n",
+               dattr->name, dattr->level, dattr->level - 1);
+        return DREAM_DISPATCH_EXIT;
+    }
+    output("[%s] got a kick back from Limbo at level [%d]\n", dattr->name, dattr->level);
+    eames = dreamer_lookup(3, DREAM_SHAPES_FAKER);
+    dream_enqueue_cmd(eames, DREAMER_KICK_BACK, dattr, eames->level);
+    return DREAM_DISPATCH_CONTINUE;
 }
 
+/*
+ * Fischer meeting with his dying father (reconciliation phase at the lowest level)
+ */
+static int fischer_level3_fake_shape(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    struct dreamer_attr *cobb = NULL;
+    if(ctx->reconciled)
+        return DREAM_DISPATCH_CONTINUE;
+    ctx->reconciled = 1;
+    dream_usleep(10000); /*take a breather*/
+    output("[%s] going to meet his dying father [%s] after getting a kick back to level [%d]\n",
+           dattr->name, (const char*)req->arg, dattr->level);
+    /*
+     * Indicator to Cobb. in limbo for you know WHAT :-)
+     */
+    pthread_mutex_lock(&dreamer_mutex[dream_depth-1]);
+    cobb = dreamer_find_sync_locked(dattr, dream_depth, DREAM_INCEPTION_PERFORMER);
+    dream_enqueue_cmd(cobb, DREAMER_RECOVER, dattr, cobb->level);
+    pthread_mutex_unlock(&dreamer_mutex[dream_depth-1]);
+    return DREAM_DISPATCH_CONTINUE;
+}
 
 /*
  * The last level of the dream beyond which we enter limbo.
@@ -691,18 +4230,10 @@ static void enter_limbo(struct dreamer_attr *dattr)
 static void *dream_level_3(void *arg)
 {
     struct dreamer_attr *dattr = arg;
-    struct dreamer_request *req = NULL;
+    struct dream_context ctx = {0};
     assert(dattr->level == 3);
     set_thread_priority(dattr, 3);
-    pthread_mutex_lock(&dreamer_mutex[2]);
-    list_add_tail(&dattr->list, &dreamer_queue[2]);
-    while( (dreamer_queue[2].nodes + 2 != DREAMERS ) )
-    {
-        pthread_mutex_unlock(&dreamer_mutex[2]);
-        usleep(10000);
-        pthread_mutex_lock(&dreamer_mutex[2]);
-    }
-    pthread_mutex_unlock(&dreamer_mutex[2]);
+    dream_level_join(dattr);
     /*
      * All have joined in level 3
      */
@@ -710,70 +4241,18 @@ static void *dream_level_3(void *arg)
     {
     case DREAM_INCEPTION_PERFORMER: /* Cobb */
         {
-            struct dreamer_attr *fischer = NULL;
-            struct dreamer_attr *ariadne = NULL;
-            struct dreamer_attr *eames = NULL;
-            struct timespec ts = {0};
+            struct dream_batch batch;
+            ctx.fischer = dreamer_lookup(3, DREAM_INCEPTION_TARGET);
+            ctx.ariadne = dreamer_lookup(3, DREAM_WORLD_ARCHITECT);
+            ctx.eames = dreamer_lookup(3, DREAM_SHAPES_FAKER);
             /*
              * Self enqueue
              */
-            fischer = dreamer_find(&dreamer_queue[2], "fischer", DREAM_INCEPTION_TARGET);
-            ariadne = dreamer_find(&dreamer_queue[2], "ariadne", DREAM_WORLD_ARCHITECT);
-            eames = dreamer_find(&dreamer_queue[2], "eames", DREAM_SHAPES_FAKER);
+            dream_batch_begin(&batch);
             dream_enqueue_cmd(dattr, DREAMER_FIGHT, (void*)"Fischer", dattr->level);
             dream_enqueue_cmd(dattr, DREAMER_IN_MY_DREAM, (void*)"Mal", dattr->level);
-            pthread_mutex_lock(&dattr->mutex);
-            for(;;)
-            {
-                while ( (req = dream_dequeue_cmd_locked(dattr)))
-                {
-                    if(req->cmd == DREAMER_FIGHT)
-                    {
-                        output("[%s] fights [%s] defense projections in level [%d]\n",
-                               dattr->name, (char*)req->arg, dattr->level);
-                    }
-                    else if(req->cmd == DREAMER_IN_MY_DREAM)
-                    {
-                        pthread_mutex_unlock(&dattr->mutex);
-                        output("[%s] sees his wife [%s] in his dream. [%s] shoots Fischer\n",
-                               dattr->name, (char*)req->arg, (char*)req->arg);
-                        dream_enqueue_cmd(fischer, DREAMER_SHOT, (void*)"Mal", fischer->level);
-                        /*
-                         * Let Eames know so he could start recovery on Fischer
-                         */
-                        dream_enqueue_cmd(eames, DREAMER_SHOT, fischer, dattr->level);
-                        /*
-                         * Hint to Ariadne about Fischers death from Mal's hands
-                         * Take the dreamer mutex for a synchronized reply wait.
-                         */
-                        arch_gettime(dream_delay_map[dattr->level-1], &ts);
-                        pthread_mutex_lock(&dreamer_mutex[dattr->level-1]);
-                        dream_enqueue_cmd(ariadne, DREAMER_SHOT, (void*)"Fischer shot by Mal", dattr->level);
-                        pthread_cond_timedwait(dattr->cond[dattr->level-1], 
-                                               &dreamer_mutex[dattr->level-1], &ts);
-                        pthread_mutex_unlock(&dreamer_mutex[dattr->level-1]);
-                        pthread_mutex_lock(&dattr->mutex);
-                    }
-                    else if(req->cmd == DREAMER_NEXT_LEVEL)
-                    {
-                        pthread_mutex_unlock(&dattr->mutex);
-                        output("[%s] follows [%s] and enters limbo with his Wifes projections in level [%d]\n",
-                               dattr->name, ((struct dreamer_attr*)req->arg)->name, dattr->level);
-                        enter_limbo(dattr);
-                        pthread_mutex_lock(&dattr->mutex);
-                        /*
-                         * should not be reached
-                         */
-                        output("[%s] returned from limbo. Exiting out at level [%d]\n", dattr->name, 
-                               dattr->level);
-                        exit(0);
-                    }
-                    free(req);
-                }
-                pthread_mutex_unlock(&dattr->mutex);
-                sleep(2);
-                pthread_mutex_lock(&dattr->mutex);
-            }
+            dream_batch_end(&batch);
+            dream_dispatch_loop(dattr, &ctx, cobb_level3_idle);
         }
         break;
 
@@ -782,324 +4261,193 @@ static void *dream_level_3(void *arg)
             /*
              * Wait for Cobbs command to enter his dream in limbo with him.
              */
-            struct timespec ts = {0};
-            struct dreamer_attr *cobb = NULL;
-            int ret_from_limbo = 0;
-            cobb = dreamer_find(&dreamer_queue[2], "cobb", DREAM_INCEPTION_PERFORMER);
-            pthread_mutex_lock(&dattr->mutex);
-            for(;;)
-            {
-                while ( (req = dream_dequeue_cmd_locked(dattr)) )
-                {
-                    if(req->cmd == DREAMER_SHOT)
-                    {
-                        pthread_mutex_unlock(&dattr->mutex);
-                        output("[%s] sees %s in level [%d]\n", dattr->name, 
-                               (char*)req->arg, dattr->level);
-                        output("[%s] tells [%s] to follow Fischer to level [%d] in Mal's world in limbo\n",
-                               dattr->name, cobb->name, dattr->level+1);
-                        pthread_mutex_lock(&dreamer_mutex[dattr->level-1]);
-                        dream_enqueue_cmd(cobb, DREAMER_NEXT_LEVEL, dattr, cobb->level);
-                        pthread_mutex_unlock(&dreamer_mutex[dattr->level-1]);
-                        output("[%s] enters Limbo at level [%d]\n",
-                               dattr->name, dattr->level+1);
-                        enter_limbo(dattr);
-                        pthread_mutex_lock(&dattr->mutex);
-                    }
-                    else if(req->cmd == DREAMER_KICK_BACK)
-                    {
-                        if(!ret_from_limbo)
-                        {
-                            struct dreamer_attr *yusuf = NULL;
-                            ret_from_limbo = 1;
-                            output("[%s] returned from Fischers limbo to level [%d] to take the synchronized kick\n", 
-                                   dattr->name, dattr->level);
-                            pthread_mutex_unlock(&dattr->mutex);
-                            yusuf = dreamer_find_sync(dattr, 1, "yusuf", DREAM_SEDATIVE_CREATOR);
-                            dream_enqueue_cmd(yusuf, DREAMER_SYNCHRONIZE_KICK, dattr, yusuf->level);
-                            /*
-                             * Take a breather while Yusuf does his work so we can rescan for a kick back
-                             * Otherwise we miss and get it after our delayed sleep
-                             */
-                            usleep(10000);
-                            pthread_mutex_lock(&dattr->mutex);
-                        }
-                        else
-                        {
-                            free(req);
-                            output("[%s] got Kick back from level [%d]. Exiting back to level [%d]\n",
-                                   dattr->name, dattr->level, dattr->level-1);
-                            goto out_unlock;
-                        }
-                    }
-                    free(req);
-                }
-                arch_gettime(dream_delay_map[dattr->level-1], &ts);
-                pthread_cond_timedwait(dattr->cond[2], &dattr->mutex, &ts);
-            }
+            ctx.cobb = dreamer_lookup(3, DREAM_INCEPTION_PERFORMER);
+            dream_dispatch_loop(dattr, &ctx, NULL);
         }
         break;
 
     case DREAM_SHAPES_FAKER: /* Eames*/
         {
-            struct timespec ts = {0};
-            struct dreamer_attr *fischer = NULL;
-            struct dreamer_attr *saito = NULL;
-            saito = dreamer_find(&dreamer_queue[2], "saito", DREAM_OVERLOOKER);
+            struct dream_batch batch;
+            ctx.saito = dreamer_lookup(3, DREAM_OVERLOOKER);
             /*
              * Self enqueue and he is the dreamer at this level
              */
+            dream_batch_begin(&batch);
             dream_enqueue_cmd(dattr, DREAMER_FIGHT, dattr, dattr->level);
             /*
              * Ask Saito to fight first before he is killed!
              */
-            dream_enqueue_cmd(saito, DREAMER_FIGHT, dattr, dattr->level);
-            pthread_mutex_lock(&dattr->mutex);
-            for(;;)
-            {
-                while ( (req = dream_dequeue_cmd_locked(dattr)))
-                {
-                    if(req->cmd == DREAMER_FIGHT)
-                    {
-                        output("[%s] fights Fischers defense projections at level [%d]\n",
-                               dattr->name, dattr->level);
-                    }
-                    else if(req->cmd == DREAMER_SHOT)
-                    {
-                        pthread_mutex_unlock(&dattr->mutex);
-                        fischer = ( (struct dreamer_attr*)req->arg);
-                        output("[%s] sees [%s] shot in level [%d]. Starts recovery\n",
-                               dattr->name, fischer->name, dattr->level);
-                        output("[%s] tells [%s] to keep fighting Fischers projections in level [%d]\n",
-                               dattr->name, saito->name, dattr->level);
-                        dream_enqueue_cmd(saito, DREAMER_FIGHT, dattr, saito->level);
-
-                        dream_enqueue_cmd(dattr, DREAMER_RECOVER, fischer, dattr->level);
-                        pthread_mutex_lock(&dattr->mutex);
-                    }
-                    else if(req->cmd == DREAMER_RECOVER)
-                    {
-                        output("[%s] doing recovery on [%s] who is shot at level [%d]\n",
-                               dattr->name, ( (struct dreamer_attr*)req->arg)->name, dattr->level);
-                        pthread_mutex_unlock(&dattr->mutex);
-                        /*
-                         * Dream about Saito getting killed ultimately as I am the dreamer in this level.
-                         */
-                        dream_enqueue_cmd(saito, DREAMER_KILLED, dattr, saito->level);
-                        pthread_mutex_lock(&dattr->mutex);
-                    }
-                    else if(req->cmd == DREAMER_KICK_BACK)
-                    {
-                        struct dreamer_attr *src = (struct dreamer_attr*)req->arg;
-                        if(src && (src->role & DREAM_INCEPTION_TARGET))
-                        {
-                            pthread_mutex_unlock(&dattr->mutex);
-                            output("[%s] sees [%s] get a recovery kick at level [%d]. "
-                                   "Starts faking Fischers Father's projections for the final Inception\n",
-                                   dattr->name, src->name, src->level);
-                            dream_enqueue_cmd(src, DREAMER_FAKE_SHAPE, "Maurice Fischer", src->level);
-                            pthread_mutex_lock(&dattr->mutex);
-                        }
-                        else
-                        {
-                            free(req);
-                            output("[%s] got Kick at level [%d]. Exiting back to level [%d]\n",
-                                   dattr->name, dattr->level, dattr->level - 1);
-                            goto out_unlock;
-                        }
-                    }
-                    free(req);
-                }
-                if(fischer)
-                {
-                    /*
-                     * Keep recovering fischer if he is shot in this level.
-                     */
-                    dream_enqueue_cmd_safe(dattr, DREAMER_RECOVER, fischer, dattr->level, &dattr->mutex);
-                }
-                arch_gettime(dream_delay_map[dattr->level-1], &ts);
-                pthread_cond_timedwait(dattr->cond[2], &dattr->mutex, &ts);
-            }
+            dream_enqueue_cmd(ctx.saito, DREAMER_FIGHT, dattr, dattr->level);
+            dream_batch_end(&batch);
+            dream_dispatch_loop(dattr, &ctx, NULL);
+            dream_timer_cancel(ctx.timer);
         }
         break;
 
     case DREAM_OVERLOOKER: /*Saito*/
-        {
-            struct timespec ts = {0};
-            pthread_mutex_lock(&dattr->mutex);
-            for(;;)
-            {
-                while( (req = dream_dequeue_cmd_locked(dattr)))
-                {
-                    if(req->cmd == DREAMER_FIGHT)
-                    {
-                        output("[%s] fights Fischers projections in level [%d]\n", 
-                               dattr->name, dattr->level);
-                    }
-                    else if(req->cmd == DREAMER_KILLED) /* Killed. Enter limbo */
-                    {
-                        output("[%s] gets killed at level [%d]. Enters limbo\n", dattr->name, dattr->level);
-                        pthread_mutex_unlock(&dattr->mutex);
-                        /*
-                         * Update killed status on all the levels. just for the sake of being
-                         * consistent
-                         */
-                        set_state(dattr, DREAMER_KILLED);
-                        enter_limbo(dattr);
-                        pthread_mutex_lock(&dattr->mutex);
-                        /*
-                         * Unreached.
-                         */
-                        output("[%s] returned back from Limbo at level [%d]\n", dattr->name, dattr->level);
-                        exit(0);
-                    }
-                    free(req);
-                }
-                arch_gettime(dream_delay_map[dattr->level-1], &ts);
-                pthread_cond_timedwait(dattr->cond[2], &dattr->mutex, &ts);
-            }
-        }
-        break;
-
     case DREAM_INCEPTION_TARGET: /* Fischer */
-        {
-            int reconciled = 0;
-            struct timespec ts = {0};
-            pthread_mutex_lock(&dattr->mutex);
-            for(;;)
-            {
-                while ( (req = dream_dequeue_cmd_locked(dattr)))
-                {
-                    if(req->cmd == DREAMER_SHOT)
-                    {
-                        output("[%s] shot by [%s] in level [%d]\n", 
-                               dattr->name, (char*)req->arg, dattr->level);
-                        /*
-                         * Freeze for sometime before joining Cobb and Ariadne in limbo.
-                         */
-                        pthread_mutex_unlock(&dattr->mutex);
-                        usleep(100000);
-                        enter_limbo(dattr);
-                        pthread_mutex_lock(&dattr->mutex);
-                    }
-                    else if(req->cmd == DREAMER_KICK_BACK)
-                    {
-                        if(!reconciled)
-                        {
-                            struct dreamer_attr *eames = NULL;
-                            pthread_mutex_unlock(&dattr->mutex);
-                            output("[%s] got a kick back from Limbo at level [%d]\n", dattr->name, dattr->level);
-                            eames = dreamer_find(&dreamer_queue[2], "eames", DREAM_SHAPES_FAKER);
-                            dream_enqueue_cmd(eames, DREAMER_KICK_BACK, dattr, eames->level);
-                            pthread_mutex_lock(&dattr->mutex);
-                        }
-                        else 
-                        {
-                            free(req);
-                            output("[%s] got a kick at level [%d]. Falling back to level [%d]\n",
-                                   dattr->name, dattr->level, dattr->level - 1);
-                            goto out_unlock;
-                        }
-                     }
-                    /*
-                     * Fischer meeting with his dying father (reconciliation phase at the lowest level)
-                     */
-                    else if(req->cmd == DREAMER_FAKE_SHAPE)
-                    {
-                        struct dreamer_attr *cobb = NULL;
-                        reconciled = 1;
-                        pthread_mutex_unlock(&dattr->mutex);
-                        usleep(10000); /*take a breather*/
-                        output("[%s] going to meet his dying father [%s] after getting a kick back to level [%d]\n",
-                               dattr->name, (const char*)req->arg, dattr->level);
-                        /*
-                         * Indicator to Cobb. for you know WHAT :-)
-                         */
-                        pthread_mutex_lock(&dreamer_mutex[dattr->level]);
-                        cobb = dreamer_find_sync_locked(dattr, dattr->level+1, "cobb", DREAM_INCEPTION_PERFORMER);
-                        dream_enqueue_cmd(cobb, DREAMER_RECOVER, dattr, cobb->level);
-                        pthread_mutex_unlock(&dreamer_mutex[dattr->level]);
-                        pthread_mutex_lock(&dattr->mutex);
-                    }
-                    free(req);
-                }
-                arch_gettime(dream_delay_map[dattr->level-1], &ts);
-                pthread_cond_timedwait(dattr->cond[2], &dattr->mutex, &ts);
-            }
-        }
+        dream_dispatch_loop(dattr, &ctx, NULL);
         break;
         
     default:
         break;
     }
-    out_unlock:
-    pthread_mutex_unlock(&dattr->mutex);
+    dreamer_table_del(dattr);
     wake_up_dreamer(dattr, 2);
     return NULL;
 }
 
+/*
+ * Ariadne and Fischer joining Cobb. at level 2 to be taken to level 3
+ */
+static int cobb_level2_in_my_dream(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    struct dreamer_attr *dreamer = (struct dreamer_attr*)req->arg;
+    if(!dreamer || !(dreamer->role & ctx->wait_for_dreamers))
+        return DREAM_DISPATCH_CONTINUE;
+    ctx->wait_for_dreamers &= ~dreamer->role;
+    output("[%s] taking [%s] to level 3\n", dattr->name, dreamer->name);
+    dream_enqueue_cmd(dreamer, DREAMER_NEXT_LEVEL, dattr, dattr->level);
+    return ctx->wait_for_dreamers ? DREAM_DISPATCH_CONTINUE : DREAM_DISPATCH_BREAK;
+}
+
+static int ariadne_level2_next_level(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] following [%s] to level [%d]\n",
+           dattr->name, ( (struct dreamer_attr*)req->arg)->name, dattr->level + 1);
+    dream_level_create(dattr->level + 1, dream_level_3, dattr);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int ariadne_level2_kick_back(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] got KICK while at level [%d]. Exiting back to level [%d]\n",
+           dattr->name, dattr->level, dattr->level - 1);
+    return DREAM_DISPATCH_EXIT;
+}
+
+/*
+ * check if Ariadne joined
+ */
+static int arthur_level2_in_my_dream(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    ctx->ariadne = (struct dreamer_attr*)req->arg;
+    assert(ctx->ariadne->role == DREAM_WORLD_ARCHITECT); 
+    /*
+     * Ariadne waits for us to be ready. The reply goes out after the request is done with.
+     */
+    ctx->reply = req->future;
+    req->future = NULL;
+    output("[%s] joined [%s] in level [%d]\n",
+           ctx->ariadne->name, dattr->name, dattr->level);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+/*
+ * If ariadne hadn't arrived, wait for her to join
+ */
+static int arthur_level2_wait_for_ariadne(struct dreamer_attr *dattr, struct dream_context *ctx)
+{
+    if(ctx->ariadne)
+        return DREAM_DISPATCH_BREAK;
+    output("[%s] waiting for Ariadne to join in level [%d]\n",
+           dattr->name, dattr->level);
+    return DREAM_DISPATCH_WAIT;
+}
+
+static int arthur_level2_free_fall(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    struct dreamer_attr *dreamer_falling = (struct dreamer_attr*)req->arg;
+    output("[%s] experiencing Free fall in level [%d] coz of a fall triggered "
+           " of [%s] in level [%d]\n",
+           dattr->name, dattr->level, dreamer_falling->name, dreamer_falling->level);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+/*
+ * instruction to fight
+ */
+static int arthur_level2_fight(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] Fighting Fischers projections in level [%d]\n",
+           dattr->name, dattr->level);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int arthur_level2_kick_back(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] got Kick at level [%d]. Exiting to level [%d]\n",
+           dattr->name, dattr->level, dattr->level - 1);
+    return DREAM_DISPATCH_EXIT;
+}
+
+static int fischer_level2_next_level(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] following [%s] to level [%d]\n",
+           dattr->name, ( (struct dreamer_attr*)req->arg)->name, dattr->level + 1);
+    dream_level_create(dattr->level + 1, dream_level_3, dattr);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int fischer_level2_fake_shape(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] met with Browning again in level [%d]. "
+           "Waits for Cobb before getting into level [%d] to meet his father\n",
+           dattr->name, dattr->level, dattr->level + 1);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+/*
+ * Eames and Saito following Cobb. or Eames to level 3
+ */
+static int eames_level2_next_level(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    struct dreamer_attr *src = (struct dreamer_attr*)req->arg;
+    output("[%s] following [%s] to level [%d]\n", 
+           dattr->name, src->name, dattr->level+1);
+    if( ( src->role & DREAM_INCEPTION_PERFORMER) )
+    {
+        /*
+         * Eames takes Saito to the next level.
+         */
+        dream_enqueue_cmd(ctx->saito, DREAMER_NEXT_LEVEL, dattr, ctx->saito->level);
+    }
+    dream_level_create(dattr->level+1, dream_level_3, dattr);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int eames_level2_kick_back(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] got Kick at level [%d]\n", dattr->name, dattr->level);
+    return DREAM_DISPATCH_EXIT;
+}
+
 static void *dream_level_2(void *arg)
 {
     struct dreamer_attr *dattr = arg;
-    int dreamers = 0;
+    struct dream_context ctx = {0};
     assert(dattr->level == 2);
     set_thread_priority(dattr, 2);
-    /*
-     * take level 2 lock.
-     */
-    pthread_mutex_lock(&dreamer_mutex[1]);
-    list_add_tail(&dattr->list, &dreamer_queue[1]);
     /*
      * Wait for the expected members to join at this level.
      */
-    while( (dreamers = dreamer_queue[1].nodes)+1 != DREAMERS)
-    {
-        pthread_mutex_unlock(&dreamer_mutex[1]);
-        usleep(10000);
-        pthread_mutex_lock(&dreamer_mutex[1]);
-    }
-
-    pthread_mutex_unlock(&dreamer_mutex[1]);
+    dream_level_join(dattr);
     switch((dattr->role & DREAM_ROLE_MASK))
     {
     case DREAM_INCEPTION_PERFORMER: /* Cobb in level 2 */
         {
             /*
              * Wait for Ariadne and Fischer to join me. at this level after meeting with Arthur
-             */
-            struct dreamer_request *req;
-            struct dreamer_attr *eames;
-            struct timespec ts = {0};
-            int wait_for_dreamers = DREAM_WORLD_ARCHITECT | DREAM_INCEPTION_TARGET;
-            eames = dreamer_find(&dreamer_queue[1], "eames", DREAM_SHAPES_FAKER);
-            pthread_mutex_lock(&dattr->mutex);
-            while(wait_for_dreamers > 0)
-            {
-                while( (!(req = dream_dequeue_cmd_locked(dattr)) ) 
-                       ||
-                       req->cmd != DREAMER_IN_MY_DREAM 
-                       ||
-                       !req->arg
-                       ||
-                       !( ((struct dreamer_attr*)req->arg)->role & wait_for_dreamers)
-                       )
-                {
-                    if(req) free(req);
-                    arch_gettime(dream_delay_map[dattr->level-1], &ts);
-                    pthread_cond_timedwait(dattr->cond[dattr->level-1], &dattr->mutex, &ts);
-                }
-                wait_for_dreamers &= ~((struct dreamer_attr*)req->arg)->role;
-                output("[%s] taking [%s] to level 3\n", dattr->name, ((struct dreamer_attr*)req->arg)->name);
-                dream_enqueue_cmd((struct dreamer_attr*)req->arg, DREAMER_NEXT_LEVEL, dattr, dattr->level);
-                free(req);
-            }
+             */
+            ctx.eames = dreamer_lookup(2, DREAM_SHAPES_FAKER);
+            ctx.wait_for_dreamers = DREAM_WORLD_ARCHITECT | DREAM_INCEPTION_TARGET;
+            dream_dispatch_loop(dattr, &ctx, NULL);
             /*
              * Ariadne + Fischer has joined. Go to level 3. myself. Take Eames into level 3
              */
-            pthread_mutex_unlock(&dattr->mutex);
             dream_level_create(dattr->level + 1, dream_level_3, dattr);
-            dream_enqueue_cmd(eames, DREAMER_NEXT_LEVEL, dattr, eames->level);
-            pthread_mutex_lock(&dattr->mutex);
+            dream_enqueue_cmd(ctx.eames, DREAMER_NEXT_LEVEL, dattr, ctx.eames->level);
             /*
              * Just do nothing and wait for kick back to previous level.
              */
@@ -1109,11 +4457,10 @@ static void *dream_level_2(void *arg)
 
     case DREAM_WORLD_ARCHITECT : /*Ariadne*/
         {
-            struct dreamer_request *req;
             struct dreamer_attr *arthur;
             struct dreamer_attr *cobb;
-            arthur = dreamer_find_sync(dattr, dattr->level, "arthur", DREAM_ORGANIZER);
-            cobb = dreamer_find_sync(dattr,dattr->level,"cobb",DREAM_INCEPTION_PERFORMER);
+            arthur = dreamer_find_sync(dattr, dattr->level, DREAM_ORGANIZER);
+            cobb = dreamer_find_sync(dattr, dattr->level, DREAM_INCEPTION_PERFORMER);
             assert(arthur != NULL);
             assert(cobb != NULL);
             /*
@@ -1121,10 +4468,7 @@ static void *dream_level_2(void *arg)
              */
             output("[%s] joining [%s] in his dream at level 2 to fight Fischers defense projections\n",
                    dattr->name, arthur->name);
-            pthread_mutex_lock(&dreamer_mutex[1]);
-            dream_enqueue_cmd(arthur, DREAMER_IN_MY_DREAM, dattr, arthur->level);
-            pthread_cond_wait(dattr->cond[1], &dreamer_mutex[1]);
-            pthread_mutex_unlock(&dreamer_mutex[1]);
+            dream_call_cmd(arthur, DREAMER_IN_MY_DREAM, dattr, arthur->level);
             /*
              * Now join Cobb. before taking Fischer to level 3.
              */
@@ -1134,222 +4478,73 @@ static void *dream_level_2(void *arg)
             /*
              * Wait for the request to enter the next level or a kick back.
              */
-            pthread_mutex_lock(&dattr->mutex);
-            for(;;)
-            {
-                struct timespec ts = {0};
-                while( (req = dream_dequeue_cmd_locked(dattr)) )
-                {
-                    if(req->cmd == DREAMER_KICK_BACK)
-                    {
-                        free(req);
-                        output("[%s] got KICK while at level [%d]. Exiting back to level [%d]\n",
-                               dattr->name, dattr->level, dattr->level - 1);
-                        goto out_unlock;
-                    }
-                    if(req->cmd == DREAMER_NEXT_LEVEL)
-                    {
-                        pthread_mutex_unlock(&dattr->mutex);
-                        output("[%s] following [%s] to level [%d]\n",
-                               dattr->name, ( (struct dreamer_attr*)req->arg)->name, dattr->level + 1);
-                        dream_level_create(dattr->level + 1, dream_level_3, dattr);
-                        pthread_mutex_lock(&dattr->mutex);
-                    }
-                    free(req);
-                }
-                arch_gettime(dream_delay_map[dattr->level-1], &ts);
-                pthread_cond_timedwait(dattr->cond[1], &dattr->mutex, &ts);
-            }
+            dream_dispatch_loop(dattr, &ctx, NULL);
         }
         break;
         
     case DREAM_ORGANIZER: /*Arthur*/
         {
-            struct dreamer_attr *ariadne = NULL;
-            struct dreamer_request *req = NULL;
             struct dreamer_attr *self = NULL;
-            struct timespec ts = {0};
-            pthread_mutex_lock(&dattr->mutex);
-            for(;;)
-            {
-                while ( (req = dream_dequeue_cmd_locked(dattr)) )
-                {
-                    if(req->cmd == DREAMER_IN_MY_DREAM) /* check if Ariadne joined */
-                    {
-                        ariadne = (struct dreamer_attr*)req->arg;
-                        assert(ariadne->role == DREAM_WORLD_ARCHITECT); 
-                        output("[%s] joined [%s] in level [%d]\n",
-                               ariadne->name, dattr->name, dattr->level);
-                    }
-                    else assert(req->cmd != DREAMER_KICK_BACK); /* cannot receive kick back yet*/
-                    free(req);
-                }
-                if(!ariadne) /* If ariadne hadn't arrived, wait for her to join*/
-                {
-                    output("[%s] waiting for Ariadne to join in level [%d]\n",
-                           dattr->name, dattr->level);
-                    arch_gettime(dream_delay_map[dattr->level-1], &ts);
-                    pthread_cond_timedwait(dattr->cond[1], &dattr->mutex, &ts);
-                }
-                else break;
-            }
+            dream_dispatch_loop(dattr, &ctx, arthur_level2_wait_for_ariadne);
             /*
              * update the state to fight defense projections of Fischer
              */
-            dattr->shared_state = DREAMER_FIGHT;
-            pthread_mutex_unlock(&dattr->mutex);
-            pthread_mutex_lock(&dreamer_mutex[1]);
+            dream_state_set(dattr, DREAMER_FIGHT);
             /*
-             * Signal Ariadne to join Cobb. to get into level 3 while I wait fighting projections
+             * Reply to Ariadne to join Cobb. to get into level 3 while I wait fighting projections
              */
-            dream_enqueue_cmd(ariadne, DREAMER_IN_MY_DREAM, (void*)dattr, dattr->level);
-            pthread_mutex_unlock(&dreamer_mutex[1]);
+            if(ctx.reply)
+            {
+                dream_future_complete(ctx.reply, dattr);
+                ctx.reply = NULL;
+            }
             /*
              * Signal self dreamer in the next level below.
              */
-            self = dreamer_find(&dreamer_queue[dattr->level-2], NULL, DREAM_ORGANIZER);
+            self = dreamer_lookup(dattr->level-1, DREAM_ORGANIZER);
             assert(self != NULL);
             dream_enqueue_cmd(self, DREAMER_SELF, dattr, self->level);
-            pthread_mutex_lock(&dattr->mutex);
-            for(;;)
-            {
-                while ( ( req = dream_dequeue_cmd_locked(dattr)) )
-                {
-                    if(req->cmd == DREAMER_FREE_FALL)
-                    {
-                        struct dreamer_attr *dreamer_falling = (struct dreamer_attr*)req->arg;
-                        output("[%s] experiencing Free fall in level [%d] coz of a fall triggered "
-                               " of [%s] in level [%d]\n",
-                               dattr->name, dattr->level, dreamer_falling->name, dreamer_falling->level);
-                    }
-                    else if(req->cmd == DREAMER_FIGHT) /* instruction to fight */
-                    {
-                        output("[%s] Fighting Fischers projections in level [%d]\n",
-                               dattr->name, dattr->level);
-                    }
-                    else if(req->cmd == DREAMER_KICK_BACK)
-                    {
-                        free(req);
-                        output("[%s] got Kick at level [%d]. Exiting to level [%d]\n",
-                               dattr->name, dattr->level, dattr->level - 1);
-                        goto out_unlock;
-                    }
-                    free(req);
-                }
-                arch_gettime(dream_delay_map[dattr->level-1], &ts);
-                pthread_cond_timedwait(dattr->cond[1], &dattr->mutex, &ts);
-            }
+            dream_dispatch_loop(dattr, &ctx, NULL);
         }
         break;
 
     case DREAM_INCEPTION_TARGET: /* Fischer */
         {
             struct dreamer_attr *cobb = NULL;
-            struct dreamer_request *req = NULL;
             /*
              * First hunt for Cobb in this level.
              */
-            cobb = dreamer_find(&dreamer_queue[1], "cobb", DREAM_INCEPTION_PERFORMER);
+            cobb = dreamer_lookup(2, DREAM_INCEPTION_PERFORMER);
             dream_enqueue_cmd(cobb, DREAMER_IN_MY_DREAM, dattr, dattr->level);
-            pthread_mutex_lock(&dattr->mutex);
-            for(;;)
-            {
-                struct timespec ts = {0};
-                while ( (req = dream_dequeue_cmd_locked(dattr)) )
-                {
-                    if(req->cmd == DREAMER_NEXT_LEVEL)
-                    {
-                        output("[%s] following [%s] to level [%d]\n",
-                               dattr->name, ( (struct dreamer_attr*)req->arg)->name, dattr->level + 1);
-                        pthread_mutex_unlock(&dattr->mutex);
-                        dream_level_create(dattr->level + 1, dream_level_3, dattr);
-                        pthread_mutex_lock(&dattr->mutex);
-                    }
-                    else if(req->cmd == DREAMER_FAKE_SHAPE)
-                    {
-                        output("[%s] met with Browning again in level [%d]. "
-                               "Waits for Cobb before getting into level [%d] to meet his father\n",
-                               dattr->name, dattr->level, dattr->level + 1);
-                    }
-                    else if(req->cmd == DREAMER_KICK_BACK)
-                    {
-                        free(req);
-                        output("[%s] got Kick at level [%d]. Exiting back to level [%d]\n",
-                               dattr->name, dattr->level, dattr->level-1);
-                        goto out_unlock;
-                        
-                    }
-                    free(req);
-                }
-                arch_gettime(dream_delay_map[dattr->level-1], &ts);
-                pthread_cond_timedwait(dattr->cond[1], &dattr->mutex, &ts);
-            }
-            
+            dream_dispatch_loop(dattr, &ctx, NULL);
         }
         break;
 
     case DREAM_SHAPES_FAKER: /*Eames*/
         {
             struct dreamer_attr *fischer = NULL;
-            struct dreamer_attr *saito = NULL;
             /*
              * Find fischer and fake Browning to manipulate him for the final inception.
              * by creating a doubt in his mind.
              */
-            fischer = dreamer_find(&dreamer_queue[1], "fischer", DREAM_INCEPTION_TARGET);
-            saito = dreamer_find(&dreamer_queue[1], "saito", DREAM_OVERLOOKER);
+            fischer = dreamer_lookup(2, DREAM_INCEPTION_TARGET);
+            ctx.saito = dreamer_lookup(2, DREAM_OVERLOOKER);
             output("[%s] Faking Browning's projection to Fischer at level [%d]\n",
                    dattr->name, dattr->level);
             dream_enqueue_cmd(fischer, DREAMER_FAKE_SHAPE, dattr, dattr->level);
-
-            /* fall through*/
-        case DREAM_OVERLOOKER: /*Saito*/
-            {
-                struct dreamer_request *req = NULL;
-                struct timespec ts = {0};
-                pthread_mutex_lock(&dattr->mutex);
-                for(;;)
-                {
-                    while( (req = dream_dequeue_cmd_locked(dattr) ) )
-                    {
-                        if(req->cmd == DREAMER_NEXT_LEVEL)
-                        {
-                            struct dreamer_attr *src = (struct dreamer_attr*)req->arg;
-                            output("[%s] following [%s] to level [%d]\n", 
-                                   dattr->name, src->name, dattr->level+1);
-                            pthread_mutex_unlock(&dattr->mutex);
-                            if( ( src->role & DREAM_INCEPTION_PERFORMER) )
-                            {
-                                /*
-                                 * Eames takes Saito to the next level.
-                                 */
-                                dream_enqueue_cmd(saito, DREAMER_NEXT_LEVEL, dattr, saito->level);
-                            }
-                            dream_level_create(dattr->level+1, dream_level_3, dattr);
-                            pthread_mutex_lock(&dattr->mutex);
-                        }
-                        else if(req->cmd == DREAMER_KICK_BACK)
-                        {
-                            free(req);
-                            output("[%s] got Kick at level [%d]\n", dattr->name, dattr->level);
-                            goto out_unlock;
-                        }
-                        free(req);
-                    }
-                    arch_gettime(dream_delay_map[dattr->level-1], &ts);
-                    pthread_cond_timedwait(dattr->cond[dattr->level-1], &dattr->mutex, &ts);
-                }
-            }
+            dream_dispatch_loop(dattr, &ctx, NULL);
         }
+        break;
 
+    case DREAM_OVERLOOKER: /*Saito*/
+        dream_dispatch_loop(dattr, &ctx, NULL);
         break;
 
     default:
         break;
     }
 
-    out_unlock:
-    pthread_mutex_unlock(&dattr->mutex);
+    dreamer_table_del(dattr);
     /*
      * Signal waiters at the next level down.
      */
@@ -1367,51 +4562,69 @@ static void go_with_fischer_to_level_2(struct dreamer_attr *fischer, struct drea
     dream_level_create(dattr->level + 1, dream_level_2, dattr);
 }
 
+/*
+ * The time to exit and wake up all dreamers with a synchronized kick
+ */
+static int yusuf_level1_synchronize_kick(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] going to take the kick back to reality and wake up all the others through a synchronized kick "                 "by effecting the VAN to fall into the river\n", dattr->name);
+    return DREAM_DISPATCH_EXIT;
+}
+
+static int yusuf_level1_fall(struct dreamer_attr *dattr, struct dream_context *ctx)
+{
+    output("[%s] while falling into the river triggers Arthurs fall in level [%d]\n", dattr->name, dattr->level);
+    dream_enqueue_cmd(ctx->arthur, DREAMER_FALL, dattr, dattr->level);
+    return DREAM_DISPATCH_WAIT;
+}
+
 /*
  * Yusuf or the sedative creator continues fighting Fischers projections and dreaming in level 2
  * Called with the dreamer mutex lock held
  */
 static void continue_dreaming_in_level_1(struct dreamer_attr *dattr)
 {
-    struct dreamer_request *req = NULL;
-    struct dreamer_attr *arthur = NULL;
+    struct dream_context ctx = {0};
     struct dreamer_attr *arthur_next_level = NULL; /* to wake him up at level 2*/
     output("[%s] starts to fall into the bridge while fighting Fischers projections in level [%d]\n",
            dattr->name, dattr->level);
 
-    arthur = dreamer_find(&dreamer_queue[0], "arthur", DREAM_ORGANIZER);
-    arthur_next_level = dreamer_find_sync(dattr, dattr->level+1, "arthur", DREAM_ORGANIZER);
+    ctx.arthur = dreamer_lookup(1, DREAM_ORGANIZER);
+    arthur_next_level = dreamer_find_sync(dattr, dattr->level+1, DREAM_ORGANIZER);
     /*
      * Wait for Arthur to enter level 2 before starting the fall.
      */
-    pthread_mutex_lock(&dattr->mutex);
-    for(;;)
-    {
-        struct timespec ts = {0};
-        while ( (req = dream_dequeue_cmd_locked(dattr) ) )
-        {
-            /*
-             * The time to exit and wake up all dreamers with a synchronized kick
-             */
-            if(req->cmd == DREAMER_SYNCHRONIZE_KICK)
-            {
-                free(req);
-                output("[%s] going to take the kick back to reality and wake up all the others through a synchronized kick "                 "by effecting the VAN to fall into the river\n", dattr->name);
-                goto out_unlock;
-            }
-            free(req);
-        }
-        output("[%s] while falling into the river triggers Arthurs fall in level [%d]\n", dattr->name, dattr->level);
-        dream_enqueue_cmd_safe(arthur, DREAMER_FALL, dattr, dattr->level, &dattr->mutex);
-        arch_gettime(dream_delay_map[dattr->level-1], &ts);
-        pthread_cond_timedwait(dattr->cond[0], &dattr->mutex, &ts);
-    }
-
-    out_unlock:
-    dattr->shared_state |= DREAMER_KICK_BACK;
-    pthread_mutex_unlock(&dattr->mutex);
+    dream_dispatch_loop(dattr, &ctx, yusuf_level1_fall);
+    dream_state_set(dattr, DREAMER_KICK_BACK);
     wake_up_dreamers(3); /* wake up all */
     wake_up_dreamer(arthur_next_level, arthur_next_level->level);
+    if(dream_projections)
+        output("[%s] kicks back [%d] of Fischers projections in level [%d]\n",
+               dattr->name, wake_up_projections(dattr->level), dattr->level);
+}
+
+/*
+ * request to enter next level from Cobb.
+ */
+static int fischer_level1_next_level(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] following Cobb. to Level [%d] to meet his father\n", 
+           dattr->name, dattr->level+1);
+    dream_level_create(dattr->level+1, dream_level_2, dattr);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int fischer_level1_fake_shape(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] interacting with Mr. Browning in hijacked state at level [%d]\n",
+           dattr->name, dattr->level);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int fischer_level1_kick_back(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] got a Kick at level [%d].\n", dattr->name, dattr->level);
+    return DREAM_DISPATCH_EXIT;
 }
 
 /*
@@ -1421,117 +4634,105 @@ static void continue_dreaming_in_level_1(struct dreamer_attr *dattr)
  */
 static void fischer_dream_level1(void)
 {
-    struct dreamer_request *req = NULL;
+    struct dream_context ctx = {0};
     struct dreamer_attr *dattr = fischer_level1;
 
     assert(dattr != NULL);
-    pthread_mutex_lock(&dattr->mutex);
-    for(;;)
-    {
-        struct timespec ts = {0};
-        while( (req = dream_dequeue_cmd_locked(dattr)))
-        {
-            if(req->cmd == DREAMER_NEXT_LEVEL) /* request to enter next level from Cobb.*/
-            {
-                output("[%s] following Cobb. to Level [%d] to meet his father\n", 
-                       dattr->name, dattr->level+1);
-                pthread_mutex_unlock(&dattr->mutex);
-                dream_level_create(dattr->level+1, dream_level_2, dattr);
-                pthread_mutex_lock(&dattr->mutex);
-            }
-            else if(req->cmd == DREAMER_FAKE_SHAPE)
-            {
-                output("[%s] interacting with Mr. Browning in hijacked state at level [%d]\n",
-                       dattr->name, dattr->level);
-            }
-            else if(req->cmd == DREAMER_KICK_BACK)
-            {
-                free(req);
-                output("[%s] got a Kick at level [%d].\n", dattr->name, dattr->level);
-                goto out;
-            }
-            free(req);
-        }
-        arch_gettime(dream_delay_map[dattr->level-1], &ts);
-        pthread_cond_timedwait(dattr->cond[0], &dattr->mutex, &ts);
-    }
-    out:
-    dattr->shared_state |= DREAMER_KICK_BACK;
+    dream_dispatch_loop(dattr, &ctx, NULL);
+    dream_state_set(dattr, DREAMER_KICK_BACK);
     /*
-     * Check if the dreamers in level 0 are back
+     * Check if the dreamers in level 0 are back. The ones in limbo are ignored.
      */
-    for(;;)
+    do
     {
-        register struct list *iter;
-
-        pthread_mutex_unlock(&dattr->mutex);
-
-        reality_kick_check:
-        sleep(2);
+        dream_sleep(2);
 #if 0
         output("[%s] doing a reality check on level [%d] dreamers\n",
                dattr->name, dattr->level);
 #endif
-        pthread_mutex_lock(&dreamer_mutex[0]);
-        pthread_mutex_lock(&dattr->mutex);
-        for(iter = dreamer_queue[0].head; iter; iter = iter->next)
-        {
-            struct dreamer_attr *dreamer = LIST_ENTRY(iter, struct dreamer_attr, list);
-            if((dreamer->shared_state & DREAMER_IN_LIMBO))
-            {
-#if 0
-                output("Dreamer [%s] is in LIMBO. So ignoring\n", dreamer->name);
-#endif
-                continue;
-            }
-            if(!(dreamer->shared_state & DREAMER_KICK_BACK))
-            {
-#if 0
-                output("Dreamer [%s] is not yet in reality\n", dreamer->name);
-#endif
-                pthread_mutex_unlock(&dattr->mutex);
-                pthread_mutex_unlock(&dreamer_mutex[0]);
-                goto reality_kick_check;
-            }
-        }
-        pthread_mutex_unlock(&dattr->mutex);
-        pthread_mutex_unlock(&dreamer_mutex[0]);
-        break;
-    }
+    } while(!dream_state_all(dattr->level, DREAMER_KICK_BACK, DREAMER_IN_LIMBO));
 
     pthread_mutex_lock(&limbo_mutex);
     dreamers_in_reality = 1;
-    pthread_cond_signal(&limbo_cond);
-    pthread_cond_wait(&limbo_cond, &limbo_mutex);
+    dream_cond_signal(&limbo_cond);
+    dream_cond_wait(&limbo_cond, &limbo_mutex);
     pthread_mutex_unlock(&limbo_mutex);
 
     output("\n\n[%s] exiting back to reality from level [%d] with the THOUGHT:\n\n", dattr->name, dattr->level);
-    pthread_cond_broadcast(&inception_reality_wakeup_for_all);
+    pthread_mutex_lock(&inception_reality_mutex);
+    dream_cond_broadcast(&inception_reality_wakeup_for_all);
+    pthread_mutex_unlock(&inception_reality_mutex);
     /* 
      * This should just exit the INCEPTION PROCESS
      */
 }
 
 
+/*
+ * Send FIGHT instructions to upper level self once found and then every period.
+ */
+static void arthur_level1_fight(struct dreamer_attr *dattr, struct dream_context *ctx)
+{
+    if(!ctx->self || ctx->timer)
+        return;
+    dream_enqueue_cmd(ctx->self, DREAMER_FIGHT, dattr, ctx->self->level);
+    ctx->timer = dream_enqueue_cmd_every(ctx->self, DREAMER_FIGHT, dattr, ctx->self->level,
+                                         dream_period(dattr->level));
+}
+
+static int arthur_level1_self(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    ctx->self = (struct dreamer_attr*)req->arg;
+    arthur_level1_fight(dattr, ctx);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+/*
+ * If you experience a FALL at this level, propagate a FREE FALL to self.
+ */
+static int arthur_level1_fall(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] experiencing a FALL in his dream at level [%d]\n", 
+           dattr->name, dattr->level);
+    /*
+     * The fall can beat the SELF request of our upper level self who has already joined level 2
+     */
+    if(!ctx->self)
+        ctx->self = dreamer_lookup(dattr->level+1, dattr->role);
+    if(ctx->self)
+    {
+        dream_enqueue_cmd(ctx->self, DREAMER_FREE_FALL, dattr, ctx->self->level);
+        arthur_level1_fight(dattr, ctx);
+    }
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int arthur_level1_kick_back(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] got a Kick at level [%d]. Exiting back to reality\n",
+           dattr->name, dattr->level);
+    return DREAM_DISPATCH_EXIT;
+}
+
+static int eames_level1_kick_back(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    output("[%s] got Kick at level 1. Exiting back to reality\n",
+           dattr->name);
+    return DREAM_DISPATCH_EXIT;
+}
+
 /*
  * In level 1, we wait for all of them to merge in a tight loop.
  */
 static void meet_all_others_in_level_1(struct dreamer_attr *dattr)
 {
-    int dreamers = 0;
     register struct list *iter;
     struct dreamer_request *req = NULL;
-    pthread_mutex_lock(&dreamer_mutex[0]);
-    list_add_tail(&dattr->list, &dreamer_queue[0]);
     /*
-     * Tight loop polling for the number of guys in the request queue
+     * Wait for all the others to join
      */
-    while( (dreamers = dreamer_queue[0].nodes) != DREAMERS)
-    {
-        pthread_mutex_unlock(&dreamer_mutex[0]);
-        usleep(10000);
-        pthread_mutex_lock(&dreamer_mutex[0]);
-    }
+    dream_level_join(dattr);
+    pthread_mutex_lock(&dreamer_mutex[0]);
 
     /*
      * Now basically we have all dreamers entered into level 1 
@@ -1557,31 +4758,25 @@ static void meet_all_others_in_level_1(struct dreamer_attr *dattr)
     /*
      * See if fischer's been hijacked.
      */
-    if(!(fischer_level1->shared_state & DREAMER_HIJACKED) )
+    if(!(dream_state(fischer_level1) & DREAMER_HIJACKED) )
     {
-        fischer_level1->shared_state |= DREAMER_HIJACKED;
+        dream_state_set(fischer_level1, DREAMER_HIJACKED);
         /* 
          * Let fischer know regarding the same so he could dream about his projections (capture inception)
          */
-        pthread_cond_signal(fischer_level1->cond[0]);
+        dream_cond_signal(&fischer_level1->cond);
     }
     
     pthread_mutex_unlock(&dreamer_mutex[0]);
-    pthread_mutex_lock(&dattr->mutex);
     /*
      * All others wait for Fischers projections to throw up. at their defense.
      */
-    while(! (req = dream_dequeue_cmd_locked(dattr) ) )
-    {
-        pthread_mutex_unlock(&dattr->mutex);
-        usleep(10000); 
-        pthread_mutex_lock(&dattr->mutex);
-    }
+    while(! (req = dream_dequeue_cmd(dattr) ) )
+        dream_usleep(10000); 
     assert(req->cmd == DREAMER_DEFENSE_PROJECTIONS);
-    free(req);
+    dream_request_free(req);
     output("[%s] sees Fischers defense projections at work in the dream at level [%d]\n", 
            dattr->name, dattr->level);
-    pthread_mutex_unlock(&dattr->mutex);
 
     /*
      * Now get into the second level. 
@@ -1595,7 +4790,6 @@ static void meet_all_others_in_level_1(struct dreamer_attr *dattr)
              * In order to counter projections, take fischer to level 2
              */
             go_with_fischer_to_level_2(fischer_level1, dattr);
-            pthread_mutex_lock(&dattr->mutex);
         }
         break;
         
@@ -1603,98 +4797,47 @@ static void meet_all_others_in_level_1(struct dreamer_attr *dattr)
         {
             output("[%s] following Cobb to level [%d]\n", dattr->name, dattr->level+1);
             dream_level_create(dattr->level+1, dream_level_2, dattr);
-            pthread_mutex_lock(&dattr->mutex);
         }
         break;
 
     case DREAM_ORGANIZER:
         {
-            struct dreamer_attr *self = NULL;
-            struct dreamer_request *req = NULL;
+            struct dream_context ctx = {0};
             output("[%s] follows Cobb. to level 2 to fight Fischers projections\n",
                    dattr->name);
             dream_level_create(dattr->level+1, dream_level_2, dattr);
-            pthread_mutex_lock(&dattr->mutex);
-            for(;;)
-            {
-                struct timespec ts = {0};
-                while ( (req = dream_dequeue_cmd_locked(dattr) ) )
-                {
-                    if(req->cmd == DREAMER_SELF)
-                    {
-                        self = (struct dreamer_attr*)req->arg;
-                    }
-                    else if(req->cmd == DREAMER_FALL)
-                    {
-                        /*
-                         * If you experience a FALL at this level, propagate a FREE FALL to self.
-                         */
-                        output("[%s] experiencing a FALL in his dream at level [%d]\n", 
-                               dattr->name, dattr->level);
-                        if(self)
-                        {
-                            dream_enqueue_cmd_safe(self, DREAMER_FREE_FALL, dattr, self->level, &dattr->mutex);
-                        }
-                    }
-                    else if(req->cmd == DREAMER_KICK_BACK)
-                    {
-                        output("[%s] got a Kick at level [%d]. Exiting back to reality\n",
-                               dattr->name, dattr->level);
-                        goto out_unlock;
-                    }
-                    free(req);
-                }
-                if(self) /* send FIGHT instructions to upper level self */
-                {
-                    dream_enqueue_cmd_safe(self, DREAMER_FIGHT, dattr, self->level, &dattr->mutex);
-                }
-                arch_gettime(dream_delay_map[dattr->level-1], &ts);
-                pthread_cond_timedwait(dattr->cond[0], &dattr->mutex, &ts);
-            }
-            
+            dream_dispatch_loop(dattr, &ctx, NULL);
+            dream_timer_cancel(ctx.timer);
+            goto out;
         }
         break;
 
     case DREAM_SHAPES_FAKER: /* Eames*/
         {
+            struct dream_context ctx = {0};
             /*
              * Fake Fischers right hand: Mr Browning for Fischer to confuse Fischer
              */
             output("[%s] faking Browning to manipulate Fischers emotions for the inception at level [%d]\n",
                    dattr->name, dattr->level);
             dream_enqueue_cmd(fischer_level1, DREAMER_FAKE_SHAPE, dattr, 1);
+            /*
+             * And keep his projection faked with Browning's presence
+             */
+            ctx.timer = dream_enqueue_cmd_every(fischer_level1, DREAMER_FAKE_SHAPE, dattr, 1,
+                                                dream_period(dattr->level));
             output("[%s] follows Cobb to level [%d] to continue with the manipulation of Fischer\n",
                    dattr->name, dattr->level+1);
             dream_level_create(dattr->level+1, dream_level_2, dattr);
-            pthread_mutex_lock(&dattr->mutex);
-            for(;;)
-            {
-                struct timespec ts = {0};
-                while( (req = dream_dequeue_cmd_locked(dattr)) )
-                {
-                    if(req->cmd == DREAMER_KICK_BACK)
-                    {
-                        free(req);
-                        output("[%s] got Kick at level 1. Exiting back to reality\n",
-                               dattr->name);
-                        goto out_unlock;
-                    }
-                    free(req);
-                }
-                /*
-                 * Keep fischers projection faked with Browning's presence
-                 */
-                dream_enqueue_cmd_safe(fischer_level1, DREAMER_FAKE_SHAPE, dattr, fischer_level1->level, &dattr->mutex);
-                arch_gettime(dream_delay_map[dattr->level-1], &ts);
-                pthread_cond_timedwait(dattr->cond[0], &dattr->mutex, &ts);
-            }
+            dream_dispatch_loop(dattr, &ctx, NULL);
+            dream_timer_cancel(ctx.timer);
+            goto out;
         }
         break;
 
     case DREAM_SEDATIVE_CREATOR:  /* Yusuf stays in level 1 */
         {
             continue_dreaming_in_level_1(dattr);
-            pthread_mutex_lock(&dattr->mutex);
         }
         break;
 
@@ -1702,13 +4845,10 @@ static void meet_all_others_in_level_1(struct dreamer_attr *dattr)
         {
             output("[%s] shot in level [%d]. Following Cobb to level [%d]\n", 
                    dattr->name, dattr->level, dattr->level+1);
-            pthread_mutex_lock(&dattr->mutex);
-            dattr->shared_state |= DREAMER_SHOT;
-            pthread_mutex_unlock(&dattr->mutex);
+            dream_state_set(dattr, DREAMER_SHOT);
             output("[%s] follows Cobb. to level [%d] after being shot\n",
                    dattr->name, dattr->level+1);
             dream_level_create(dattr->level+1, dream_level_2, dattr);
-            pthread_mutex_lock(&dattr->mutex);
         }
         break;
         
@@ -1721,9 +4861,39 @@ static void meet_all_others_in_level_1(struct dreamer_attr *dattr)
      * expecting a kick back to reality
      */
     wait_for_kick(dattr);
-    out_unlock:
-    dattr->shared_state |= DREAMER_KICK_BACK; /*mark that we have been woken up*/
-    pthread_mutex_unlock(&dattr->mutex);
+    out:
+    dream_state_set(dattr, DREAMER_KICK_BACK); /*mark that we have been woken up*/
+}
+
+static int projection_level1_defense(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int projection_level1_kick_back(struct dreamer_attr *dattr, struct dreamer_request *req, struct dream_context *ctx)
+{
+    return DREAM_DISPATCH_EXIT;
+}
+
+/*
+ * Fischers projections join the others in level 1 and defend his dream
+ * till the kick back from Yusuf.
+ */
+static void projection_dream_level_1(struct dreamer_attr *dattr)
+{
+    struct dream_context ctx = {0};
+    dream_level_join(dattr);
+    dream_dispatch_loop(dattr, &ctx, NULL);
+    dream_state_set(dattr, DREAMER_KICK_BACK);
+}
+
+/*
+ * Projections on the executor: they only react to their mailbox till the kick back from Yusuf.
+ */
+static void projection_task_start(struct dreamer_attr *dattr)
+{
+    dream_dreamer_task_create(dattr);
+    dream_level_enter(dattr);
 }
 
 static void shared_dream_level_1(void *dreamer_attr)
@@ -1754,12 +4924,14 @@ static void shared_dream_level_1(void *dreamer_attr)
              */
             pthread_mutex_lock(&dreamer_mutex[0]);
             list_add(&dattr->list, &dreamer_queue[0]);
+            dreamer_table_add(dattr);
+            dream_barrier_arrive(&dream_level_barriers[0]);
             fischer_level1_taskid = GET_TID;
-            pthread_cond_wait(dattr->cond[0], &dreamer_mutex[0]);
+            dream_cond_wait(&dattr->cond, &dreamer_mutex[0]);
             /*
              * When woken up, make sure you are in hijacked state!
              */
-            if(!(dattr->shared_state & DREAMER_HIJACKED))
+            if(!(dream_state(dattr) & DREAMER_HIJACKED))
             {
                 pthread_mutex_unlock(&dreamer_mutex[0]);
                 output("Fischer woken up without being hijacked. Inception process aborted\n");
@@ -1767,7 +4939,7 @@ static void shared_dream_level_1(void *dreamer_attr)
             }
             output("[%s] HIJACKED ! Open up my defense projections in my dream to the hijackers!\n",
                    dattr->name);
-            dream_clone_cmd(&dreamer_queue[0], DREAMER_DEFENSE_PROJECTIONS, dattr, dattr, dattr->level);
+            dream_clone_cmd(DREAMER_DEFENSE_PROJECTIONS, dattr, dattr, dattr->level);
             pthread_mutex_unlock(&dreamer_mutex[0]);
             /*
              * Now get into the request processing loop in level 1 by noting my confused thoughts
@@ -1837,6 +5009,12 @@ static void shared_dream_level_1(void *dreamer_attr)
         }
         break;
 
+    case DREAM_PROJECTION:
+        {
+            projection_dream_level_1(dattr);
+        }
+        break;
+
     default:
         break;
     }
@@ -1852,31 +5030,36 @@ static void create_dreamer(struct dreamer_attr *dattr)
 {
     pthread_attr_t attr;
     pthread_t d;
-    assert(pthread_attr_init(&attr) == 0);
-    assert(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0);
     /*
-     * inherit attributes from the movie/director thread
+     * A carrier per dreamer of the cast, in the order they are created
      */
-    assert(pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED) == 0);
-    assert(pthread_create(&d, &attr, dreamer, dattr) == 0);
+    if(dream_nested && !(dattr->role & DREAM_PROJECTION))
+    {
+        dream_fiber_create(dreamer, dattr);
+        return;
+    }
+    dream_thread_attr_init(&attr);
+    assert(dream_thread_create(&d, &attr, dreamer, dattr) == 0);
+    pthread_attr_destroy(&attr);
 }
 
-static void lucid_dreamer(const char *name, int role)
+static struct dreamer_attr *dream_attr_alloc(const char *name, int role)
 {
     struct dreamer_attr *dattr = calloc(1, sizeof(*dattr));
-    register int i;
     assert(dattr != NULL);
     dattr->name = name;
     dattr->role = role;
+    dattr->id = dream_id_intern(name, role);
     dattr->level = 1;
     assert(pthread_mutex_init(&dattr->mutex, NULL) == 0);
-    for(i = 0 ; i < DREAM_LEVELS; ++i)
-    {
-        dattr->cond[i] = calloc(1, sizeof(*dattr->cond[i]));
-        assert(pthread_cond_init(dattr->cond[i], NULL) == 0);
-    }
-    list_init(&dattr->request_queue);
-    create_dreamer(dattr);
+    assert(arch_cond_init(&dattr->cond) == 0);
+    dream_mailbox_init(&dattr->mailbox);
+    return dattr;
+}
+
+static void lucid_dreamer(const char *name, int role)
+{
+    create_dreamer(dream_attr_alloc(name, role));
 }
 
 /*
@@ -1885,6 +5068,7 @@ static void lucid_dreamer(const char *name, int role)
 static void *inception(void *unused)
 {
     struct sched_param param = {.sched_priority = 99 };
+    register int i;
     int policy = SCHED_OTHER;
     if(!getuid() 
        ||
@@ -1898,6 +5082,13 @@ static void *inception(void *unused)
         param.sched_priority = 0;
     }
     assert(pthread_setschedparam(pthread_self(), policy, &param) == 0);
+    dream_wheel_start();
+    if(dream_nested)
+        dream_fibers_start(DREAMERS);
+    else if(dream_carriers)
+        dream_fibers_start(dream_carriers);
+    else if(dream_thread_cache)
+        dream_threads_start(dream_thread_cache);
     lucid_dreamer("Fischer", DREAM_INCEPTION_TARGET);
     lucid_dreamer("Cobb", DREAM_INCEPTION_PERFORMER);
     lucid_dreamer("Ariadne", DREAM_WORLD_ARCHITECT);
@@ -1905,29 +5096,294 @@ static void *inception(void *unused)
     lucid_dreamer("Eames", DREAM_SHAPES_FAKER);
     lucid_dreamer("Yusuf", DREAM_SEDATIVE_CREATOR);
     lucid_dreamer("Saito", DREAM_OVERLOOKER);
+    if(dream_projections && dream_workers > 0)
+        dream_executor_start(dream_workers, dream_projections);
+    for(i = 0; i < dream_projections; ++i)
+    {
+        char *name = malloc(32);
+        assert(name != NULL);
+        snprintf(name, 32, "Projection %d", i + 1);
+        if(dream_workers > 0)
+            projection_task_start(dream_attr_alloc(name, DREAM_PROJECTION));
+        else
+            lucid_dreamer(name, DREAM_PROJECTION);
+    }
     pthread_mutex_lock(&inception_reality_mutex);
-    pthread_cond_wait(&inception_reality_wakeup_for_all, &inception_reality_mutex);
+    dream_cond_wait(&inception_reality_wakeup_for_all, &inception_reality_mutex);
     pthread_mutex_unlock(&inception_reality_mutex);
     return NULL;
 }
 
-int main()
+/*
+ * Request handlers of every dreamer at every level. A command without an entry is dropped
+ * by the dreamer at that level.
+ */
+static const struct dream_dispatch_entry dream_dispatch_entries[] = {
+    /* level 1 */
+    { DREAM_INCEPTION_TARGET, 1, DREAMER_NEXT_LEVEL, fischer_level1_next_level },
+    { DREAM_INCEPTION_TARGET, 1, DREAMER_FAKE_SHAPE, fischer_level1_fake_shape },
+    { DREAM_INCEPTION_TARGET, 1, DREAMER_KICK_BACK, fischer_level1_kick_back },
+    { DREAM_INCEPTION_PERFORMER, 1, DREAMER_KICK_BACK, dreamer_kick_back },
+    { DREAM_WORLD_ARCHITECT, 1, DREAMER_KICK_BACK, dreamer_kick_back },
+    { DREAM_ORGANIZER, 1, DREAMER_SELF, arthur_level1_self },
+    { DREAM_ORGANIZER, 1, DREAMER_FALL, arthur_level1_fall },
+    { DREAM_ORGANIZER, 1, DREAMER_KICK_BACK, arthur_level1_kick_back },
+    { DREAM_SHAPES_FAKER, 1, DREAMER_KICK_BACK, eames_level1_kick_back },
+    { DREAM_SEDATIVE_CREATOR, 1, DREAMER_SYNCHRONIZE_KICK, yusuf_level1_synchronize_kick },
+    { DREAM_SEDATIVE_CREATOR, 1, DREAMER_KICK_BACK, dreamer_kick_back },
+    { DREAM_OVERLOOKER, 1, DREAMER_KICK_BACK, dreamer_kick_back },
+    { DREAM_PROJECTION, 1, DREAMER_DEFENSE_PROJECTIONS, projection_level1_defense },
+    { DREAM_PROJECTION, 1, DREAMER_KICK_BACK, projection_level1_kick_back },
+    /* level 2 */
+    { DREAM_INCEPTION_TARGET, 2, DREAMER_NEXT_LEVEL, fischer_level2_next_level },
+    { DREAM_INCEPTION_TARGET, 2, DREAMER_FAKE_SHAPE, fischer_level2_fake_shape },
+    { DREAM_INCEPTION_TARGET, 2, DREAMER_KICK_BACK, dreamer_kick_back },
+    { DREAM_INCEPTION_PERFORMER, 2, DREAMER_IN_MY_DREAM, cobb_level2_in_my_dream },
+    { DREAM_INCEPTION_PERFORMER, 2, DREAMER_KICK_BACK, dreamer_kick_back },
+    { DREAM_WORLD_ARCHITECT, 2, DREAMER_NEXT_LEVEL, ariadne_level2_next_level },
+    { DREAM_WORLD_ARCHITECT, 2, DREAMER_KICK_BACK, ariadne_level2_kick_back },
+    { DREAM_ORGANIZER, 2, DREAMER_IN_MY_DREAM, arthur_level2_in_my_dream },
+    { DREAM_ORGANIZER, 2, DREAMER_FREE_FALL, arthur_level2_free_fall },
+    { DREAM_ORGANIZER, 2, DREAMER_FIGHT, arthur_level2_fight },
+    { DREAM_ORGANIZER, 2, DREAMER_KICK_BACK, arthur_level2_kick_back },
+    { DREAM_SHAPES_FAKER, 2, DREAMER_NEXT_LEVEL, eames_level2_next_level },
+    { DREAM_SHAPES_FAKER, 2, DREAMER_KICK_BACK, eames_level2_kick_back },
+    { DREAM_OVERLOOKER, 2, DREAMER_NEXT_LEVEL, eames_level2_next_level },
+    { DREAM_OVERLOOKER, 2, DREAMER_KICK_BACK, eames_level2_kick_back },
+    /* level 3 */
+    { DREAM_INCEPTION_TARGET, 3, DREAMER_SHOT, fischer_level3_shot },
+    { DREAM_INCEPTION_TARGET, 3, DREAMER_KICK_BACK, fischer_level3_kick_back },
+    { DREAM_INCEPTION_TARGET, 3, DREAMER_FAKE_SHAPE, fischer_level3_fake_shape },
+    { DREAM_INCEPTION_PERFORMER, 3, DREAMER_FIGHT, cobb_level3_fight },
+    { DREAM_INCEPTION_PERFORMER, 3, DREAMER_IN_MY_DREAM, cobb_level3_in_my_dream },
+    { DREAM_INCEPTION_PERFORMER, 3, DREAMER_NEXT_LEVEL, cobb_level3_next_level },
+    { DREAM_WORLD_ARCHITECT, 3, DREAMER_SHOT, ariadne_level3_shot },
+    { DREAM_WORLD_ARCHITECT, 3, DREAMER_KICK_BACK, ariadne_level3_kick_back },
+    { DREAM_SHAPES_FAKER, 3, DREAMER_FIGHT, eames_level3_fight },
+    { DREAM_SHAPES_FAKER, 3, DREAMER_SHOT, eames_level3_shot },
+    { DREAM_SHAPES_FAKER, 3, DREAMER_RECOVER, eames_level3_recover },
+    { DREAM_SHAPES_FAKER, 3, DREAMER_KICK_BACK, eames_level3_kick_back },
+    { DREAM_OVERLOOKER, 3, DREAMER_FIGHT, saito_level3_fight },
+    { DREAM_OVERLOOKER, 3, DREAMER_KILLED, saito_level3_killed },
+    /* limbo */
+    { DREAM_INCEPTION_TARGET, DREAM_LIMBO, DREAMER_KICK_BACK, fischer_limbo_kick_back },
+    { DREAM_INCEPTION_PERFORMER, DREAM_LIMBO, DREAMER_IN_MY_DREAM, cobb_limbo_in_my_dream },
+    { DREAM_INCEPTION_PERFORMER, DREAM_LIMBO, DREAMER_KILLED, cobb_limbo_killed },
+    { DREAM_INCEPTION_PERFORMER, DREAM_LIMBO, DREAMER_RECOVER, cobb_limbo_recover },
+    { DREAM_WORLD_ARCHITECT, DREAM_LIMBO, DREAMER_IN_MY_DREAM, ariadne_limbo_in_my_dream },
+    { DREAM_WORLD_ARCHITECT, DREAM_LIMBO, DREAMER_RECOVER, ariadne_limbo_recover },
+    { DREAM_WORLD_ARCHITECT, DREAM_LIMBO, DREAMER_KICK_BACK, ariadne_limbo_kick_back },
+};
+
+/*
+ * Build the dispatch table for the depth of the dream. Every dreamer on the way to limbo
+ * passes the kick back on.
+ */
+static void dream_dispatch_init(void)
+{
+    register int i, level;
+    memset(dream_dispatch_table, 0, sizeof(dream_dispatch_table));
+    for(i = 0; i < sizeof(dream_dispatch_entries)/sizeof(dream_dispatch_entries[0]); ++i)
+    {
+        const struct dream_dispatch_entry *entry = &dream_dispatch_entries[i];
+        const struct dream_dispatch_entry **slot;
+        level = entry->level == DREAM_LIMBO ? dream_depth : entry->level;
+        assert(level >= 1 && level <= dream_depth);
+        assert(entry->cmd && !(entry->cmd & (entry->cmd - 1)) && entry->cmd < (1 << DREAMER_CMDS));
+        slot = &dream_dispatch_table[DREAM_ROLE_INDEX(entry->role)][level-1][__builtin_ctz(entry->cmd)];
+        assert(*slot == NULL); /* one handler per role, level and command */
+        *slot = entry;
+    }
+    for(level = DREAM_LEVELS; level < dream_depth; ++level)
+    {
+        for(i = 0; i < DREAM_ROLES; ++i)
+            dream_dispatch_table[i][level-1][__builtin_ctz(DREAMER_KICK_BACK)] = &dream_descend_kick_back_entry;
+    }
+}
+
+#include "inception_bench.h"
+
+/*
+ * Integer value of an option within [min, max]. Returns -1 on garbage or a value out of range.
+ */
+static int dream_option_int(const char *arg, long min, long max, int *value)
+{
+    char *end = NULL;
+    long v;
+    errno = 0;
+    v = strtol(arg, &end, 0);
+    if(errno || end == arg || *end || v < min || v > max)
+        return -1;
+    *value = v;
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    output("%s [-s] [-q capacity] [-x projections] [-w workers] [-c carriers] [-n] [-t threads] [-k stack KB] [-g guard KB] [-a placement] [-d depth] [-v seed] [-b benchmark]\n"
+           "  -s  print the engine stats on returning to reality\n"
+           "  -q  bound the dreamer mailboxes to capacity requests. Unbounded by default\n"
+           "  -x  add projections of Fischer to the cast of the shared dream at level 1\n"
+           "  -w  run the projections as tasks on workers. One per cpu by default, 0 for a thread each\n"
+           "  -c  run the dreamers below level 1 as coroutines on carrier threads. A thread each by default\n"
+           "  -n  nest the levels of a dreamer in its thread as coroutines. Not with -c\n"
+           "  -t  threads pre-spawned for the levels below 1, reused from level to level. 0 for a new thread per level\n"
+           "  -k  stack size of the dreamer threads in KB, at least PTHREAD_STACK_MIN. 0 for the default of the system\n"
+           "  -g  guard size below the stacks of the dreamer threads in KB\n"
+           "  -a  placement of the dreamer threads on the cpus: none, core, l2, spread or isolate\n"
+           "  -d  depth of the dream from 4 to 64 levels. Limbo is the deepest level\n"
+           "  -v  dream in virtual time jumping to the next event. The seed orders events due together\n"
+           "  -b  run a benchmark instead of the movie. One of:", prog);
+    dream_bench_list();
+    output("\n");
+}
+
+int main(int argc, char **argv)
 {
     pthread_t movie;
     register int i;
+    int stats = 0;
+    int c, kb;
+    const char *bench = NULL;
+    int depth = DREAM_LEVELS;
+    int virtual_time = 0;
+    unsigned int seed = 0;
+    while( (c = getopt(argc, argv, "sq:x:w:c:nt:k:g:a:d:v:b:h")) != EOF )
+    {
+        switch(c)
+        {
+        case 's':
+            stats = 1;
+            break;
+        case 'q':
+            if(dream_option_int(optarg, 0, INT_MAX, &dream_mailbox_capacity) < 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'x':
+            if(dream_option_int(optarg, 0, INT_MAX - DREAMERS, &dream_projections) < 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'w':
+            if(dream_option_int(optarg, 0, INT_MAX, &dream_workers) < 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            if(dream_option_int(optarg, 0, INT_MAX, &dream_carriers) < 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'n':
+            dream_nested = 1;
+            break;
+        case 't':
+            if(dream_option_int(optarg, 0, INT_MAX, &dream_thread_cache) < 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'k':
+            if(dream_option_int(optarg, 0, INT_MAX, &kb) < 0
+               ||
+               (kb && (size_t)kb << 10 < PTHREAD_STACK_MIN))
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            dream_stack_size = (size_t)kb << 10;
+            break;
+        case 'g':
+            if(dream_option_int(optarg, 0, INT_MAX, &kb) < 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            dream_guard_size = (size_t)kb << 10;
+            break;
+        case 'a':
+            dream_placement = dream_placement_lookup(optarg);
+            if(dream_placement < 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'd':
+            if(dream_option_int(optarg, DREAM_LEVELS, DREAM_LEVELS_MAX, &depth) < 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'v':
+            virtual_time = 1;
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            bench = optarg;
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if(dream_nested && dream_carriers)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if(dream_workers < 0)
+        dream_workers = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    assert(arch_cond_init(&inception_reality_wakeup_for_all) == 0);
+    assert(arch_cond_init(&limbo_cond) == 0);
+    list_init(&dream_threads.idle);
+    dream_cmd_classes_init();
+    dream_levels_init(depth);
+    dream_dispatch_init();
+    dream_request_pool_init();
+    dream_registry_init(DREAMERS + dream_projections);
+    dream_level_barriers[0].expected += dream_projections;
     /*
      * Initialize the per level dream request queues.
      */
-    for(i = 0; i < DREAM_LEVELS; ++i)
+    for(i = 0; i < DREAM_LEVELS_MAX; ++i)
     {
         assert(pthread_mutex_init(&dreamer_mutex[i], NULL) == 0);
+        assert(arch_cond_init(&dreamer_join_cond[i]) == 0);
         list_init(&dreamer_queue[i]);
     }
-    assert(pthread_create(&movie, NULL, inception, NULL) == 0);
+    dream_placement_start();
+    if(bench)
+        return dream_bench_run(bench);
+    if(virtual_time)
+        dream_vclock_start(seed);
+    assert(dream_thread_create(&movie, NULL, inception, NULL) == 0);
     pthread_join(movie, NULL);
+    if(stats)
+    {
+        dream_request_pool_stats();
+        dream_mailbox_stats_print();
+        dream_mailbox_high_water_print();
+        dream_barrier_stats_print();
+        dream_wheel_stats_print();
+        dream_vclock_stats_print();
+        dream_executor_stats_print();
+        dream_fibers_stats_print();
+        dream_threads_stats_print();
+        dream_placement_stats_print();
+        output("Registry grace periods: [%lu]\n", __atomic_load_n(&dream_rcu.grace_periods, __ATOMIC_RELAXED));
+    }
     return 0;
 }
-    
-
-
-
@@ -4,6 +4,8 @@
 #ifndef _INCEPTION_ARCH_H_
 #define _INCEPTION_ARCH_H_
 
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <sys/mman.h>
 
@@ -19,20 +21,312 @@ extern "C" {
 #endif
 
 #ifdef __linux__
-static __inline__ void arch_gettime(int delay, struct timespec *ts)
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * Timed waits are on the monotonic clock of arch_time_ns so they are not
+ * stretched or cut short by wall clock steps.
+ */
+static __inline__ int arch_cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    int err;
+    if( (err = pthread_condattr_init(&attr)) )
+        return err;
+    if(!(err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)))
+        err = pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return err;
+}
+
+static __inline__ unsigned long long arch_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Sleep while *addr is still val. Returns on a wake up, a signal or a changed value.
+ */
+static __inline__ void arch_futex_wait(int *addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static __inline__ void arch_futex_wake_all(int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static __inline__ void arch_futex_wake_one(int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Returns 1 if every other thread of the process is sleeping. A thread woken up is runnable
+ * for the kernel before the waker returns, so a wake up in flight never reads as idle.
+ */
+static int arch_threads_blocked(void)
+{
+    char path[64], stat[256];
+    pid_t self = syscall(SYS_gettid);
+    DIR *tasks = opendir("/proc/self/task");
+    struct dirent *task;
+    int blocked = 1;
+    if(!tasks)
+        return 0;
+    while(blocked && (task = readdir(tasks)))
+    {
+        int tid = atoi(task->d_name);
+        char *state;
+        ssize_t bytes;
+        int fd;
+        if(tid <= 0 || tid == self)
+            continue;
+        snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+        if( (fd = open(path, O_RDONLY)) < 0)
+            continue; /* exited */
+        bytes = read(fd, stat, sizeof(stat) - 1);
+        close(fd);
+        if(bytes <= 0)
+            continue;
+        stat[bytes] = 0;
+        /*
+         * The state follows the command name in parentheses
+         */
+        if( (state = strrchr(stat, ')')) && state[1] && strchr("SZX", state[2]) == NULL)
+            blocked = 0;
+    }
+    closedir(tasks);
+    return blocked;
+}
+
+/*
+ * Cpus of a cpu list of sysfs like 0-3,8-11. Returns the number of cpus, 0 if the list is missing.
+ */
+static int arch_cpulist_read(const char *path, int *cpus, int max)
+{
+    char list[4096], *iter = list;
+    int ncpus = 0;
+    FILE *file = fopen(path, "r");
+    if(!file)
+        return 0;
+    if(!fgets(list, sizeof(list), file))
+        list[0] = 0;
+    fclose(file);
+    while(*iter >= '0' && *iter <= '9')
+    {
+        int first = strtol(iter, &iter, 10), last = first;
+        if(*iter == '-')
+            last = strtol(iter + 1, &iter, 10);
+        while(first <= last && ncpus < max)
+            cpus[ncpus++] = first++;
+        if(*iter == ',')
+            ++iter;
+    }
+    return ncpus;
+}
+
+static __inline__ int arch_thread_pin(const int *cpus, int ncpus)
+{
+    cpu_set_t set;
+    register int i;
+    CPU_ZERO(&set);
+    for(i = 0; i < ncpus; ++i)
+        CPU_SET(cpus[i], &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static __inline__ int arch_thread_cpu(void)
 {
-    clock_gettime(CLOCK_REALTIME, ts);
-    ts->tv_sec += delay;
+    return sched_getcpu();
+}
+
+/*
+ * Virtual and resident size of the process in KB.
+ */
+static void arch_memory_usage(unsigned long *vsz, unsigned long *rss)
+{
+    char line[128];
+    FILE *status = fopen("/proc/self/status", "r");
+    *vsz = *rss = 0;
+    if(!status)
+        return;
+    while(fgets(line, sizeof(line), status))
+    {
+        if(!strncmp(line, "VmSize:", 7))
+            *vsz = strtoul(line + 7, NULL, 10);
+        else if(!strncmp(line, "VmRSS:", 6))
+            *rss = strtoul(line + 6, NULL, 10);
+    }
+    fclose(status);
 }
 #else
-static __inline__ void arch_gettime(int delay, struct timespec *ts)
+/*
+ * Timed waits are on the wall clock of arch_time_ns.
+ */
+static __inline__ int arch_cond_init(pthread_cond_t *cond)
+{
+    return pthread_cond_init(cond, NULL);
+}
+
+static __inline__ unsigned long long arch_time_ns(void)
 {
     struct timeval t;
     gettimeofday(&t, NULL);
-    t.tv_sec += delay;
-    ts->tv_sec = t.tv_sec;
-    ts->tv_nsec = t.tv_usec*1000L;
+    return t.tv_sec * 1000000000ULL + t.tv_usec * 1000ULL;
 }
+
+/*
+ * No futex. The waiters poll the value.
+ */
+static __inline__ void arch_futex_wait(int *addr, int val)
+{
+    if(__atomic_load_n(addr, __ATOMIC_ACQUIRE) == val)
+        usleep(1000);
+}
+
+static __inline__ void arch_futex_wake_all(int *addr)
+{
+}
+
+static __inline__ void arch_futex_wake_one(int *addr)
+{
+}
+
+/*
+ * No view of the thread states. Counts on the caller running at the lowest priority
+ * so it only gets the CPU once the others are blocked.
+ */
+static __inline__ int arch_threads_blocked(void)
+{
+    return 1;
+}
+
+static __inline__ void arch_memory_usage(unsigned long *vsz, unsigned long *rss)
+{
+    *vsz = *rss = 0;
+}
+
+/*
+ * No topology or affinity. Placement is left to the scheduler.
+ */
+static __inline__ int arch_cpulist_read(const char *path, int *cpus, int max)
+{
+    return 0;
+}
+
+static __inline__ int arch_thread_pin(const int *cpus, int ncpus)
+{
+    return 0;
+}
+
+static __inline__ int arch_thread_cpu(void)
+{
+    return -1;
+}
+#endif
+
+/*
+ * Absolute deadline in ns of arch_time_ns for the timed waits on condition variables of arch_cond_init.
+ */
+static __inline__ void arch_deadline(unsigned long long deadline, struct timespec *ts)
+{
+    ts->tv_sec = deadline / 1000000000ULL;
+    ts->tv_nsec = deadline % 1000000000ULL;
+}
+
+/*
+ * User level context switch for the coroutines. On x86_64 only the callee saved registers
+ * and the floating point control words are switched, without the signal mask round trip
+ * to the kernel of swapcontext. Other archs fall back to ucontext.
+ */
+#if defined(__x86_64__)
+
+struct arch_context
+{
+    void *sp;
+};
+
+void arch_context_switch(struct arch_context *from, struct arch_context *to);
+
+__asm__(".text\n"
+        ".globl arch_context_switch\n"
+        ".type arch_context_switch, @function\n"
+        "arch_context_switch:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    subq $8, %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq (%rsi), %rsp\n"
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    addq $8, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size arch_context_switch, .-arch_context_switch\n");
+
+/*
+ * Lay out the stack for the first switch to return into the entry, with the stack
+ * aligned as after a call. The entry never returns.
+ */
+static __inline__ void arch_context_init(struct arch_context *ctx, void *stack, size_t size, void (*entry)(void))
+{
+    unsigned long *sp = (unsigned long *)(((unsigned long)stack + size) & ~15UL);
+    *--sp = 0; /* return address of the entry */
+    *--sp = (unsigned long)entry;
+    sp -= 6; /* rbp, rbx, r12 to r15 */
+    memset(sp, 0, 6 * sizeof(*sp));
+    --sp;
+    ((unsigned int *)sp)[0] = 0x1f80; /* mxcsr */
+    ((unsigned int *)sp)[1] = 0x037f; /* x87 control word */
+    ctx->sp = sp;
+}
+
+#else
+
+#include <ucontext.h>
+
+struct arch_context
+{
+    ucontext_t uc;
+};
+
+static __inline__ void arch_context_switch(struct arch_context *from, struct arch_context *to)
+{
+    swapcontext(&from->uc, &to->uc);
+}
+
+static __inline__ void arch_context_init(struct arch_context *ctx, void *stack, size_t size, void (*entry)(void))
+{
+    getcontext(&ctx->uc);
+    ctx->uc.uc_stack.ss_sp = stack;
+    ctx->uc.uc_stack.ss_size = size;
+    ctx->uc.uc_link = NULL;
+    makecontext(&ctx->uc, entry, 0);
+}
+
 #endif
 
 #ifdef __cplusplus
@@ -0,0 +1,1719 @@
+/*
+ * Micro benchmarks for the dream engine internals. Run with: ./inception -b <benchmark>
+ */
+
+#ifndef _INCEPTION_C_
+#error "This special header file has to be included only from inception.c"
+#endif
+
+#define DREAM_BENCH_LOOPS (1000000)
+#define DREAM_BENCH_INFLIGHT (256) /* max requests in flight between producer and consumer */
+
+struct dream_bench
+{
+    const char *name;
+    const char *desc;
+    void (*run)(void);
+};
+
+static void dream_bench_report(const char *what, unsigned long long ns, unsigned long ops)
+{
+    output("%-48s: %10.1f ns/op\n", what, (double)ns/ops);
+}
+
+/*
+ * Request allocation: the pool against the calloc/free path it replaced.
+ */
+struct dream_bench_pipe
+{
+    struct llist_head inbox;
+    int use_pool;
+    int inflight;
+};
+
+static struct dreamer_request *dream_bench_alloc(int use_pool)
+{
+    struct dreamer_request *req;
+    if(use_pool)
+        return dream_request_alloc();
+    req = calloc(1, sizeof(*req));
+    assert(req != NULL);
+    return req;
+}
+
+static void dream_bench_free(struct dreamer_request *req, int use_pool)
+{
+    if(use_pool)
+        dream_request_free(req);
+    else
+        free(req);
+}
+
+static void *dream_bench_pipe_consumer(void *arg)
+{
+    struct dream_bench_pipe *pipe = arg;
+    register int consumed = 0;
+    while(consumed < DREAM_BENCH_LOOPS)
+    {
+        struct llist_node *iter = llist_del_all(&pipe->inbox);
+        int batch = 0;
+        if(!iter)
+        {
+            sched_yield();
+            continue;
+        }
+        while(iter)
+        {
+            struct dreamer_request *req = LIST_ENTRY(iter, struct dreamer_request, mailbox);
+            iter = iter->next;
+            dream_bench_free(req, pipe->use_pool);
+            ++batch;
+        }
+        consumed += batch;
+        __atomic_sub_fetch(&pipe->inflight, batch, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static unsigned long long dream_bench_pipe_run(int use_pool)
+{
+    struct dream_bench_pipe pipe = { .use_pool = use_pool };
+    unsigned long long start;
+    pthread_t consumer;
+    register int i;
+    llist_init(&pipe.inbox);
+    start = arch_time_ns();
+    assert(pthread_create(&consumer, NULL, dream_bench_pipe_consumer, &pipe) == 0);
+    for(i = 0; i < DREAM_BENCH_LOOPS; ++i)
+    {
+        struct dreamer_request *req;
+        while(__atomic_load_n(&pipe.inflight, __ATOMIC_ACQUIRE) >= DREAM_BENCH_INFLIGHT)
+            sched_yield();
+        req = dream_bench_alloc(use_pool);
+        req->cmd = DREAMER_FIGHT;
+        __atomic_add_fetch(&pipe.inflight, 1, __ATOMIC_RELAXED);
+        llist_add(&req->mailbox, &pipe.inbox);
+    }
+    pthread_join(consumer, NULL);
+    return arch_time_ns() - start;
+}
+
+static void dream_bench_pool(void)
+{
+    unsigned long long start;
+    unsigned long heap_allocs;
+    register int i;
+    start = arch_time_ns();
+    for(i = 0; i < DREAM_BENCH_LOOPS; ++i)
+    {
+        struct dreamer_request * volatile req = dream_bench_alloc(0);
+        dream_bench_free(req, 0);
+    }
+    dream_bench_report("calloc/free, same thread", arch_time_ns() - start, DREAM_BENCH_LOOPS);
+    start = arch_time_ns();
+    for(i = 0; i < DREAM_BENCH_LOOPS; ++i)
+    {
+        struct dreamer_request * volatile req = dream_bench_alloc(1);
+        dream_bench_free(req, 1);
+    }
+    dream_bench_report("request pool, same thread", arch_time_ns() - start, DREAM_BENCH_LOOPS);
+    dream_bench_report("calloc/free, producer to consumer thread", dream_bench_pipe_run(0), DREAM_BENCH_LOOPS);
+    heap_allocs = dream_request_depot.heap_allocs_after_startup;
+    dream_bench_report("request pool, producer to consumer thread", dream_bench_pipe_run(1), DREAM_BENCH_LOOPS);
+    output("Request pool heap allocations during the benchmark: [%lu]\n",
+           dream_request_depot.heap_allocs_after_startup - heap_allocs);
+    dream_request_pool_stats();
+}
+
+/*
+ * Kick delivery latency behind a flood of data commands. Measured once with the priority lanes
+ * and once with every command mapped to the data lane as in the single FIFO mailbox.
+ */
+#define DREAM_BENCH_FLOOD (20000) /* data commands queued ahead of the kick */
+#define DREAM_BENCH_FLOOD_ROUNDS (20)
+#define DREAM_BENCH_CMD_WORK (500) /* ns spent by the consumer on each data command */
+
+struct dream_bench_kick
+{
+    struct dreamer_attr dreamer;
+    unsigned long long kick_seen;
+    int processed;
+};
+
+static void dream_bench_spin(unsigned long long ns)
+{
+    unsigned long long start = arch_time_ns();
+    while(arch_time_ns() - start < ns);
+}
+
+static void *dream_bench_kick_consumer(void *arg)
+{
+    struct dream_bench_kick *bench = arg;
+    struct dreamer_attr *dattr = &bench->dreamer;
+    struct dreamer_request *req;
+    unsigned long long deadline = 0;
+    for(;;)
+    {
+        LIST_DECLARE(cmds);
+        dream_drain_cmds(dattr, &cmds);
+        while( (req = dream_cmd_next(dattr, &cmds)) )
+        {
+            int cmd = req->cmd;
+            dream_request_free(req);
+            if(cmd == DREAMER_SYNCHRONIZE_KICK)
+            {
+                dream_cmds_release(&cmds);
+                return NULL;
+            }
+            if(cmd == DREAMER_KICK_BACK)
+            {
+                __atomic_store_n(&bench->kick_seen, arch_time_ns(), __ATOMIC_RELEASE);
+                continue;
+            }
+            dream_bench_spin(DREAM_BENCH_CMD_WORK);
+            __atomic_add_fetch(&bench->processed, 1, __ATOMIC_RELEASE);
+        }
+        dream_wait_cmd(dattr, &deadline);
+    }
+    return NULL;
+}
+
+static void dream_bench_kick_run(const char *what)
+{
+    struct dream_bench_kick bench;
+    struct dreamer_attr *dattr = &bench.dreamer;
+    unsigned long long total = 0, worst = 0;
+    pthread_t consumer;
+    register int round;
+    memset(&bench, 0, sizeof(bench));
+    dattr->name = "bench";
+    dattr->level = 1;
+    dream_mailbox_init(&dattr->mailbox);
+    assert(pthread_mutex_init(&dattr->mutex, NULL) == 0);
+    assert(arch_cond_init(&dattr->cond) == 0);
+    assert(pthread_create(&consumer, NULL, dream_bench_kick_consumer, &bench) == 0);
+    for(round = 1; round <= DREAM_BENCH_FLOOD_ROUNDS; ++round)
+    {
+        struct dream_batch batch;
+        unsigned long long start, latency;
+        register int i;
+        dream_batch_begin(&batch);
+        for(i = 0; i < DREAM_BENCH_FLOOD; ++i)
+            dream_enqueue_cmd(dattr, DREAMER_FIGHT, NULL, 1);
+        dream_batch_end(&batch);
+        start = arch_time_ns();
+        dream_enqueue_cmd(dattr, DREAMER_KICK_BACK, NULL, 1);
+        while(!__atomic_load_n(&bench.kick_seen, __ATOMIC_ACQUIRE))
+            sched_yield();
+        latency = bench.kick_seen - start;
+        total += latency;
+        if(latency > worst)
+            worst = latency;
+        /*
+         * Let the flood drain before the next round
+         */
+        while(__atomic_load_n(&bench.processed, __ATOMIC_ACQUIRE) < round * DREAM_BENCH_FLOOD)
+            sched_yield();
+        bench.kick_seen = 0;
+    }
+    dream_enqueue_cmd(dattr, DREAMER_SYNCHRONIZE_KICK, NULL, 1);
+    pthread_join(consumer, NULL);
+    output("%-48s: %10.1f us avg, %10.1f us max\n", what,
+           (double)total/DREAM_BENCH_FLOOD_ROUNDS/1000, (double)worst/1000);
+    pthread_cond_destroy(&dattr->cond);
+    pthread_mutex_destroy(&dattr->mutex);
+}
+
+static void dream_bench_kick(void)
+{
+    int lanes[DREAMER_CMDS];
+    register int i;
+    output("Kick delivery behind [%d] queued data commands of [%d] ns each\n",
+           DREAM_BENCH_FLOOD, DREAM_BENCH_CMD_WORK);
+    for(i = 0; i < DREAMER_CMDS; ++i)
+    {
+        lanes[i] = dream_cmd_classes[i].lane;
+        dream_cmd_classes[i].lane = DREAM_LANE_DATA;
+    }
+    dream_bench_kick_run("kick latency, single FIFO");
+    for(i = 0; i < DREAMER_CMDS; ++i)
+        dream_cmd_classes[i].lane = lanes[i];
+    dream_bench_kick_run("kick latency, priority lanes");
+}
+
+/*
+ * Repeated enqueues of an idempotent command to a dreamer that is not draining its mailbox,
+ * with and without a sender to coalesce on.
+ */
+static void dream_bench_coalesce_run(const char *what, void *sender)
+{
+    struct dreamer_attr dreamer;
+    struct dreamer_request *req;
+    unsigned long long start, ns;
+    unsigned long *merged = &dream_mailbox_stats.merged[__builtin_ctz(DREAMER_FAKE_SHAPE)];
+    unsigned long merges = __atomic_load_n(merged, __ATOMIC_RELAXED);
+    int queued = 0;
+    register int i;
+    LIST_DECLARE(cmds);
+    memset(&dreamer, 0, sizeof(dreamer));
+    dreamer.name = "bench";
+    dreamer.level = 1;
+    dream_mailbox_init(&dreamer.mailbox);
+    assert(pthread_mutex_init(&dreamer.mutex, NULL) == 0);
+    assert(arch_cond_init(&dreamer.cond) == 0);
+    start = arch_time_ns();
+    for(i = 0; i < DREAM_BENCH_LOOPS; ++i)
+        dream_enqueue_cmd(&dreamer, DREAMER_FAKE_SHAPE, sender, 1);
+    ns = arch_time_ns() - start;
+    merges = __atomic_load_n(merged, __ATOMIC_RELAXED) - merges;
+    dream_drain_cmds(&dreamer, &cmds);
+    while( (req = dream_cmd_next(&dreamer, &cmds)) )
+    {
+        ++queued;
+        dream_request_free(req);
+    }
+    dream_bench_report(what, ns, DREAM_BENCH_LOOPS);
+    output("    [%d] requests queued, [%lu] enqueues merged\n", queued, merges);
+    pthread_cond_destroy(&dreamer.cond);
+    pthread_mutex_destroy(&dreamer.mutex);
+}
+
+static void dream_bench_coalesce(void)
+{
+    dream_bench_coalesce_run("FAKE_SHAPE enqueue, no sender", NULL);
+    dream_bench_coalesce_run("FAKE_SHAPE enqueue, coalesced by sender", (void*)"Eames");
+    dream_mailbox_stats_print();
+}
+
+/*
+ * Cost of routing a request to its handler: the dispatch table lookup against the
+ * if/else chains it replaced. Both call the same handlers on the same command mix.
+ * The handlers are installed for Yusuf in limbo, a slot no dreamer uses.
+ */
+static int dream_bench_dispatch_hits[DREAMER_CMDS];
+
+static int dream_bench_dispatch_handler(struct dreamer_attr *dattr, struct dreamer_request *req,
+                                        struct dream_context *ctx)
+{
+    ++dream_bench_dispatch_hits[__builtin_ctz(req->cmd)];
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static int dream_bench_dispatch_chain(struct dreamer_attr *dattr, struct dreamer_request *req,
+                                      struct dream_context *ctx)
+{
+    if(req->cmd == DREAMER_FIGHT)
+        return dream_bench_dispatch_handler(dattr, req, ctx);
+    else if(req->cmd == DREAMER_SHOT)
+        return dream_bench_dispatch_handler(dattr, req, ctx);
+    else if(req->cmd == DREAMER_RECOVER)
+        return dream_bench_dispatch_handler(dattr, req, ctx);
+    else if(req->cmd == DREAMER_KICK_BACK)
+        return dream_bench_dispatch_handler(dattr, req, ctx);
+    return DREAM_DISPATCH_CONTINUE;
+}
+
+static void dream_bench_dispatch(void)
+{
+    static const struct dream_dispatch_entry entries[] = {
+        { DREAM_SEDATIVE_CREATOR, DREAM_LIMBO, DREAMER_FIGHT, dream_bench_dispatch_handler },
+        { DREAM_SEDATIVE_CREATOR, DREAM_LIMBO, DREAMER_SHOT, dream_bench_dispatch_handler },
+        { DREAM_SEDATIVE_CREATOR, DREAM_LIMBO, DREAMER_RECOVER, dream_bench_dispatch_handler },
+        { DREAM_SEDATIVE_CREATOR, DREAM_LIMBO, DREAMER_KICK_BACK, dream_bench_dispatch_handler },
+    };
+    static const int cmds[] = { DREAMER_FIGHT, DREAMER_SHOT, DREAMER_RECOVER, DREAMER_KICK_BACK,
+                                DREAMER_FAKE_SHAPE };
+    int ncmds = sizeof(cmds)/sizeof(cmds[0]);
+    struct dreamer_attr dreamer;
+    struct dream_context ctx = {0};
+    struct dreamer_request reqs[sizeof(cmds)/sizeof(cmds[0])];
+    const struct dream_dispatch_entry **handlers;
+    unsigned long long start;
+    register int i;
+    memset(&dreamer, 0, sizeof(dreamer));
+    memset(reqs, 0, sizeof(reqs));
+    dreamer.name = "bench";
+    dreamer.role = DREAM_SEDATIVE_CREATOR;
+    dreamer.level = dream_depth;
+    handlers = dream_dispatch_handlers(&dreamer);
+    for(i = 0; i < sizeof(entries)/sizeof(entries[0]); ++i)
+    {
+        assert(handlers[__builtin_ctz(entries[i].cmd)] == NULL);
+        handlers[__builtin_ctz(entries[i].cmd)] = &entries[i];
+    }
+    for(i = 0; i < ncmds; ++i)
+        reqs[i].cmd = cmds[i];
+    start = arch_time_ns();
+    for(i = 0; i < DREAM_BENCH_LOOPS; ++i)
+    {
+        struct dreamer_request * volatile req = &reqs[i % ncmds];
+        dream_bench_dispatch_chain(&dreamer, req, &ctx);
+    }
+    dream_bench_report("if/else chain", arch_time_ns() - start, DREAM_BENCH_LOOPS);
+    start = arch_time_ns();
+    for(i = 0; i < DREAM_BENCH_LOOPS; ++i)
+    {
+        struct dreamer_request * volatile req = &reqs[i % ncmds];
+        dream_dispatch(handlers, &dreamer, req, &ctx);
+    }
+    dream_bench_report("dispatch table", arch_time_ns() - start, DREAM_BENCH_LOOPS);
+    for(i = 0; i < sizeof(entries)/sizeof(entries[0]); ++i)
+        handlers[__builtin_ctz(entries[i].cmd)] = NULL;
+}
+
+/*
+ * Join to discovery latency of a dreamer waiting for another to join a level.
+ * Measured with the join notification and with the 100 ms rescans it replaced.
+ */
+#define DREAM_BENCH_JOIN_ROUNDS (20)
+#define DREAM_BENCH_JOIN_POLL (100000) /* us between rescans of the polling lookup */
+
+struct dream_bench_join
+{
+    struct dreamer_attr dreamer;
+    struct dreamer_attr waiter;
+    int poll;
+    int waiting;
+    unsigned long long found;
+};
+
+static void *dream_bench_join_waiter(void *arg)
+{
+    struct dream_bench_join *bench = arg;
+    int level = bench->dreamer.level;
+    pthread_mutex_lock(&dreamer_mutex[level-1]);
+    __atomic_store_n(&bench->waiting, 1, __ATOMIC_RELEASE);
+    if(bench->poll)
+    {
+        while(!dreamer_lookup(level, bench->dreamer.role))
+        {
+            pthread_mutex_unlock(&dreamer_mutex[level-1]);
+            usleep(DREAM_BENCH_JOIN_POLL);
+            pthread_mutex_lock(&dreamer_mutex[level-1]);
+        }
+    }
+    else
+        dreamer_find_sync_locked(&bench->waiter, level, bench->dreamer.role);
+    bench->found = arch_time_ns();
+    pthread_mutex_unlock(&dreamer_mutex[level-1]);
+    return NULL;
+}
+
+static void dream_bench_join_run(const char *what, struct dream_bench_join *bench)
+{
+    struct dreamer_attr *dattr = &bench->dreamer;
+    unsigned long long total = 0, worst = 0;
+    register int round;
+    for(round = 0; round < DREAM_BENCH_JOIN_ROUNDS; ++round)
+    {
+        unsigned long long start, latency;
+        pthread_t waiter;
+        dreamer_table[dattr->level-1][dattr->id] = NULL;
+        bench->waiting = 0;
+        assert(pthread_create(&waiter, NULL, dream_bench_join_waiter, bench) == 0);
+        while(!__atomic_load_n(&bench->waiting, __ATOMIC_ACQUIRE))
+            sched_yield();
+        /*
+         * Join at a random point of the polling period
+         */
+        usleep(rand() % DREAM_BENCH_JOIN_POLL);
+        pthread_mutex_lock(&dreamer_mutex[dattr->level-1]);
+        start = arch_time_ns();
+        dreamer_table_add(dattr);
+        pthread_mutex_unlock(&dreamer_mutex[dattr->level-1]);
+        pthread_join(waiter, NULL);
+        latency = bench->found - start;
+        total += latency;
+        if(latency > worst)
+            worst = latency;
+    }
+    output("%-48s: %10.1f us avg, %10.1f us max\n", what,
+           (double)total/DREAM_BENCH_JOIN_ROUNDS/1000, (double)worst/1000);
+}
+
+static void dream_bench_join(void)
+{
+    struct dream_bench_join bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.waiter.name = "waiter";
+    bench.dreamer.name = "bench";
+    bench.dreamer.role = DREAM_OVERLOOKER;
+    bench.dreamer.level = 1;
+    bench.dreamer.id = dream_id_intern(bench.dreamer.name, bench.dreamer.role);
+    bench.poll = 1;
+    dream_bench_join_run("join discovery, 100 ms rescans", &bench);
+    bench.poll = 0;
+    dream_bench_join_run("join discovery, join notification", &bench);
+}
+
+/*
+ * Latency from the last arrival at a level barrier to all the waiters running.
+ * Measured with the futex barrier and with the 10 ms polling of the arrivals it replaced.
+ */
+#define DREAM_BENCH_BARRIER_ROUNDS (20)
+#define DREAM_BENCH_BARRIER_POLL (10000) /* us between polls of the arrivals */
+
+struct dream_bench_barrier
+{
+    struct dream_barrier barrier;
+    int poll;
+    unsigned long long running; /* latest wake up of a waiter */
+};
+
+static void *dream_bench_barrier_waiter(void *arg)
+{
+    struct dream_bench_barrier *bench = arg;
+    unsigned long long now, latest;
+    if(bench->poll)
+    {
+        __atomic_add_fetch(&bench->barrier.arrived, 1, __ATOMIC_ACQ_REL);
+        while(__atomic_load_n(&bench->barrier.arrived, __ATOMIC_ACQUIRE) != bench->barrier.expected)
+            usleep(DREAM_BENCH_BARRIER_POLL);
+    }
+    else
+        dream_barrier_wait(&bench->barrier);
+    now = arch_time_ns();
+    latest = __atomic_load_n(&bench->running, __ATOMIC_RELAXED);
+    while(now > latest
+          &&
+          !__atomic_compare_exchange_n(&bench->running, &latest, now, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return NULL;
+}
+
+static void dream_bench_barrier_run(const char *what, struct dream_bench_barrier *bench)
+{
+    pthread_t waiters[DREAMERS-1];
+    unsigned long long total = 0, worst = 0;
+    register int round, i;
+    for(round = 0; round < DREAM_BENCH_BARRIER_ROUNDS; ++round)
+    {
+        unsigned long long start, latency;
+        bench->barrier.arrived = 0;
+        bench->running = 0;
+        for(i = 0; i < DREAMERS-1; ++i)
+            assert(pthread_create(&waiters[i], NULL, dream_bench_barrier_waiter, bench) == 0);
+        while(__atomic_load_n(&bench->barrier.arrived, __ATOMIC_ACQUIRE) != DREAMERS-1)
+            usleep(1000);
+        /*
+         * Arrive last at a random point of the polling period
+         */
+        usleep(rand() % DREAM_BENCH_BARRIER_POLL);
+        start = arch_time_ns();
+        if(bench->poll)
+            __atomic_add_fetch(&bench->barrier.arrived, 1, __ATOMIC_ACQ_REL);
+        else
+            assert(dream_barrier_arrive(&bench->barrier));
+        for(i = 0; i < DREAMERS-1; ++i)
+            pthread_join(waiters[i], NULL);
+        latency = bench->running - start;
+        total += latency;
+        if(latency > worst)
+            worst = latency;
+    }
+    output("%-48s: %10.1f us avg, %10.1f us max\n", what,
+           (double)total/DREAM_BENCH_BARRIER_ROUNDS/1000, (double)worst/1000);
+}
+
+static void dream_bench_barrier(void)
+{
+    struct dream_bench_barrier bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.barrier.expected = DREAMERS;
+    bench.poll = 1;
+    dream_bench_barrier_run("level barrier, 10 ms polling", &bench);
+    bench.poll = 0;
+    dream_bench_barrier_run("level barrier, futex wake", &bench);
+}
+
+/*
+ * Drift of a periodic request loop doing some work every period.
+ * Measured with the wait restarted from the wake up as before and with the deadline kept across periods.
+ */
+#define DREAM_BENCH_PERIODIC_PERIODS (200)
+#define DREAM_BENCH_PERIODIC_PERIOD (5000000ULL) /* ns */
+#define DREAM_BENCH_PERIODIC_WORK (500000) /* ns of work at most every period */
+
+static void dream_bench_periodic_run(const char *what, int keep)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond;
+    struct timespec ts = {0};
+    unsigned long long start, deadline, elapsed;
+    register int i;
+    assert(arch_cond_init(&cond) == 0);
+    start = deadline = arch_time_ns();
+    pthread_mutex_lock(&mutex);
+    for(i = 0; i < DREAM_BENCH_PERIODIC_PERIODS; ++i)
+    {
+        dream_bench_spin(rand() % DREAM_BENCH_PERIODIC_WORK);
+        if(keep)
+            deadline += DREAM_BENCH_PERIODIC_PERIOD;
+        else
+            deadline = arch_time_ns() + DREAM_BENCH_PERIODIC_PERIOD;
+        arch_deadline(deadline, &ts);
+        while(pthread_cond_timedwait(&cond, &mutex, &ts) != ETIMEDOUT);
+    }
+    pthread_mutex_unlock(&mutex);
+    elapsed = arch_time_ns() - start;
+    pthread_cond_destroy(&cond);
+    output("%-48s: %10.1f us per period, %10.1f ms drift over [%d] periods\n", what,
+           (double)elapsed/DREAM_BENCH_PERIODIC_PERIODS/1000,
+           ((double)elapsed - DREAM_BENCH_PERIODIC_PERIODS * DREAM_BENCH_PERIODIC_PERIOD)/1000000,
+           DREAM_BENCH_PERIODIC_PERIODS);
+}
+
+static void dream_bench_periodic(void)
+{
+    dream_bench_periodic_run("5 ms period, wait restarted on wake up", 0);
+    dream_bench_periodic_run("5 ms period, absolute deadline kept", 1);
+}
+
+/*
+ * Registry lookups, kicks, clones and state scans of a level against the cast size.
+ * The cast is registered at level 1 without threads, projections on top of the 7 roles.
+ * Memory is the registry and the dreamers without their threads.
+ */
+#define DREAM_BENCH_SCALE_WORK (1 << 18) /* dreamers visited per measurement */
+
+static void dream_bench_scale_drain(struct dreamer_attr **dattrs, int dreamers)
+{
+    register int i;
+    for(i = 0; i < dreamers; ++i)
+    {
+        LIST_DECLARE(cmds);
+        dream_drain_cmds(dattrs[i], &cmds);
+        dream_cmds_release(&cmds);
+    }
+}
+
+static void dream_bench_scale(void)
+{
+    static const int casts[] = { DREAMERS, 64, 512, 4096, 32768 };
+    register int c;
+    output("%8s %12s %16s %16s %16s %12s %12s\n", "dreamers", "lookup ns", "kick all ns/dr",
+           "clone ns/dr", "state scan ns/dr", "registry KB", "dreamers KB");
+    for(c = 0; c < sizeof(casts)/sizeof(casts[0]); ++c)
+    {
+        int dreamers = casts[c], rounds = DREAM_BENCH_SCALE_WORK / casts[c];
+        struct dreamer_attr **dattrs = calloc(dreamers, sizeof(*dattrs));
+        unsigned long long start, lookup, kick = 0, clone = 0, scan;
+        register int i;
+        assert(dattrs != NULL);
+        dream_registry_init(dreamers);
+        pthread_mutex_lock(&dreamer_mutex[0]);
+        for(i = 0; i < dreamers; ++i)
+        {
+            dattrs[i] = dream_attr_alloc(i < DREAMERS ? "cast" : "projection",
+                                         i < DREAMERS ? 1 << i : DREAM_PROJECTION);
+            dreamer_table_add(dattrs[i]);
+        }
+        pthread_mutex_unlock(&dreamer_mutex[0]);
+        start = arch_time_ns();
+        for(i = 0; i < DREAM_BENCH_LOOPS; ++i)
+            assert(dreamer_lookup(1, 1 << (i % DREAMERS)) != NULL);
+        lookup = arch_time_ns() - start;
+        for(i = 0; i < rounds; ++i)
+        {
+            start = arch_time_ns();
+            wake_up_dreamers(1);
+            kick += arch_time_ns() - start;
+            dream_bench_scale_drain(dattrs, dreamers);
+            start = arch_time_ns();
+            dream_clone_cmd(DREAMER_FIGHT, NULL, NULL, 1);
+            clone += arch_time_ns() - start;
+            dream_bench_scale_drain(dattrs, dreamers);
+        }
+        start = arch_time_ns();
+        for(i = 0; i < rounds; ++i)
+            assert(!dream_state_all(1, DREAMER_KICK_BACK, 0));
+        scan = arch_time_ns() - start;
+        output("%8d %12.1f %16.1f %16.1f %16.2f %12.1f %12.1f\n", dreamers,
+               (double)lookup/DREAM_BENCH_LOOPS,
+               (double)kick/rounds/dreamers, (double)clone/rounds/dreamers, (double)scan/rounds/dreamers,
+               (double)dreamers * (sizeof(*dream_ids) + dream_state_words * sizeof(*dream_states) + dream_depth * sizeof(**dreamer_table))/1024,
+               (double)dreamers * sizeof(struct dreamer_attr)/1024);
+        for(i = 0; i < dreamers; ++i)
+        {
+            pthread_cond_destroy(&dattrs[i]->cond);
+            free(dattrs[i]);
+        }
+        free(dattrs);
+    }
+}
+
+/*
+ * Periodic commands to many dreamers over a second. Every dreamer owning a thread with a timed wait
+ * against the timer wheel publishing to the mailboxes of dreamers without threads.
+ * CPU time of the process and worst lateness from the due time to the wakeup or publish.
+ */
+#define DREAM_BENCH_WHEEL_PERIOD (10000000ULL) /* ns */
+#define DREAM_BENCH_WHEEL_RUN (1000000000ULL) /* ns */
+#define DREAM_BENCH_WHEEL_STACK (64 << 10)
+
+struct dream_bench_wheel_waiter
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned long long start;
+    unsigned long long lateness;
+};
+
+static unsigned long long dream_bench_cpu_ns(void)
+{
+    struct timespec ts = {0};
+    assert(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == 0);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *dream_bench_wheel_waiter(void *arg)
+{
+    struct dream_bench_wheel_waiter *waiter = arg;
+    struct timespec ts = {0};
+    unsigned long long deadline = waiter->start + DREAM_BENCH_WHEEL_PERIOD;
+    pthread_mutex_lock(&waiter->mutex);
+    while(deadline <= waiter->start + DREAM_BENCH_WHEEL_RUN)
+    {
+        unsigned long long lateness;
+        arch_deadline(deadline, &ts);
+        if(pthread_cond_timedwait(&waiter->cond, &waiter->mutex, &ts) != ETIMEDOUT)
+            continue;
+        lateness = arch_time_ns() - deadline;
+        if(lateness > waiter->lateness)
+            waiter->lateness = lateness;
+        deadline += DREAM_BENCH_WHEEL_PERIOD;
+    }
+    pthread_mutex_unlock(&waiter->mutex);
+    return NULL;
+}
+
+static void dream_bench_wheel_threads(int dreamers)
+{
+    struct dream_bench_wheel_waiter *waiters = calloc(dreamers, sizeof(*waiters));
+    pthread_t *threads = calloc(dreamers, sizeof(*threads));
+    unsigned long long start, cpu, lateness = 0;
+    pthread_attr_t attr;
+    register int i;
+    assert(waiters != NULL && threads != NULL);
+    assert(pthread_attr_init(&attr) == 0);
+    assert(pthread_attr_setstacksize(&attr, DREAM_BENCH_WHEEL_STACK) == 0);
+    cpu = dream_bench_cpu_ns();
+    start = arch_time_ns();
+    for(i = 0; i < dreamers; ++i)
+    {
+        assert(pthread_mutex_init(&waiters[i].mutex, NULL) == 0);
+        assert(arch_cond_init(&waiters[i].cond) == 0);
+        waiters[i].start = start;
+        assert(pthread_create(&threads[i], &attr, dream_bench_wheel_waiter, &waiters[i]) == 0);
+    }
+    for(i = 0; i < dreamers; ++i)
+    {
+        pthread_join(threads[i], NULL);
+        if(waiters[i].lateness > lateness)
+            lateness = waiters[i].lateness;
+        pthread_cond_destroy(&waiters[i].cond);
+    }
+    cpu = dream_bench_cpu_ns() - cpu;
+    output("%8d %-16s %12.1f %16.1f\n", dreamers, "timed waits", (double)cpu/1000000, (double)lateness/1000);
+    pthread_attr_destroy(&attr);
+    free(threads);
+    free(waiters);
+}
+
+static void dream_bench_wheel_timers(int dreamers)
+{
+    struct dreamer_attr **dattrs = calloc(dreamers, sizeof(*dattrs));
+    struct dream_timer **timers = calloc(dreamers, sizeof(*timers));
+    unsigned long long cpu;
+    register int i;
+    assert(dattrs != NULL && timers != NULL);
+    dream_registry_init(dreamers);
+    pthread_mutex_lock(&dreamer_mutex[0]);
+    for(i = 0; i < dreamers; ++i)
+    {
+        dattrs[i] = dream_attr_alloc(i < DREAMERS ? "cast" : "projection",
+                                     i < DREAMERS ? 1 << i : DREAM_PROJECTION);
+        dreamer_table_add(dattrs[i]);
+    }
+    pthread_mutex_unlock(&dreamer_mutex[0]);
+    pthread_mutex_lock(&dream_wheel.mutex);
+    dream_wheel.worst_lateness = 0;
+    pthread_mutex_unlock(&dream_wheel.mutex);
+    cpu = dream_bench_cpu_ns();
+    for(i = 0; i < dreamers; ++i)
+        timers[i] = dream_enqueue_cmd_every(dattrs[i], DREAMER_FIGHT, dattrs[i], 1, DREAM_BENCH_WHEEL_PERIOD);
+    usleep(DREAM_BENCH_WHEEL_RUN/1000);
+    for(i = 0; i < dreamers; ++i)
+        dream_timer_cancel(timers[i]);
+    cpu = dream_bench_cpu_ns() - cpu;
+    output("%8d %-16s %12.1f %16.1f\n", dreamers, "timer wheel", (double)cpu/1000000,
+           (double)dream_wheel.worst_lateness/1000);
+    dream_bench_scale_drain(dattrs, dreamers);
+    for(i = 0; i < dreamers; ++i)
+    {
+        pthread_cond_destroy(&dattrs[i]->cond);
+        free(dattrs[i]);
+    }
+    free(timers);
+    free(dattrs);
+}
+
+static void dream_bench_wheel(void)
+{
+    static const int casts[] = { 64, 512, 2048 };
+    register int c;
+    dream_wheel_start();
+    output("Every dreamer gets a command every [%llu] ms for [%llu] ms\n",
+           DREAM_BENCH_WHEEL_PERIOD/1000000, DREAM_BENCH_WHEEL_RUN/1000000);
+    output("%8s %-16s %12s %16s\n", "dreamers", "", "cpu ms", "worst late us");
+    for(c = 0; c < sizeof(casts)/sizeof(casts[0]); ++c)
+    {
+        dream_bench_wheel_threads(casts[c]);
+        dream_bench_wheel_timers(casts[c]);
+    }
+}
+
+/*
+ * Projections reacting to their mailbox with a thread each against tasks on the executor.
+ * Every round sends a defense command to all of them and the kick back sends them out of the level.
+ * Time is from the first command to the last projection out, threads are the ones holding the projections
+ * and context switches are the voluntary and involuntary ones of the process.
+ */
+#define DREAM_BENCH_EXECUTOR_ROUNDS (20)
+#define DREAM_BENCH_EXECUTOR_STACK (64 << 10)
+
+static int dream_bench_executor_exited;
+
+static void *dream_bench_executor_dreamer(void *arg)
+{
+    struct dream_context ctx = {0};
+    dream_dispatch_loop(arg, &ctx, NULL);
+    __atomic_add_fetch(&dream_bench_executor_exited, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static long dream_bench_csw(void)
+{
+    struct rusage usage;
+    assert(getrusage(RUSAGE_SELF, &usage) == 0);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+static void dream_bench_executor_run(int dreamers, int tasks)
+{
+    struct dreamer_attr **dattrs = calloc(dreamers, sizeof(*dattrs));
+    pthread_t *threads = calloc(dreamers, sizeof(*threads));
+    int *exited = tasks ? &dream_executor.exited : &dream_bench_executor_exited;
+    int out = __atomic_load_n(exited, __ATOMIC_ACQUIRE) + dreamers;
+    unsigned long long start;
+    long csw;
+    pthread_attr_t attr;
+    register int i, round;
+    assert(dattrs != NULL && threads != NULL);
+    assert(pthread_attr_init(&attr) == 0);
+    assert(pthread_attr_setstacksize(&attr, DREAM_BENCH_EXECUTOR_STACK) == 0);
+    dream_registry_init(dreamers);
+    pthread_mutex_lock(&dreamer_mutex[0]);
+    for(i = 0; i < dreamers; ++i)
+    {
+        dattrs[i] = dream_attr_alloc("projection", DREAM_PROJECTION);
+        if(tasks)
+            dream_dreamer_task_create(dattrs[i]);
+        dreamer_table_add(dattrs[i]);
+    }
+    pthread_mutex_unlock(&dreamer_mutex[0]);
+    for(i = 0; !tasks && i < dreamers; ++i)
+        assert(pthread_create(&threads[i], &attr, dream_bench_executor_dreamer, dattrs[i]) == 0);
+    /*
+     * Start with every dreamer waiting on its mailbox
+     */
+    while(!arch_threads_blocked())
+        usleep(1000);
+    csw = dream_bench_csw();
+    start = arch_time_ns();
+    for(round = 0; round < DREAM_BENCH_EXECUTOR_ROUNDS; ++round)
+    {
+        for(i = 0; i < dreamers; ++i)
+            dream_enqueue_cmd(dattrs[i], DREAMER_DEFENSE_PROJECTIONS, NULL, 1);
+    }
+    for(i = 0; i < dreamers; ++i)
+        dream_enqueue_cmd(dattrs[i], DREAMER_KICK_BACK, NULL, 1);
+    while(__atomic_load_n(exited, __ATOMIC_ACQUIRE) != out)
+        usleep(100);
+    output("%8d %-10s %10d %12.1f %14.1f %12.1f\n", dreamers, tasks ? "tasks" : "threads",
+           tasks ? dream_executor.nworkers : dreamers, (double)(arch_time_ns() - start)/1000000,
+           (double)(arch_time_ns() - start)/dreamers/(DREAM_BENCH_EXECUTOR_ROUNDS + 1),
+           (double)(dream_bench_csw() - csw));
+    for(i = 0; i < dreamers; ++i)
+    {
+        if(!tasks)
+            pthread_join(threads[i], NULL);
+        else
+            free(LIST_ENTRY(dattrs[i]->task, struct dream_dreamer_task, task));
+        pthread_cond_destroy(&dattrs[i]->cond);
+        free(dattrs[i]);
+    }
+    pthread_attr_destroy(&attr);
+    free(threads);
+    free(dattrs);
+}
+
+static void dream_bench_executor(void)
+{
+    static const int casts[] = { 64, 512, 4096 };
+    register int c;
+    dream_executor_start(dream_workers, casts[sizeof(casts)/sizeof(casts[0]) - 1]);
+    output("[%d] rounds of commands, [%d] workers, [%ld] cpus online\n", DREAM_BENCH_EXECUTOR_ROUNDS,
+           dream_workers, sysconf(_SC_NPROCESSORS_ONLN));
+    output("%8s %-10s %10s %12s %14s %12s\n", "dreamers", "", "threads", "ms", "ns/command", "ctx switches");
+    for(c = 0; c < sizeof(casts)/sizeof(casts[0]); ++c)
+    {
+        dream_bench_executor_run(casts[c], 0);
+        dream_bench_executor_run(casts[c], 1);
+    }
+}
+
+/*
+ * Two dreamers handing a turn back and forth over a condition, as threads and as coroutines
+ * on one carrier. The same code blocks the thread or parks the coroutine.
+ */
+#define DREAM_BENCH_FIBER_ROUNDS (100000)
+
+static struct dream_bench_fiber
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_cond_t finished;
+    int turn;
+    int done;
+} dream_bench_fiber_state = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static void *dream_bench_fiber_player(void *arg)
+{
+    struct dream_bench_fiber *bench = &dream_bench_fiber_state;
+    int me = (long)arg;
+    register int round;
+    pthread_mutex_lock(&bench->mutex);
+    for(round = 0; round < DREAM_BENCH_FIBER_ROUNDS; ++round)
+    {
+        while(bench->turn != me)
+            dream_cond_wait(&bench->cond, &bench->mutex);
+        bench->turn = !me;
+        dream_cond_signal(&bench->cond);
+    }
+    ++bench->done;
+    dream_cond_signal(&bench->finished);
+    pthread_mutex_unlock(&bench->mutex);
+    return NULL;
+}
+
+static void dream_bench_fiber_run(const char *what, int fibers)
+{
+    struct dream_bench_fiber *bench = &dream_bench_fiber_state;
+    pthread_t players[2];
+    unsigned long long start, cpu;
+    long csw;
+    register long i;
+    bench->turn = 0;
+    bench->done = 0;
+    csw = dream_bench_csw();
+    cpu = dream_bench_cpu_ns();
+    start = arch_time_ns();
+    for(i = 0; i < 2; ++i)
+    {
+        if(fibers)
+            dream_fiber_create(dream_bench_fiber_player, (void*)i);
+        else
+            assert(pthread_create(&players[i], NULL, dream_bench_fiber_player, (void*)i) == 0);
+    }
+    pthread_mutex_lock(&bench->mutex);
+    while(bench->done != 2)
+        pthread_cond_wait(&bench->finished, &bench->mutex);
+    pthread_mutex_unlock(&bench->mutex);
+    for(i = 0; !fibers && i < 2; ++i)
+        pthread_join(players[i], NULL);
+    output("%-12s %14.1f %14.1f %14ld\n", what,
+           (double)(arch_time_ns() - start)/DREAM_BENCH_FIBER_ROUNDS/2,
+           (double)(dream_bench_cpu_ns() - cpu)/DREAM_BENCH_FIBER_ROUNDS/2,
+           dream_bench_csw() - csw);
+}
+
+static void dream_bench_fiber(void)
+{
+    assert(arch_cond_init(&dream_bench_fiber_state.cond) == 0);
+    assert(arch_cond_init(&dream_bench_fiber_state.finished) == 0);
+    dream_fibers_start(1);
+    output("[%d] hand offs each way\n", DREAM_BENCH_FIBER_ROUNDS);
+    output("%-12s %14s %14s %14s\n", "", "ns/switch", "cpu ns/switch", "ctx switches");
+    dream_bench_fiber_run("threads", 0);
+    dream_bench_fiber_run("coroutines", 1);
+}
+
+/*
+ * Level transitions on a new thread with the default stack of the system, as before the cache,
+ * against the thread cache with the stacks of -k and -g. The latency is from the hand off
+ * to the level running, one transition at a time. The footprint is the growth of the process
+ * with many levels running at once, each waiting to be released.
+ */
+#define DREAM_BENCH_THREADS_TRANSITIONS (1000)
+#define DREAM_BENCH_THREADS_LEVELS (1024)
+
+static struct dream_bench_threads
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned long long started; /* time the last level started running */
+    int running;
+    int released;
+} dream_bench_threads_state = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static void *dream_bench_threads_level(void *arg)
+{
+    struct dream_bench_threads *bench = &dream_bench_threads_state;
+    unsigned long long started = arch_time_ns();
+    pthread_mutex_lock(&bench->mutex);
+    bench->started = started;
+    ++bench->running;
+    pthread_cond_broadcast(&bench->cond);
+    while(arg && !bench->released)
+        pthread_cond_wait(&bench->cond, &bench->mutex);
+    --bench->running;
+    pthread_cond_broadcast(&bench->cond);
+    pthread_mutex_unlock(&bench->mutex);
+    return NULL;
+}
+
+/*
+ * Mode 0 is a new thread with the default attributes, 1 a new thread with the attributes of the dreamers
+ * and 2 the cache.
+ */
+static void dream_bench_threads_create(int mode, void *arg)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    if(mode == 2)
+    {
+        dream_thread_run(dream_bench_threads_level, arg);
+        return;
+    }
+    if(mode)
+        dream_thread_attr_init(&attr);
+    else
+    {
+        assert(pthread_attr_init(&attr) == 0);
+        assert(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0);
+    }
+    assert(pthread_create(&thread, &attr, dream_bench_threads_level, arg) == 0);
+    pthread_attr_destroy(&attr);
+}
+
+static void dream_bench_threads_run(const char *what, int mode)
+{
+    struct dream_bench_threads *bench = &dream_bench_threads_state;
+    unsigned long long latency = 0;
+    unsigned long vsz, rss, vsz_levels, rss_levels;
+    register int i;
+    for(i = 0; i < DREAM_BENCH_THREADS_TRANSITIONS; ++i)
+    {
+        unsigned long long start = arch_time_ns();
+        dream_bench_threads_create(mode, NULL);
+        pthread_mutex_lock(&bench->mutex);
+        while(bench->started < start || bench->running)
+            pthread_cond_wait(&bench->cond, &bench->mutex);
+        latency += bench->started - start;
+        pthread_mutex_unlock(&bench->mutex);
+    }
+    arch_memory_usage(&vsz, &rss);
+    bench->released = 0;
+    for(i = 0; i < DREAM_BENCH_THREADS_LEVELS; ++i)
+        dream_bench_threads_create(mode, bench);
+    pthread_mutex_lock(&bench->mutex);
+    while(bench->running != DREAM_BENCH_THREADS_LEVELS)
+        pthread_cond_wait(&bench->cond, &bench->mutex);
+    arch_memory_usage(&vsz_levels, &rss_levels);
+    bench->released = 1;
+    pthread_cond_broadcast(&bench->cond);
+    while(bench->running)
+        pthread_cond_wait(&bench->cond, &bench->mutex);
+    pthread_mutex_unlock(&bench->mutex);
+    output("%-22s %14.1f %14.1f %14.1f\n", what, (double)latency/DREAM_BENCH_THREADS_TRANSITIONS/1000,
+           (double)(vsz_levels - vsz)/1024, (double)(rss_levels - rss)/1024);
+}
+
+static void dream_bench_threads(void)
+{
+    char what[32];
+    assert(arch_cond_init(&dream_bench_threads_state.cond) == 0);
+    output("[%d] transitions one at a time, [%d] levels at once, stack [%zu KB], guard [%zu KB]\n",
+           DREAM_BENCH_THREADS_TRANSITIONS, DREAM_BENCH_THREADS_LEVELS,
+           dream_stack_size >> 10, dream_guard_size >> 10);
+    output("%-22s %14s %14s %14s\n", "", "transition us", "VSZ MB", "RSS MB");
+    dream_bench_threads_run("thread per level", 0);
+    dream_bench_threads_run("thread, small stack", 1);
+    snprintf(what, sizeof(what), "cache of [%d]", dream_thread_cache);
+    dream_threads_start(dream_thread_cache);
+    dream_bench_threads_run(what, 2);
+}
+
+/*
+ * Message latency between the levels of a dreamer under each placement policy.
+ * The dreamer at level 1 and its clone at level 2 ping-pong a command through their mailboxes,
+ * each in a thread placed as the policy places the dreamer at that level.
+ * The latency is half the round trip.
+ */
+#define DREAM_BENCH_PLACEMENT_ROUNDS (20000)
+
+struct dream_bench_placement
+{
+    struct dreamer_attr dreamer;
+    struct dreamer_attr *peer;
+    unsigned long long elapsed;
+    int cpu;
+};
+
+static void dream_bench_placement_recv(struct dreamer_attr *dattr)
+{
+    struct dreamer_request *req;
+    while(!(req = dream_dequeue_cmd(dattr)))
+        dream_wait_cmd(dattr, NULL);
+    dream_request_free(req);
+}
+
+/*
+ * Level 1 serves first.
+ */
+static void *dream_bench_placement_level(void *arg)
+{
+    struct dream_bench_placement *level = arg;
+    struct dreamer_attr *dattr = &level->dreamer;
+    unsigned long long start;
+    register int round;
+    dream_place(dattr, dattr->level);
+    level->cpu = arch_thread_cpu();
+    start = arch_time_ns();
+    for(round = 0; round < DREAM_BENCH_PLACEMENT_ROUNDS; ++round)
+    {
+        if(dattr->level == 1)
+        {
+            dream_enqueue_cmd(level->peer, DREAMER_FIGHT, NULL, level->peer->level);
+            dream_bench_placement_recv(dattr);
+        }
+        else
+        {
+            dream_bench_placement_recv(dattr);
+            dream_enqueue_cmd(level->peer, DREAMER_FIGHT, NULL, level->peer->level);
+        }
+    }
+    level->elapsed = arch_time_ns() - start;
+    return NULL;
+}
+
+static void dream_bench_placement_run(int placement, int id)
+{
+    struct dream_bench_placement levels[2];
+    struct dream_cpus set;
+    pthread_t threads[2];
+    char cpus[64];
+    register int i;
+    memset(levels, 0, sizeof(levels));
+    for(i = 0; i < 2; ++i)
+    {
+        struct dreamer_attr *dattr = &levels[i].dreamer;
+        dattr->name = "bench";
+        dattr->id = id;
+        dattr->level = i + 1;
+        dream_mailbox_init(&dattr->mailbox);
+        assert(pthread_mutex_init(&dattr->mutex, NULL) == 0);
+        assert(arch_cond_init(&dattr->cond) == 0);
+        levels[i].peer = &levels[!i].dreamer;
+    }
+    dream_placement = placement;
+    for(i = 0; i < 2; ++i)
+        assert(pthread_create(&threads[i], NULL, dream_bench_placement_level, &levels[i]) == 0);
+    for(i = 0; i < 2; ++i)
+        pthread_join(threads[i], NULL);
+    snprintf(cpus, sizeof(cpus), "%d -> %d%s", levels[0].cpu, levels[1].cpu,
+             placement != DREAM_PLACE_NONE && !dream_placement_cpus(placement, id, 1, &set) ?
+             " (unplaced)" : "");
+    output("%-10s %-20s %14.1f\n", dream_placement_names[placement], cpus,
+           (double)levels[0].elapsed/DREAM_BENCH_PLACEMENT_ROUNDS/2);
+    for(i = 0; i < 2; ++i)
+    {
+        pthread_cond_destroy(&levels[i].dreamer.cond);
+        pthread_mutex_destroy(&levels[i].dreamer.mutex);
+    }
+}
+
+static void dream_bench_placement(void)
+{
+    int placement = dream_placement;
+    register int i;
+    output("[%d] round trips between levels 1 and 2 of a dreamer. cpus [%d], numa nodes [%d], isolated [%d]\n",
+           DREAM_BENCH_PLACEMENT_ROUNDS, dream_topology.online.ncpus, dream_topology.nnodes,
+           dream_topology.isolated.ncpus);
+    output("%-10s %-20s %14s\n", "policy", "cpus level 1 -> 2", "latency ns");
+    for(i = 0; i < DREAM_PLACEMENTS; ++i)
+        dream_bench_placement_run(i, 0);
+    dream_placement = placement;
+}
+
+/*
+ * Descent down to the depth of the dream and kick propagation back up against the depth.
+ * A projection descends from level 1 like the dreamers falling into limbo, in its thread
+ * as nested levels, with a thread per level and with a coroutine per level on its carrier
+ * like the dreamers of the nested mode (-n). The kick is sent to it at the deepest level
+ * and unwinds back to level 1, as returns in its thread or level by level over the mailboxes.
+ */
+#define DREAM_BENCH_DEPTH_ROUNDS (100)
+
+enum dream_bench_depth_mode
+{
+    DREAM_BENCH_DEPTH_NESTED,
+    DREAM_BENCH_DEPTH_THREADS,
+    DREAM_BENCH_DEPTH_COROUTINES,
+    DREAM_BENCH_DEPTH_MODES,
+};
+
+static const char *dream_bench_depth_modes[DREAM_BENCH_DEPTH_MODES] = {
+    [DREAM_BENCH_DEPTH_NESTED] = "nested",
+    [DREAM_BENCH_DEPTH_THREADS] = "threads",
+    [DREAM_BENCH_DEPTH_COROUTINES] = "coroutines",
+};
+
+static struct dream_bench_depth
+{
+    struct dreamer_attr *deepest;
+    unsigned long long descended; /* time the deepest level was reached */
+    unsigned long long kicked; /* time the kick got back to level 1 */
+    enum dream_bench_depth_mode mode;
+} dream_bench_depth_state;
+
+static void dream_bench_depth_dream(struct dreamer_attr *clone, struct dreamer_attr *origin)
+{
+    struct dream_context ctx = {0};
+    ctx.self = dreamer_get(clone->level-1, clone->id);
+    __atomic_store_n(&dream_bench_depth_state.descended, arch_time_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&dream_bench_depth_state.deepest, clone, __ATOMIC_RELEASE);
+    dream_dispatch_loop(clone, &ctx, NULL);
+    dream_enqueue_cmd(ctx.self, DREAMER_KICK_BACK, clone, ctx.self->level);
+}
+
+/*
+ * A level of the thread or coroutine per level descent. Passes the kick on to the level above.
+ */
+static void *dream_bench_depth_level(void *arg)
+{
+    struct dreamer_attr *dattr = arg;
+    struct dream_context ctx = {0};
+    dream_level_join(dattr);
+    ctx.self = dreamer_get(dattr->level-1, dattr->id);
+    if(dattr->level < dream_depth)
+        dream_level_create(dattr->level+1, dream_bench_depth_level, dattr);
+    else
+    {
+        __atomic_store_n(&dream_bench_depth_state.descended, arch_time_ns(), __ATOMIC_RELAXED);
+        __atomic_store_n(&dream_bench_depth_state.deepest, dattr, __ATOMIC_RELEASE);
+    }
+    dream_dispatch_loop(dattr, &ctx, NULL);
+    dreamer_table_del(dattr);
+    dream_enqueue_cmd(ctx.self, DREAMER_KICK_BACK, dattr, ctx.self->level);
+    return NULL;
+}
+
+static void *dream_bench_depth_dreamer(void *arg)
+{
+    struct dreamer_attr *dattr = arg;
+    struct dream_context ctx = {0};
+    if(dream_bench_depth_state.mode == DREAM_BENCH_DEPTH_NESTED)
+        dream_descend(dattr, dream_depth, dream_bench_depth_dream, dattr);
+    else
+        dream_level_create(dattr->level+1, dream_bench_depth_level, dattr);
+    dream_dispatch_loop(dattr, &ctx, NULL);
+    __atomic_store_n(&dream_bench_depth_state.kicked, arch_time_ns(), __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void dream_bench_depth_run(struct dreamer_attr *dattr)
+{
+    unsigned long long descent = 0, kick = 0;
+    register int round;
+    for(round = 0; round < DREAM_BENCH_DEPTH_ROUNDS; ++round)
+    {
+        unsigned long long start;
+        pthread_t dreamer;
+        dream_bench_depth_state.deepest = NULL;
+        dream_bench_depth_state.kicked = 0;
+        start = arch_time_ns();
+        if(dream_bench_depth_state.mode == DREAM_BENCH_DEPTH_COROUTINES)
+            dream_fiber_create(dream_bench_depth_dreamer, dattr);
+        else
+            assert(pthread_create(&dreamer, NULL, dream_bench_depth_dreamer, dattr) == 0);
+        while(!__atomic_load_n(&dream_bench_depth_state.deepest, __ATOMIC_ACQUIRE))
+            usleep(100);
+        descent += dream_bench_depth_state.descended - start;
+        start = arch_time_ns();
+        dream_enqueue_cmd(dream_bench_depth_state.deepest, DREAMER_KICK_BACK, NULL, dream_depth);
+        if(dream_bench_depth_state.mode == DREAM_BENCH_DEPTH_COROUTINES)
+        {
+            while(!__atomic_load_n(&dream_bench_depth_state.kicked, __ATOMIC_ACQUIRE))
+                usleep(100);
+        }
+        else
+            pthread_join(dreamer, NULL);
+        kick += dream_bench_depth_state.kicked - start;
+    }
+    output("%8d %-10s %14.1f %16.1f %14.1f %16.1f %14zu\n", dream_depth,
+           dream_bench_depth_modes[dream_bench_depth_state.mode],
+           (double)descent/DREAM_BENCH_DEPTH_ROUNDS/1000,
+           (double)descent/DREAM_BENCH_DEPTH_ROUNDS/(dream_depth-1),
+           (double)kick/DREAM_BENCH_DEPTH_ROUNDS/1000,
+           (double)kick/DREAM_BENCH_DEPTH_ROUNDS/(dream_depth-1),
+           sizeof(struct dreamer_attr));
+}
+
+static void dream_bench_depth(void)
+{
+    static const int depths[] = { DREAM_LEVELS, 8, 16, 32, DREAM_LEVELS_MAX };
+    register int d;
+    /*
+     * A single carrier for the coroutine descent. A dreamer run as a thread still gets a thread per level
+     */
+    dream_nested = 1;
+    dream_fibers_start(1);
+    output("%8s %-10s %14s %16s %14s %16s %14s\n", "depth", "levels", "descent us", "descent ns/lvl",
+           "kick us", "kick ns/lvl", "bytes/lvl");
+    for(d = 0; d < sizeof(depths)/sizeof(depths[0]); ++d)
+    {
+        struct dreamer_attr *dattr;
+        register int level;
+        dream_levels_init(depths[d]);
+        dream_dispatch_init();
+        dream_registry_init(1);
+        for(level = 2; level <= dream_depth; ++level)
+        {
+            dream_level_barriers[level-1].expected = 1;
+            dream_dispatch_table[DREAM_ROLE_INDEX(DREAM_PROJECTION)][level-1][__builtin_ctz(DREAMER_KICK_BACK)] =
+                &dream_descend_kick_back_entry;
+        }
+        dattr = dream_attr_alloc("bench", DREAM_PROJECTION);
+        dreamer_table_add(dattr);
+        dream_bench_depth_state.mode = DREAM_BENCH_DEPTH_NESTED;
+        dream_bench_depth_run(dattr);
+        dream_bench_depth_state.mode = DREAM_BENCH_DEPTH_THREADS;
+        dream_bench_depth_run(dattr);
+        dream_bench_depth_state.mode = DREAM_BENCH_DEPTH_COROUTINES;
+        dream_bench_depth_run(dattr);
+    }
+}
+
+/*
+ * Synthetic model of the levels for the parallel discrete event simulation (PDES) micro-benchmark.
+ * It runs no dreamer of the movie. Every level is a logical process with its own event heap.
+ * Its dreamers tick every level period of dream_delay_map, so time runs slower the deeper the level,
+ * and kick dreamers of the adjacent levels. A dreamer only acts on its ticks, so a kick lands at least a level period after it is sent:
+ * that period is the lookahead of the level. The levels are spread over the workers that run in windows.
+ * Events before the earliest time any level could kick another one (the next event of a level
+ * plus its lookahead, the minimum over the levels) are run concurrently. Kicks to other levels
+ * go through a lock-less inbox merged at the end of the window, between two rounds of the barrier.
+ * Events are ordered by time, then by sender, so the digest does not depend on the workers.
+ */
+struct dream_bench_pdes_event
+{
+    struct llist_node inbox;
+    unsigned long long time; /* virtual ns */
+    unsigned long long key; /* sender to order the events due at the same time */
+    int dreamer;
+    int kick;
+};
+
+struct dream_bench_pdes_level
+{
+    struct dream_bench_pdes_event *heap;
+    int events;
+    int size;
+    struct llist_head inbox;
+    unsigned long long lookahead;
+    unsigned long long kicks; /* kicks sent */
+    unsigned long long processed;
+    unsigned long long digest;
+    unsigned int rand;
+} __attribute__((aligned(64)));
+
+struct dream_bench_pdes
+{
+    struct dream_bench_pdes_level *levels;
+    int depth;
+    int dreamers; /* per level */
+    int workers;
+    unsigned long long end; /* virtual ns */
+    unsigned long long work; /* ns of work per event */
+    unsigned long long window; /* events before it are safe */
+    unsigned long long horizon[2]; /* window being reduced by the workers, by round */
+    unsigned long long earliest[2]; /* earliest event being reduced by the workers, by round */
+    unsigned long long span[2]; /* events of the busiest worker in the window, by round */
+    unsigned long long critical; /* events of the busiest worker summed over the windows */
+    unsigned long windows;
+    unsigned long long processed; /* events of all the levels once the simulation is over */
+    struct dream_barrier barrier;
+};
+
+struct dream_bench_pdes_worker
+{
+    struct dream_bench_pdes *sim;
+    int id;
+    pthread_t thread;
+};
+
+static __inline__ int dream_bench_pdes_before(struct dream_bench_pdes_event *a, struct dream_bench_pdes_event *b)
+{
+    return a->time < b->time || (a->time == b->time && a->key < b->key);
+}
+
+static void dream_bench_pdes_push(struct dream_bench_pdes_level *level, struct dream_bench_pdes_event *event)
+{
+    int child;
+    if(level->events == level->size)
+    {
+        level->size = level->size ? level->size << 1 : 64;
+        level->heap = realloc(level->heap, level->size * sizeof(*level->heap));
+        assert(level->heap != NULL);
+    }
+    child = level->events++;
+    while(child)
+    {
+        int parent = (child - 1) >> 1;
+        if(!dream_bench_pdes_before(event, &level->heap[parent]))
+            break;
+        level->heap[child] = level->heap[parent];
+        child = parent;
+    }
+    level->heap[child] = *event;
+}
+
+static void dream_bench_pdes_pop(struct dream_bench_pdes_level *level, struct dream_bench_pdes_event *event)
+{
+    struct dream_bench_pdes_event *last;
+    int parent = 0;
+    assert(level->events > 0);
+    *event = level->heap[0];
+    last = &level->heap[--level->events];
+    for(;;)
+    {
+        int child = (parent << 1) + 1;
+        if(child >= level->events)
+            break;
+        if(child + 1 < level->events && dream_bench_pdes_before(&level->heap[child + 1], &level->heap[child]))
+            ++child;
+        if(!dream_bench_pdes_before(&level->heap[child], last))
+            break;
+        level->heap[parent] = level->heap[child];
+        parent = child;
+    }
+    level->heap[parent] = *last;
+}
+
+static __inline__ unsigned long long dream_bench_pdes_next(struct dream_bench_pdes_level *level)
+{
+    return level->events ? level->heap[0].time : DREAM_WHEEL_IDLE;
+}
+
+static __inline__ unsigned int dream_bench_pdes_rand(struct dream_bench_pdes_level *level)
+{
+    level->rand ^= level->rand << 13;
+    level->rand ^= level->rand >> 17;
+    level->rand ^= level->rand << 5;
+    return level->rand;
+}
+
+/*
+ * Run an event of a level. A tick arms the next one and kicks an adjacent level one time in four,
+ * a level period out. The kick is queued straight into the heap of a sequential run.
+ */
+static void dream_bench_pdes_run_event(struct dream_bench_pdes *sim, int l, struct dream_bench_pdes_event *event, int sequential)
+{
+    struct dream_bench_pdes_level *level = &sim->levels[l];
+    unsigned long long start = arch_time_ns();
+    unsigned int r;
+    while(arch_time_ns() - start < sim->work);
+    level->digest = (level->digest ^ event->time ^ event->key ^ event->dreamer) * 1000003ULL;
+    ++level->processed;
+    if(event->kick)
+        return;
+    event->time += level->lookahead;
+    if(event->time < sim->end)
+        dream_bench_pdes_push(level, event);
+    r = dream_bench_pdes_rand(level);
+    if(!(r & 3) && sim->depth > 1)
+    {
+        struct dream_bench_pdes_event *kick = calloc(1, sizeof(*kick));
+        int target = (r & 4) ? l + 1 : l - 1;
+        assert(kick != NULL);
+        if(target < 0 || target >= sim->depth)
+            target = l < target ? l - 1 : l + 1;
+        kick->time = event->time;
+        kick->key = ( (unsigned long long)(l + 1) << 56) | (1ULL << 55) | level->kicks++;
+        kick->dreamer = (r >> 3) % sim->dreamers;
+        kick->kick = 1;
+        if(sequential)
+        {
+            dream_bench_pdes_push(&sim->levels[target], kick);
+            free(kick);
+        }
+        else
+            llist_add(&kick->inbox, &sim->levels[target].inbox);
+    }
+}
+
+static void dream_bench_pdes_init(struct dream_bench_pdes *sim, int depth, int dreamers, int workers,
+                           unsigned long long end, unsigned long long work)
+{
+    register int l, i;
+    memset(sim, 0, sizeof(*sim));
+    assert(depth > 0 && depth <= dream_depth);
+    sim->depth = depth;
+    sim->dreamers = dreamers;
+    sim->workers = workers;
+    sim->end = end;
+    sim->work = work;
+    sim->barrier.expected = workers;
+    sim->horizon[0] = sim->horizon[1] = DREAM_WHEEL_IDLE;
+    sim->earliest[0] = sim->earliest[1] = DREAM_WHEEL_IDLE;
+    assert(posix_memalign((void**)&sim->levels, 64, depth * sizeof(*sim->levels)) == 0);
+    memset(sim->levels, 0, depth * sizeof(*sim->levels));
+    sim->window = DREAM_WHEEL_IDLE;
+    for(l = 0; l < depth; ++l)
+    {
+        struct dream_bench_pdes_level *level = &sim->levels[l];
+        llist_init(&level->inbox);
+        level->lookahead = dream_period(l + 1);
+        level->rand = 0x9e3779b9U * (l + 1);
+        /*
+         * Ticks spread over the first period of the level
+         */
+        for(i = 0; i < dreamers; ++i)
+        {
+            struct dream_bench_pdes_event tick = { .time = level->lookahead * i / dreamers,
+                                            .key = ( (unsigned long long)(l + 1) << 56) | i,
+                                            .dreamer = i };
+            dream_bench_pdes_push(level, &tick);
+        }
+        if(dream_bench_pdes_next(level) + level->lookahead < sim->window)
+            sim->window = dream_bench_pdes_next(level) + level->lookahead;
+    }
+}
+
+static unsigned long long dream_bench_pdes_destroy(struct dream_bench_pdes *sim)
+{
+    unsigned long long digest = 0;
+    register int l;
+    for(l = 0; l < sim->depth; ++l)
+    {
+        digest ^= sim->levels[l].digest;
+        sim->processed += sim->levels[l].processed;
+        free(sim->levels[l].heap);
+    }
+    free(sim->levels);
+    return digest;
+}
+
+static void dream_bench_pdes_min(unsigned long long *min, unsigned long long val)
+{
+    unsigned long long cur = __atomic_load_n(min, __ATOMIC_RELAXED);
+    while(val < cur
+          &&
+          !__atomic_compare_exchange_n(min, &cur, val, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void dream_bench_pdes_max(unsigned long long *max, unsigned long long val)
+{
+    unsigned long long cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while(val > cur
+          &&
+          !__atomic_compare_exchange_n(max, &cur, val, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void *dream_bench_pdes_worker(void *arg)
+{
+    struct dream_bench_pdes_worker *worker = arg;
+    struct dream_bench_pdes *sim = worker->sim;
+    unsigned long long window = sim->window;
+    int round;
+    for(round = 0; ; ++round)
+    {
+        unsigned long long events = 0;
+        int slot = round & 1;
+        register int l;
+        for(l = worker->id; l < sim->depth; l += sim->workers)
+        {
+            struct dream_bench_pdes_level *level = &sim->levels[l];
+            struct dream_bench_pdes_event event;
+            while(dream_bench_pdes_next(level) < window)
+            {
+                dream_bench_pdes_pop(level, &event);
+                dream_bench_pdes_run_event(sim, l, &event, 0);
+                ++events;
+            }
+        }
+        dream_bench_pdes_max(&sim->span[slot], events);
+        dream_barrier_wait(&sim->barrier);
+        for(l = worker->id; l < sim->depth; l += sim->workers)
+        {
+            struct dream_bench_pdes_level *level = &sim->levels[l];
+            struct llist_node *iter = llist_del_all(&level->inbox);
+            unsigned long long next;
+            while(iter)
+            {
+                struct dream_bench_pdes_event *kick = LIST_ENTRY(iter, struct dream_bench_pdes_event, inbox);
+                iter = iter->next;
+                dream_bench_pdes_push(level, kick);
+                free(kick);
+            }
+            next = dream_bench_pdes_next(level);
+            dream_bench_pdes_min(&sim->earliest[slot], next);
+            if(next != DREAM_WHEEL_IDLE)
+                dream_bench_pdes_min(&sim->horizon[slot], next + level->lookahead);
+        }
+        dream_barrier_wait(&sim->barrier);
+        window = __atomic_load_n(&sim->horizon[slot], __ATOMIC_RELAXED);
+        if(__atomic_load_n(&sim->earliest[slot], __ATOMIC_RELAXED) == DREAM_WHEEL_IDLE)
+            break;
+        if(!worker->id)
+        {
+            /*
+             * Nobody touches the other slot before the next round of the barrier
+             */
+            sim->horizon[slot ^ 1] = sim->earliest[slot ^ 1] = DREAM_WHEEL_IDLE;
+            sim->critical += sim->span[slot];
+            sim->span[slot ^ 1] = 0;
+            ++sim->windows;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Run the simulation over the workers. Returns the digest of the events of all the levels.
+ */
+static unsigned long long dream_bench_pdes_run(struct dream_bench_pdes *sim)
+{
+    struct dream_bench_pdes_worker *workers = calloc(sim->workers, sizeof(*workers));
+    register int i;
+    assert(workers != NULL);
+    for(i = 0; i < sim->workers; ++i)
+    {
+        workers[i].sim = sim;
+        workers[i].id = i;
+        assert(pthread_create(&workers[i].thread, NULL, dream_bench_pdes_worker, &workers[i]) == 0);
+    }
+    for(i = 0; i < sim->workers; ++i)
+        pthread_join(workers[i].thread, NULL);
+    free(workers);
+    return dream_bench_pdes_destroy(sim);
+}
+
+/*
+ * The same simulation in one thread with a single event order over all the levels.
+ */
+static unsigned long long dream_bench_pdes_run_sequential(struct dream_bench_pdes *sim)
+{
+    for(;;)
+    {
+        struct dream_bench_pdes_event event;
+        int next = -1;
+        register int l;
+        for(l = 0; l < sim->depth; ++l)
+        {
+            if(sim->levels[l].events
+               &&
+               (next < 0 || dream_bench_pdes_before(&sim->levels[l].heap[0], &sim->levels[next].heap[0])))
+                next = l;
+        }
+        if(next < 0)
+            break;
+        dream_bench_pdes_pop(&sim->levels[next], &event);
+        dream_bench_pdes_run_event(sim, next, &event, 1);
+    }
+    return dream_bench_pdes_destroy(sim);
+}
+
+/*
+ * Parallel simulation of the levels over a growing number of workers against the sequential one
+ * with a single event order. The digests of the events have to match.
+ * Parallelism is the speedup the windows allow with a core per worker: all the events over
+ * the events of the busiest worker summed over the windows.
+ */
+#define DREAM_BENCH_PDES_END (64 * 1000000000ULL) /* ns of virtual time */
+#define DREAM_BENCH_PDES_WORK (2000) /* ns of work per event */
+
+static void dream_bench_pdes(void)
+{
+    static const int casts[] = { DREAMERS, 64, 512 };
+    register int c;
+    output("[%d] levels for [%llu] s of virtual time, [%llu] ns of work per event, [%ld] cpus online\n",
+           dream_depth, DREAM_BENCH_PDES_END/1000000000ULL, (unsigned long long)DREAM_BENCH_PDES_WORK,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    output("%8s %10s %10s %10s %12s %10s %12s\n", "dreamers", "workers", "events", "windows", "ms", "speedup",
+           "parallelism");
+    for(c = 0; c < sizeof(casts)/sizeof(casts[0]); ++c)
+    {
+        struct dream_bench_pdes sim;
+        unsigned long long start, sequential, digest;
+        int workers;
+        dream_bench_pdes_init(&sim, dream_depth, casts[c], 1, DREAM_BENCH_PDES_END, DREAM_BENCH_PDES_WORK);
+        start = arch_time_ns();
+        digest = dream_bench_pdes_run_sequential(&sim);
+        sequential = arch_time_ns() - start;
+        output("%8d %10s %10llu %10s %12.1f %10.2f %12.2f\n", casts[c], "sequential", sim.processed, "-",
+               (double)sequential/1000000, 1.0, 1.0);
+        for(workers = 1; workers <= dream_depth; workers <<= 1)
+        {
+            unsigned long long elapsed;
+            dream_bench_pdes_init(&sim, dream_depth, casts[c], workers, DREAM_BENCH_PDES_END, DREAM_BENCH_PDES_WORK);
+            start = arch_time_ns();
+            assert(dream_bench_pdes_run(&sim) == digest);
+            elapsed = arch_time_ns() - start;
+            output("%8d %10d %10llu %10lu %12.1f %10.2f %12.2f\n", casts[c], workers, sim.processed, sim.windows,
+                   (double)elapsed/1000000, (double)sequential/elapsed, (double)sim.processed/sim.critical);
+        }
+    }
+}
+
+static struct dream_bench dream_benches[] = {
+    { "pool", "request pool against calloc/free", dream_bench_pool },
+    { "kick", "kick delivery latency behind a flooded mailbox", dream_bench_kick },
+    { "coalesce", "repeated idempotent commands with and without coalescing", dream_bench_coalesce },
+    { "dispatch", "request dispatch table against if/else chains", dream_bench_dispatch },
+    { "join", "latency from a dreamer joining a level to its discovery", dream_bench_join },
+    { "barrier", "latency from the last arrival at a level barrier to all waiters running", dream_bench_barrier },
+    { "periodic", "drift of a periodic request loop with restarted and kept deadlines", dream_bench_periodic },
+    { "scale", "registry, kick and state scan paths against the cast size", dream_bench_scale },
+    { "wheel", "periodic commands to many dreamers with timed waits and with the timer wheel", dream_bench_wheel },
+    { "executor", "projections with a thread each against tasks on the work stealing executor", dream_bench_executor },
+    { "coroutine", "hand offs between dreamers as threads and as coroutines on a carrier", dream_bench_fiber },
+    { "threads", "level transitions on new threads against the thread cache, latency and footprint", dream_bench_threads },
+    { "placement", "message latency between the levels of a dreamer under each cpu placement policy", dream_bench_placement },
+    { "pdes", "PDES micro-benchmark on a synthetic model of the levels against the sequential run", dream_bench_pdes },
+    { "depth", "descent and kick propagation against the depth of the dream", dream_bench_depth },
+};
+
+static void dream_bench_list(void)
+{
+    register int i;
+    for(i = 0; i < sizeof(dream_benches)/sizeof(dream_benches[0]); ++i)
+        output("\n      %-10s %s", dream_benches[i].name, dream_benches[i].desc);
+}
+
+static int dream_bench_run(const char *name)
+{
+    register int i;
+    for(i = 0; i < sizeof(dream_benches)/sizeof(dream_benches[0]); ++i)
+    {
+        if(!strcasecmp(dream_benches[i].name, name))
+        {
+            dream_benches[i].run();
+            return 0;
+        }
+    }
+    output("Unknown benchmark [%s]\n", name);
+    return 1;
+}
@@ -80,6 +80,22 @@ static __inline__ void list_init(struct list_head *list)
     list->nodes = 0;
 }
 
+/*
+ * Move all the elements of src to the tail of dst in O(1) leaving src empty.
+ */
+static __inline__ void list_splice_tail(struct list_head *src, struct list_head *dst)
+{
+    assert(src);
+    assert(dst);
+    assert(dst->tail);
+    if(!src->head)
+        return;
+    *(src->head->pprev = dst->tail) = src->head;
+    dst->tail = src->tail;
+    dst->nodes += src->nodes;
+    list_init(src);
+}
+
 #define LIST_ENTRY(element, cast, field)                                \
     (cast*) ( (unsigned char*)element - (unsigned long)&(((cast*)0)->field) )
 
@@ -0,0 +1,90 @@
+#ifndef _LLIST_H_
+#define _LLIST_H_
+
+/*
+ * Lock-less singly linked list for multiple producers and a single consumer.
+ * Producers push with llist_add from any thread without a lock.
+ * The consumer detaches the whole chain at once with llist_del_all,
+ * which returns the entries in LIFO order (use llist_reverse_order for FIFO).
+ */
+
+#include <assert.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct llist_node
+{
+    struct llist_node *next;
+};
+
+struct llist_head
+{
+    struct llist_node *first;
+};
+
+#define LLIST_DECLARE(l) \
+    struct llist_head l = { .first = NULL }
+
+static __inline__ void llist_init(struct llist_head *list)
+{
+    assert(list);
+    __atomic_store_n(&list->first, NULL, __ATOMIC_RELAXED);
+}
+
+static __inline__ int llist_empty(struct llist_head *list)
+{
+    return __atomic_load_n(&list->first, __ATOMIC_ACQUIRE) == NULL;
+}
+
+/*
+ * Splice a chain of entries from new_first to new_last in one shot.
+ * Returns 1 if the list was empty before the add, so the caller can wake up the consumer
+ * only on the empty to non-empty transition.
+ */
+static __inline__ int llist_add_batch(struct llist_node *new_first, struct llist_node *new_last,
+                                      struct llist_head *list)
+{
+    struct llist_node *first;
+    assert(new_first);
+    assert(new_last);
+    assert(list);
+    first = __atomic_load_n(&list->first, __ATOMIC_RELAXED);
+    do
+    {
+        new_last->next = first;
+    } while(!__atomic_compare_exchange_n(&list->first, &first, new_first, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return first == NULL;
+}
+
+static __inline__ int llist_add(struct llist_node *element, struct llist_head *list)
+{
+    return llist_add_batch(element, element, list);
+}
+
+static __inline__ struct llist_node *llist_del_all(struct llist_head *list)
+{
+    assert(list);
+    return __atomic_exchange_n(&list->first, NULL, __ATOMIC_ACQUIRE);
+}
+
+static __inline__ struct llist_node *llist_reverse_order(struct llist_node *head)
+{
+    struct llist_node *reversed = NULL;
+    while(head)
+    {
+        struct llist_node *next = head->next;
+        head->next = reversed;
+        reversed = head;
+        head = next;
+    }
+    return reversed;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif